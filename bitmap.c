@@ -0,0 +1,441 @@
+#include "bitmap.h"
+#include "fsStats.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Free block bitmap and the allocator that searches it.
+//
+// A set bit means the block is in use.  Searches move a 64-bit word at a
+// time: all-ones words are skipped (several per instruction where SIMD is
+// available) and count-trailing-zeros finds the free bit inside a word.
+// regionfree[] keeps the number of free blocks in every REGION_BITS slice
+// so completely full slices are skipped without looking at their words.
+// The bitmap spans as many blocks as the disk needs; the ones changed
+// since the last bitmapflush() are remembered in dirtyblocks[] and counted.
+//
+// Allocation needs no lock.  Searches read the words as they are, and a
+// found run is then claimed a word at a time with compare-and-swap; if
+// another thread took any of it first, the words already claimed are
+// given back and the search starts over.  The zone cursors are only
+// hints, so racing updates to them do no harm.
+// How many words and region counts a search looked at is added up per
+// thread and handed to statsalloc() once the allocation is done.
+//
+// A disk mounted after a clean close gets its bitmap lazily: nothing is
+// read at mount, and each bitmap block is read the first time a word of
+// it is looked at, so mounting a large disk costs the same as a small
+// one.  Until then the block's words and region counts mean nothing;
+// every access goes through bitmapfault() first, which is one load once
+// all blocks are in.
+
+uint64_t *freeblocks = NULL;
+uint64_t bitmapwords = 0;
+static uint32_t *regionfree = NULL;
+static uint8_t *dirtyblocks = NULL;
+static uint64_t ndirtyblocks = 0;   // blocks marked in dirtyblocks[]
+static uint64_t bitmapstart = 0;
+static uint64_t bitmapbits = 0;
+static uint8_t *loaded = NULL;      // per bitmap block: its words are those on disk
+static uint64_t unloaded = 0;       // bitmap blocks not read yet
+static int lazyhandle = -1;         // disk they are read from
+static pthread_mutex_t loadlock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint64_t scanned = 0;
+
+static inline uint64_t bitmask(uint64_t n) {
+  return 1ULL << (n % 64);
+}
+
+// bits past the end of the disk are never handed out
+static void markpastend(void) {
+  for (uint64_t n = bitmapbits; n < bitmapwords * 64; n++) {
+    freeblocks[n / 64] |= bitmask(n);
+  }
+}
+
+// rebuilds the free counts of the regions in words [from, to)
+static void countregions(uint64_t from, uint64_t to) {
+  for (uint64_t r = from / REGION_WORDS; r < to / REGION_WORDS; r++) {
+    uint32_t used = 0;
+    for (uint64_t w = r * REGION_WORDS; w < (r + 1) * REGION_WORDS; w++) {
+      used += __builtin_popcountll(freeblocks[w]);
+    }
+    regionfree[r] = REGION_BITS - used;
+  }
+}
+
+static void loadblock(uint64_t b) {
+  pthread_mutex_lock(&loadlock);
+  if (!loaded[b]) {
+    uint64_t *words = &freeblocks[b * BITMAP_WORDS];
+    if (rawreadblock(lazyhandle, bitmapstart + b, words) < 0) {
+      // what cannot be read is never handed out
+      FSLOG(FSLOG_ERROR, "could not read bitmap block %ld\n", b);
+      memset(words, 0xff, BLOCK_SIZE);
+    }
+    if ((b + 1) * BITMAP_WORDS == bitmapwords) {
+      markpastend();
+    }
+    countregions(b * BITMAP_WORDS, (b + 1) * BITMAP_WORDS);
+    __atomic_store_n(&loaded[b], 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&unloaded, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&loadlock);
+}
+
+// makes sure the bitmap block holding word w has been read
+static inline void bitmapfault(uint64_t w) {
+  if (__atomic_load_n(&unloaded, __ATOMIC_ACQUIRE) != 0 &&
+      !__atomic_load_n(&loaded[w / BITMAP_WORDS], __ATOMIC_ACQUIRE)) {
+    loadblock(w / BITMAP_WORDS);
+  }
+}
+
+// searches read words and counts other threads may be changing; the
+// claim that follows a search is what settles who gets a block
+static inline uint64_t bitmapword(uint64_t w) {
+  bitmapfault(w);
+  return __atomic_load_n(&freeblocks[w], __ATOMIC_RELAXED);
+}
+
+static inline uint32_t regionfreecount(uint64_t r) {
+  bitmapfault(r * REGION_WORDS);
+  return __atomic_load_n(&regionfree[r], __ATOMIC_RELAXED);
+}
+
+int checkbitset(int n) {
+  // n is the number of the bit we want to check is set
+  // returns true if the block is in use
+  return (bitmapword(n / 64) & bitmask(n)) != 0;
+}
+
+// sets or clears count bits starting at start, a word at a time.
+// Setting is a claim: it only succeeds if every bit was clear, and
+// otherwise changes nothing and returns false.
+static bool setrange(uint64_t start, uint64_t count, bool used) {
+  uint64_t n = start;
+  uint64_t end = start + count;
+  while (n < end) {
+    uint64_t w = n / 64;
+    uint64_t off = n % 64;
+    uint64_t bits = end - n < 64 - off ? end - n : 64 - off;
+    uint64_t mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << off;
+    uint64_t old = bitmapword(w);
+    uint64_t new;
+    do {
+      if (used && (old & mask) != 0) {
+        // another thread got here first
+        if (n > start) {
+          setrange(start, n - start, false);
+        }
+        return false;
+      }
+      new = used ? old | mask : old & ~mask;
+    } while (!__atomic_compare_exchange_n(&freeblocks[w], &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if (!__atomic_exchange_n(&dirtyblocks[w / BITMAP_WORDS], 1, __ATOMIC_ACQ_REL)) {
+      __atomic_fetch_add(&ndirtyblocks, 1, __ATOMIC_RELAXED);
+    }
+    if (used) {
+      __atomic_fetch_sub(&regionfree[w / REGION_WORDS], bits, __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_add(&regionfree[w / REGION_WORDS], __builtin_popcountll(old & mask), __ATOMIC_RELAXED);
+    }
+    n += bits;
+  }
+  return true;
+}
+
+void setbit(int n) {
+  setrange(n, 1, true);
+}
+
+void clearbit(int n) {
+  setrange(n, 1, false);
+}
+
+void bitmapfree(uint64_t start, uint64_t count) {
+  setrange(start, count, false);
+}
+
+int bitmapsetup(uint64_t nbits, uint64_t startblock) {
+  // sizes the in-memory bitmap for a disk of nbits blocks whose bitmap
+  // starts at block startblock; every bit starts out clear
+  uint64_t nblocks = (nbits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+  free(freeblocks);
+  free(regionfree);
+  free(dirtyblocks);
+  free(loaded);
+  bitmapwords = nblocks * BITMAP_WORDS;
+  bitmapstart = startblock;
+  bitmapbits = nbits;
+  unloaded = 0;
+  freeblocks = calloc(bitmapwords, sizeof(uint64_t));
+  regionfree = calloc(bitmapwords / REGION_WORDS, sizeof(uint32_t));
+  dirtyblocks = calloc(nblocks, 1);
+  loaded = malloc(nblocks);
+  if (freeblocks == NULL || regionfree == NULL || dirtyblocks == NULL || loaded == NULL) {
+    FSLOG(FSLOG_ERROR, "could not allocate bitmap for %ld blocks\n", nbits);
+    bitmapwords = 0;
+    return -1;
+  }
+  markpastend();
+  bitmapinit();
+  memset(dirtyblocks, 1, nblocks);
+  ndirtyblocks = nblocks;
+  memset(loaded, 1, nblocks);
+  return 0;
+}
+
+int bitmapload(int handle, bool lazy) {
+  // fills the bitmap bitmapsetup() sized with what is on the disk: all of
+  // it now, in one read, or if lazy each block when it is first needed
+  uint64_t nblocks = bitmapwords / BITMAP_WORDS;
+  memset(dirtyblocks, 0, nblocks);
+  ndirtyblocks = 0;
+  if (lazy) {
+    lazyhandle = handle;
+    memset(loaded, 0, nblocks);
+    __atomic_store_n(&unloaded, nblocks, __ATOMIC_RELEASE);
+    return 0;
+  }
+  if (rawreadblocks(handle, bitmapstart, nblocks, freeblocks) < 0) {
+    FSLOG(FSLOG_ERROR, "could not read the bitmap\n");
+    return -1;
+  }
+  markpastend();
+  bitmapinit();
+  return 0;
+}
+
+uint64_t bitmapunloaded(void) {
+  return __atomic_load_n(&unloaded, __ATOMIC_RELAXED);
+}
+
+int bitmapflush(int handle) {
+  // writes every bitmap block changed since the last flush, a batch at a time
+  uint64_t blocknums[64];
+  void *buffers[64];
+  uint64_t n = 0;
+  for (uint64_t b = 0; b < bitmapwords / BITMAP_WORDS; b++) {
+    // a block changed again while it is written is marked again
+    if (__atomic_exchange_n(&dirtyblocks[b], 0, __ATOMIC_ACQ_REL)) {
+      __atomic_fetch_sub(&ndirtyblocks, 1, __ATOMIC_RELAXED);
+      blocknums[n] = bitmapstart + b;
+      buffers[n++] = &freeblocks[b * BITMAP_WORDS];
+    }
+    if (n == countof(blocknums) || (n > 0 && b + 1 == bitmapwords / BITMAP_WORDS)) {
+      if (writeblocks(handle, blocknums, buffers, n) < 0) {
+        return -1;
+      }
+      n = 0;
+    }
+  }
+  return 0;
+}
+
+uint64_t bitmapdirtycount(void) {
+  // bitmap blocks the next bitmapflush() will write
+  return __atomic_load_n(&ndirtyblocks, __ATOMIC_RELAXED);
+}
+
+void bitmapinit(void) {
+  // rebuilds the region summary after the bitmap was loaded or reset
+  countregions(0, bitmapwords);
+}
+
+uint64_t bitmapcountfree(uint64_t from, uint64_t to) {
+  uint64_t count = 0;
+  uint64_t n = from;
+  while (n < to) {
+    uint64_t r = n / REGION_BITS;
+    if (n % REGION_BITS == 0 && n + REGION_BITS <= to) {
+      count += regionfreecount(r);
+      n += REGION_BITS;
+      continue;
+    }
+    if (!checkbitset(n)) {
+      count++;
+    }
+    n++;
+  }
+  return count;
+}
+
+// index of the first word in [w, end) that is not all ones, or end
+static uint64_t firstnotfull(uint64_t w, uint64_t end) {
+  uint64_t from = w;
+  // [w, end) lies inside one region, so inside one bitmap block
+  if (w < end) {
+    bitmapfault(w);
+  }
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  for (; w + 4 <= end; w += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) &freeblocks[w]);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, ones)) != -1) {
+      break;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi32(-1);
+  for (; w + 2 <= end; w += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i*) &freeblocks[w]);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, ones)) != 0xFFFF) {
+      break;
+    }
+  }
+#endif
+  while (w < end && bitmapword(w) == ~0ULL) {
+    w++;
+  }
+  scanned += w - from;
+  return w;
+}
+
+// first free bit in [from, to), or -1
+static int64_t findfree(uint64_t from, uint64_t to) {
+  uint64_t n = from;
+  while (n < to) {
+    scanned++;
+    uint64_t w = n / 64;
+    uint64_t r = w / REGION_WORDS;
+    if (regionfreecount(r) == 0) {
+      n = (r + 1) * REGION_BITS;
+      continue;
+    }
+    // bits below n in the first word do not count
+    uint64_t word = bitmapword(w) | (bitmask(n) - 1);
+    if (word == ~0ULL) {
+      uint64_t regionend = (r + 1) * REGION_WORDS;
+      w = firstnotfull(w + 1, regionend);
+      if (w == regionend) {
+        n = w * 64;
+        continue;
+      }
+      word = bitmapword(w);
+    }
+    uint64_t bit = w * 64 + __builtin_ctzll(~word);
+    return bit < to ? (int64_t) bit : -1;
+  }
+  return -1;
+}
+
+// length of the free run starting at n, capped at max and at to
+static uint64_t freerunat(uint64_t n, uint64_t to, uint64_t max) {
+  uint64_t limit = to - n < max ? to - n : max;
+  uint64_t len = 0;
+  while (len < limit) {
+    scanned++;
+    uint64_t pos = n + len;
+    uint64_t used = bitmapword(pos / 64) >> (pos % 64);
+    if (used == 0) {
+      len += 64 - pos % 64;
+      continue;
+    }
+    len += __builtin_ctzll(used);
+    break;
+  }
+  return len < limit ? len : limit;
+}
+
+// where the zone's next search starts
+static uint64_t zonecursor(struct bitmapzone *zone) {
+  uint64_t cursor = __atomic_load_n(&zone->cursor, __ATOMIC_RELAXED);
+  return cursor >= zone->from && cursor < zone->to ? cursor : zone->from;
+}
+
+static void zonemoved(struct bitmapzone *zone, uint64_t cursor) {
+  __atomic_store_n(&zone->cursor, cursor, __ATOMIC_RELAXED);
+}
+
+// Looks for a free run of want blocks: at goal first, then next-fit from
+// the zone's cursor.  Returns the longest run seen if none is long enough.
+static uint64_t searchrun(struct bitmapzone *zone, uint64_t goal, uint64_t want, uint64_t *got) {
+  uint64_t best = 0;
+  uint64_t bestlen = 0;
+
+  if (goal >= zone->from && goal < zone->to && !checkbitset(goal)) {
+    best = goal;
+    bestlen = freerunat(goal, zone->to, want);
+  }
+
+  uint64_t cursor = zonecursor(zone);
+  uint64_t spans[2][2] = { { cursor, zone->to }, { zone->from, cursor } };
+  for (int s = 0; s < 2 && bestlen < want; s++) {
+    uint64_t n = spans[s][0];
+    while (n < spans[s][1] && bestlen < want) {
+      int64_t start = findfree(n, spans[s][1]);
+      if (start < 0) {
+        break;
+      }
+      uint64_t len = freerunat(start, zone->to, want);
+      if (len > bestlen) {
+        best = start;
+        bestlen = len;
+      }
+      n = start + len;
+    }
+  }
+  *got = bestlen;
+  return best;
+}
+
+int64_t bitmapalloc(struct bitmapzone *zone, uint64_t goal) {
+  int64_t bit;
+  do {
+    if (goal >= zone->from && goal < zone->to && !checkbitset(goal)) {
+      bit = goal;
+    } else {
+      uint64_t cursor = zonecursor(zone);
+      bit = findfree(cursor, zone->to);
+      if (bit < 0) {
+        bit = findfree(zone->from, cursor);
+      }
+    }
+    if (bit < 0) {
+      statsalloc(0, scanned);
+      scanned = 0;
+      return -1;
+    }
+  } while (!setrange(bit, 1, true));
+  zonemoved(zone, bit + 1);
+  statsalloc(1, scanned);
+  scanned = 0;
+  return bit;
+}
+
+uint64_t bitmapallocrun(struct bitmapzone *zone, uint64_t goal, uint64_t want, uint64_t *got) {
+  // claims up to want contiguous blocks; returns the first one, or 0 if
+  // the zone is full, and the number claimed in got
+  uint64_t start;
+  do {
+    start = searchrun(zone, goal, want, got);
+    if (*got == 0) {
+      statsalloc(0, scanned);
+      scanned = 0;
+      return 0;
+    }
+  } while (!setrange(start, *got, true));
+  zonemoved(zone, start + *got);
+  statsalloc(*got, scanned);
+  scanned = 0;
+  return start;
+}
+
+int64_t bitmapalloccontig(struct bitmapzone *zone, uint64_t goal, uint64_t count) {
+  // claims exactly count contiguous blocks, or nothing
+  uint64_t got = 0;
+  uint64_t start;
+  do {
+    start = searchrun(zone, goal, count, &got);
+    if (count == 0 || got < count) {
+      statsalloc(0, scanned);
+      scanned = 0;
+      return -1;
+    }
+  } while (!setrange(start, count, true));
+  zonemoved(zone, start + count);
+  statsalloc(count, scanned);
+  scanned = 0;
+  return start;
+}
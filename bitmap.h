@@ -0,0 +1,33 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "fsHelpers.h"
+
+#define BITMAP_WORDS (BLOCK_SIZE / sizeof(uint64_t))   /* words per bitmap block */
+#define REGION_WORDS 8              /* bitmap words summarised by one free count */
+#define REGION_BITS (REGION_WORDS * 64)
+
+// A range of blocks handed out by the same allocator, with the next-fit
+// cursor that remembers where the last allocation in it ended.
+struct bitmapzone {
+    uint64_t from;          /* first block in the zone */
+    uint64_t to;            /* one past the last block */
+    uint64_t cursor;        /* where the next search starts */
+};
+
+extern uint64_t *freeblocks;
+extern uint64_t bitmapwords;
+
+int bitmapsetup(uint64_t nbits, uint64_t startblock);
+int bitmapload(int handle, bool lazy);
+uint64_t bitmapunloaded(void);
+void bitmapinit(void);
+int bitmapflush(int handle);
+uint64_t bitmapdirtycount(void);
+uint64_t bitmapcountfree(uint64_t from, uint64_t to);
+int64_t bitmapalloc(struct bitmapzone *zone, uint64_t goal);
+uint64_t bitmapallocrun(struct bitmapzone *zone, uint64_t goal, uint64_t want, uint64_t *got);
+int64_t bitmapalloccontig(struct bitmapzone *zone, uint64_t goal, uint64_t count);
+void bitmapfree(uint64_t start, uint64_t count);
+
+#endif
@@ -0,0 +1,366 @@
+#include "blockCache.h"
+#include "journal.h"
+
+// A fixed number of block buffers sit in front of the disk.
+// Lookups go through a small hash table keyed on (handle, block number),
+// and the CLOCK algorithm picks which buffer to recycle on a miss.
+// Writes only dirty the buffer; dirty buffers reach the disk when they
+// are evicted or when cacheflush() runs from syncdisk()/closedisk().
+// While a disk is journaled its dirty buffers belong to the running
+// transaction and are pinned until journalcommit() writes them home;
+// nothing here writes them itself.  txnbegin() keeps a transaction
+// smaller than the cache, so a cache full of pinned buffers is an error
+// rather than a reason to commit half an operation.  One mutex covers
+// the table.
+
+struct cacheentry {
+  uint64_t blocknum;
+  int handle;
+  bool valid;
+  bool dirty;
+  bool referenced;     // second-chance bit for the clock hand
+  uint64_t gen;        // bumped by every write, see cachemarkclean()
+  int64_t next;        // next entry in the same hash bucket, -1 terminates
+  uint8_t *data;
+};
+
+static struct cacheentry *entries = NULL;
+static int64_t *buckets = NULL;
+static uint64_t nentries = 0;
+static uint64_t nbuckets = 0;
+static uint64_t hand = 0;
+static uint64_t ndirty = 0;
+static struct cachestats stats;
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hashblock(int handle, uint64_t blocknum) {
+  uint64_t h = blocknum * 0x9E3779B97F4A7C15ULL + (uint64_t) handle;
+  return (h ^ (h >> 29)) & (nbuckets - 1);
+}
+
+static int cacheresize(uint64_t nblocks) {
+  // resizing drops every buffer, so write the dirty ones out first;
+  // a running transaction's buffers cannot be, so it has to commit first
+  for (uint64_t i = 0; i < nentries; i++) {
+    if (entries[i].valid && entries[i].dirty && journalactive(entries[i].handle)) {
+      FSLOG(FSLOG_ERROR, "cannot resize the block cache during a transaction\n");
+      return -1;
+    }
+  }
+  for (uint64_t i = 0; i < nentries; i++) {
+    if (entries[i].valid && entries[i].dirty) {
+      if (rawwriteblock(entries[i].handle, entries[i].blocknum, entries[i].data) < 0) {
+        return -1;
+      }
+      stats.writebacks++;
+    }
+    free(entries[i].data);
+  }
+  free(entries);
+  free(buckets);
+  entries = NULL;
+  buckets = NULL;
+  nentries = 0;
+  ndirty = 0;
+
+  if (nblocks == 0) {
+    return 0;
+  }
+
+  nbuckets = 1;
+  while (nbuckets < nblocks * 2) {
+    nbuckets <<= 1;
+  }
+  entries = calloc(nblocks, sizeof(struct cacheentry));
+  buckets = malloc(nbuckets * sizeof(int64_t));
+  if (entries == NULL || buckets == NULL) {
+    FSLOG(FSLOG_ERROR, "could not allocate block cache of %ld blocks\n", nblocks);
+    free(entries);
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+    return -1;
+  }
+  for (uint64_t i = 0; i < nbuckets; i++) {
+    buckets[i] = -1;
+  }
+  for (uint64_t i = 0; i < nblocks; i++) {
+    entries[i].data = malloc(BLOCK_SIZE);
+    entries[i].next = -1;
+    assert(entries[i].data != NULL);
+  }
+  nentries = nblocks;
+  hand = 0;
+  stats.capacity = nblocks;
+  return 0;
+}
+
+int cachesetsize(uint64_t nblocks) {
+  pthread_mutex_lock(&cachelock);
+  int result = cacheresize(nblocks);
+  pthread_mutex_unlock(&cachelock);
+  return result;
+}
+
+static int64_t cachelookup(int handle, uint64_t blocknum) {
+  for (int64_t i = buckets[hashblock(handle, blocknum)]; i >= 0; i = entries[i].next) {
+    if (entries[i].blocknum == blocknum && entries[i].handle == handle) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void cacheunlink(int64_t idx) {
+  int64_t *link = &buckets[hashblock(entries[idx].handle, entries[idx].blocknum)];
+  while (*link != idx) {
+    link = &entries[*link].next;
+  }
+  *link = entries[idx].next;
+  entries[idx].next = -1;
+  entries[idx].valid = false;
+}
+
+// run the clock hand until it finds a buffer whose reference bit is clear,
+// writing it back if it is dirty; returns -1 if every buffer is pinned
+static int64_t cachevictim(void) {
+  uint64_t scanned = 0;
+  for (;;) {
+    struct cacheentry *e = &entries[hand];
+    int64_t idx = hand;
+    hand = (hand + 1) % nentries;
+
+    if (!e->valid) {
+      return idx;
+    }
+    if (scanned++ > 2 * nentries) {
+      FSLOG(FSLOG_ERROR, "every block buffer is pinned by a transaction\n");
+      return -1;
+    }
+    if (e->referenced) {
+      e->referenced = false;
+      continue;
+    }
+    if (e->dirty) {
+      if (journalactive(e->handle)) {
+        continue;
+      }
+      if (rawwriteblock(e->handle, e->blocknum, e->data) < 0) {
+        return -1;
+      }
+      e->dirty = false;
+      ndirty--;
+      stats.writebacks++;
+    }
+    cacheunlink(idx);
+    stats.evictions++;
+    return idx;
+  }
+}
+
+static int64_t cacheinsert(int handle, uint64_t blocknum) {
+  int64_t idx = cachevictim();
+  if (idx < 0) {
+    return -1;
+  }
+  struct cacheentry *e = &entries[idx];
+  uint64_t b = hashblock(handle, blocknum);
+  e->handle = handle;
+  e->blocknum = blocknum;
+  e->valid = true;
+  e->dirty = false;
+  e->referenced = true;
+  e->next = buckets[b];
+  buckets[b] = idx;
+  return idx;
+}
+
+// finds the buffer of a block, or takes one for it with *hit false;
+// called with cachelock held
+static int64_t cacheget(int handle, uint64_t blocknum, bool *hit) {
+  *hit = false;
+  if (nentries == 0 && cacheresize(CACHE_DEFAULT_BLOCKS) < 0) {
+    return -1;
+  }
+  int64_t idx = cachelookup(handle, blocknum);
+  *hit = idx >= 0;
+  if (idx >= 0) {
+    return idx;
+  }
+  return cacheinsert(handle, blocknum);
+}
+
+int cacheread(int handle, uint64_t blocknum, void *buffer) {
+  pthread_mutex_lock(&cachelock);
+  bool hit;
+  int result = 0;
+  int64_t idx = cacheget(handle, blocknum, &hit);
+  if (hit) {
+    stats.hits++;
+    entries[idx].referenced = true;
+    memcpy(buffer, entries[idx].data, BLOCK_SIZE);
+  } else if (idx < 0) {
+    stats.misses++;
+    result = rawreadblock(handle, blocknum, buffer);
+  } else {
+    stats.misses++;
+    if (rawreadblock(handle, blocknum, entries[idx].data) < 0) {
+      cacheunlink(idx);
+      result = -1;
+    } else {
+      memcpy(buffer, entries[idx].data, BLOCK_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&cachelock);
+  return result;
+}
+
+int cachewrite(int handle, uint64_t blocknum, void *buffer) {
+  // a full-block write never needs the old contents, so a miss costs no read
+  pthread_mutex_lock(&cachelock);
+  bool hit;
+  int64_t idx = cacheget(handle, blocknum, &hit);
+  if (hit) {
+    stats.hits++;
+  } else {
+    stats.misses++;
+  }
+  if (idx < 0) {
+    // a journaled block may only reach its home through a commit
+    pthread_mutex_unlock(&cachelock);
+    return journalactive(handle) ? -1 : rawwriteblock(handle, blocknum, buffer);
+  }
+  memcpy(entries[idx].data, buffer, BLOCK_SIZE);
+  if (!entries[idx].dirty) {
+    entries[idx].dirty = true;
+    ndirty++;
+  }
+  entries[idx].gen++;
+  entries[idx].referenced = true;
+  pthread_mutex_unlock(&cachelock);
+  return 0;
+}
+
+int cacheflush(int handle) {
+  // the dirty buffers of a journaled disk are the running transaction's,
+  // and only journalcommit() writes those
+  if (journalactive(handle)) {
+    return cachedirtycount(handle) > 0 ? -1 : 0;
+  }
+  pthread_mutex_lock(&cachelock);
+  int result = 0;
+  for (uint64_t i = 0; i < nentries; i++) {
+    struct cacheentry *e = &entries[i];
+    if (e->valid && e->dirty && e->handle == handle) {
+      if (rawwriteblock(handle, e->blocknum, e->data) < 0) {
+        result = -1;
+        continue;
+      }
+      e->dirty = false;
+      ndirty--;
+      stats.writebacks++;
+    }
+  }
+  pthread_mutex_unlock(&cachelock);
+  return result;
+}
+
+bool cachecontains(int handle, uint64_t blocknum) {
+  pthread_mutex_lock(&cachelock);
+  bool found = nentries > 0 && cachelookup(handle, blocknum) >= 0;
+  pthread_mutex_unlock(&cachelock);
+  return found;
+}
+
+void cachemarkclean(int handle, uint64_t blocknum, uint64_t gen) {
+  // the caller has written the contents the buffer had at generation gen
+  // home itself; a buffer written again since then stays dirty
+  pthread_mutex_lock(&cachelock);
+  int64_t idx = cachelookup(handle, blocknum);
+  if (idx >= 0 && entries[idx].dirty && entries[idx].gen == gen) {
+    entries[idx].dirty = false;
+    ndirty--;
+    stats.writebacks++;
+  }
+  pthread_mutex_unlock(&cachelock);
+}
+
+uint64_t cachedirtycount(int handle) {
+  // dirty buffers of handle; the scan stops once it has seen all of them
+  pthread_mutex_lock(&cachelock);
+  uint64_t n = 0;
+  uint64_t seen = 0;
+  for (uint64_t i = 0; i < nentries && seen < ndirty; i++) {
+    if (entries[i].valid && entries[i].dirty) {
+      seen++;
+      n += entries[i].handle == handle;
+    }
+  }
+  pthread_mutex_unlock(&cachelock);
+  return n;
+}
+
+uint64_t cachecollectdirty(int handle, uint64_t *blocknums, uint8_t **data, uint64_t *gens, uint64_t max) {
+  // copies the dirty buffers of handle into data[] without cleaning them,
+  // so other threads may go on writing while the copies are committed;
+  // returns the total number found even if it is more than max
+  pthread_mutex_lock(&cachelock);
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < nentries; i++) {
+    struct cacheentry *e = &entries[i];
+    if (e->valid && e->dirty && e->handle == handle) {
+      if (n < max) {
+        blocknums[n] = e->blocknum;
+        gens[n] = e->gen;
+        memcpy(data[n], e->data, BLOCK_SIZE);
+      }
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&cachelock);
+  return n;
+}
+
+void cacheinvalidate(int handle) {
+  // drops every buffer belonging to handle, dirty or not;
+  // callers flush first if they want the data kept
+  pthread_mutex_lock(&cachelock);
+  for (uint64_t i = 0; i < nentries; i++) {
+    if (entries[i].valid && entries[i].handle == handle) {
+      cacheunlink(i);
+      if (entries[i].dirty) {
+        entries[i].dirty = false;
+        ndirty--;
+      }
+    }
+  }
+  pthread_mutex_unlock(&cachelock);
+}
+
+void cachediscard(int handle, uint64_t blocknum) {
+  // forgets one buffer without writing it, e.g. because its block was freed
+  pthread_mutex_lock(&cachelock);
+  int64_t idx = nentries > 0 ? cachelookup(handle, blocknum) : -1;
+  if (idx >= 0) {
+    if (entries[idx].dirty) {
+      entries[idx].dirty = false;
+      ndirty--;
+    }
+    cacheunlink(idx);
+  }
+  pthread_mutex_unlock(&cachelock);
+}
+
+void cachegetstats(struct cachestats *out) {
+  pthread_mutex_lock(&cachelock);
+  *out = stats;
+  pthread_mutex_unlock(&cachelock);
+}
+
+void cacheresetstats(void) {
+  pthread_mutex_lock(&cachelock);
+  uint64_t capacity = stats.capacity;
+  memset(&stats, 0, sizeof(stats));
+  stats.capacity = capacity;
+  pthread_mutex_unlock(&cachelock);
+}
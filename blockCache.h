@@ -0,0 +1,29 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "fsHelpers.h"
+
+#define CACHE_DEFAULT_BLOCKS 256   /* block buffers kept in memory (1 MiB) */
+
+struct cachestats {
+    uint64_t hits;          /* lookups served from memory */
+    uint64_t misses;        /* lookups that had to read the disk */
+    uint64_t evictions;     /* buffers recycled by the clock hand */
+    uint64_t writebacks;    /* dirty buffers written to disk */
+    uint64_t capacity;      /* number of block buffers */
+};
+
+int cacheread(int handle, uint64_t blocknum, void *buffer);
+int cachewrite(int handle, uint64_t blocknum, void *buffer);
+int cacheflush(int handle);
+void cacheinvalidate(int handle);
+void cachediscard(int handle, uint64_t blocknum);
+int cachesetsize(uint64_t nblocks);
+bool cachecontains(int handle, uint64_t blocknum);
+void cachemarkclean(int handle, uint64_t blocknum, uint64_t gen);
+uint64_t cachedirtycount(int handle);
+uint64_t cachecollectdirty(int handle, uint64_t *blocknums, uint8_t **data, uint64_t *gens, uint64_t max);
+void cachegetstats(struct cachestats *stats);
+void cacheresetstats(void);
+
+#endif
@@ -0,0 +1,205 @@
+#include "dentryCache.h"
+
+// Remembers the results of directory lookups, keyed on (handle, parent
+// directory inode, name).  A missing name is remembered too, with inode
+// -1, so repeated misses cost no more than hits.  The directory code
+// keeps the cache correct: adddirentry() and removedirentry() overwrite
+// the entry for the name they change, and deleting a directory drops
+// every entry under it since its inode number may be handed out again.
+// Entries are recycled with the same CLOCK scheme as the block cache.
+// One mutex covers the whole cache; nothing done under it blocks.
+
+struct dentry {
+  uint64_t parent;
+  int handle;
+  bool valid;
+  bool referenced;     // second-chance bit for the clock hand
+  char name[DIRENT_NAME_LEN];
+  int64_t inode;       // -1 if the name is known not to exist
+  int64_t next;        // next entry in the same hash bucket, -1 terminates
+};
+
+static struct dentry *dentries = NULL;
+static int64_t *dbuckets = NULL;
+static uint64_t ndentries = 0;
+static uint64_t ndbuckets = 0;
+static uint64_t dhand = 0;
+static struct dcachestats dstats;
+static pthread_mutex_t dcachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hashdentry(int handle, uint64_t parent, const char *name) {
+  uint64_t h = 0xCBF29CE484222325ULL ^ (parent * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) handle;
+  for (int i = 0; i < DIRENT_NAME_LEN && name[i] != '\0'; i++) {
+    h ^= (uint8_t) name[i];
+    h *= 0x100000001B3ULL;
+  }
+  return (h ^ (h >> 29)) & (ndbuckets - 1);
+}
+
+static int dcacheresize(uint64_t nentries) {
+  free(dentries);
+  free(dbuckets);
+  dentries = NULL;
+  dbuckets = NULL;
+  ndentries = 0;
+
+  if (nentries == 0) {
+    return 0;
+  }
+
+  ndbuckets = 1;
+  while (ndbuckets < nentries * 2) {
+    ndbuckets <<= 1;
+  }
+  dentries = calloc(nentries, sizeof(struct dentry));
+  dbuckets = malloc(ndbuckets * sizeof(int64_t));
+  if (dentries == NULL || dbuckets == NULL) {
+    FSLOG(FSLOG_ERROR, "could not allocate dentry cache of %ld entries\n", nentries);
+    free(dentries);
+    free(dbuckets);
+    dentries = NULL;
+    dbuckets = NULL;
+    return -1;
+  }
+  for (uint64_t i = 0; i < ndbuckets; i++) {
+    dbuckets[i] = -1;
+  }
+  for (uint64_t i = 0; i < nentries; i++) {
+    dentries[i].next = -1;
+  }
+  ndentries = nentries;
+  dhand = 0;
+  dstats.capacity = nentries;
+  return 0;
+}
+
+int dcachesetsize(uint64_t nentries) {
+  pthread_mutex_lock(&dcachelock);
+  int result = dcacheresize(nentries);
+  pthread_mutex_unlock(&dcachelock);
+  return result;
+}
+
+static int64_t dcachefind(int handle, uint64_t parent, const char *name) {
+  for (int64_t i = dbuckets[hashdentry(handle, parent, name)]; i >= 0; i = dentries[i].next) {
+    struct dentry *d = &dentries[i];
+    if (d->parent == parent && d->handle == handle && strncmp(d->name, name, DIRENT_NAME_LEN) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void dcacheunlink(int64_t idx) {
+  struct dentry *d = &dentries[idx];
+  int64_t *link = &dbuckets[hashdentry(d->handle, d->parent, d->name)];
+  while (*link != idx) {
+    link = &dentries[*link].next;
+  }
+  *link = d->next;
+  d->next = -1;
+  d->valid = false;
+}
+
+// whether name fits in a directory entry, and so in the cache; a longer
+// one would be cut to a prefix that may well name a real file
+static bool dcachefits(const char *name) {
+  return strnlen(name, DIRENT_NAME_LEN) < DIRENT_NAME_LEN;
+}
+
+int dcachelookup(int handle, uint64_t parent, const char *name, int64_t *inode) {
+  // returns 1 and the remembered inode (or -1) on a hit, 0 on a miss
+  pthread_mutex_lock(&dcachelock);
+  int64_t idx = ndentries > 0 && dcachefits(name) ? dcachefind(handle, parent, name) : -1;
+  if (idx < 0) {
+    dstats.misses++;
+    pthread_mutex_unlock(&dcachelock);
+    return 0;
+  }
+  dentries[idx].referenced = true;
+  *inode = dentries[idx].inode;
+  dstats.hits++;
+  if (*inode < 0) {
+    dstats.negativehits++;
+  }
+  pthread_mutex_unlock(&dcachelock);
+  return 1;
+}
+
+void dcacheinsert(int handle, uint64_t parent, const char *name, int64_t inode) {
+  if (!dcachefits(name)) {
+    return;
+  }
+  pthread_mutex_lock(&dcachelock);
+  if (ndentries == 0 && dcacheresize(DCACHE_DEFAULT_ENTRIES) < 0) {
+    pthread_mutex_unlock(&dcachelock);
+    return;
+  }
+  int64_t idx = dcachefind(handle, parent, name);
+  if (idx < 0) {
+    // nothing is ever dirty here, so the first unreferenced entry will do
+    for (;;) {
+      struct dentry *d = &dentries[dhand];
+      idx = dhand;
+      dhand = (dhand + 1) % ndentries;
+      if (!d->valid) {
+        break;
+      }
+      if (d->referenced) {
+        d->referenced = false;
+        continue;
+      }
+      dcacheunlink(idx);
+      break;
+    }
+    struct dentry *d = &dentries[idx];
+    uint64_t b;
+    d->handle = handle;
+    d->parent = parent;
+    size_t len = strnlen(name, DIRENT_NAME_LEN - 1);
+    memcpy(d->name, name, len);
+    d->name[len] = '\0';
+    d->valid = true;
+    b = hashdentry(handle, parent, d->name);
+    d->next = dbuckets[b];
+    dbuckets[b] = idx;
+  }
+  dentries[idx].inode = inode;
+  dentries[idx].referenced = true;
+  pthread_mutex_unlock(&dcachelock);
+}
+
+void dcacheinvalidatedir(int handle, uint64_t parent) {
+  // forgets every name looked up in one directory
+  pthread_mutex_lock(&dcachelock);
+  for (uint64_t i = 0; i < ndentries; i++) {
+    if (dentries[i].valid && dentries[i].handle == handle && dentries[i].parent == parent) {
+      dcacheunlink(i);
+    }
+  }
+  pthread_mutex_unlock(&dcachelock);
+}
+
+void dcacheinvalidate(int handle) {
+  pthread_mutex_lock(&dcachelock);
+  for (uint64_t i = 0; i < ndentries; i++) {
+    if (dentries[i].valid && dentries[i].handle == handle) {
+      dcacheunlink(i);
+    }
+  }
+  pthread_mutex_unlock(&dcachelock);
+}
+
+void dcachegetstats(struct dcachestats *out) {
+  pthread_mutex_lock(&dcachelock);
+  *out = dstats;
+  pthread_mutex_unlock(&dcachelock);
+}
+
+void dcacheresetstats(void) {
+  pthread_mutex_lock(&dcachelock);
+  uint64_t capacity = dstats.capacity;
+  memset(&dstats, 0, sizeof(dstats));
+  dstats.capacity = capacity;
+  pthread_mutex_unlock(&dcachelock);
+}
@@ -0,0 +1,23 @@
+#ifndef DENTRYCACHE_H
+#define DENTRYCACHE_H
+
+#include "fsHelpers.h"
+
+#define DCACHE_DEFAULT_ENTRIES 4096   /* remembered (directory, name) lookups */
+
+struct dcachestats {
+    uint64_t hits;          /* lookups answered from memory, found or not */
+    uint64_t negativehits;  /* hits that remembered a missing name */
+    uint64_t misses;        /* lookups that had to read the directory */
+    uint64_t capacity;      /* number of entries */
+};
+
+int dcachelookup(int handle, uint64_t parent, const char *name, int64_t *inode);
+void dcacheinsert(int handle, uint64_t parent, const char *name, int64_t inode);
+void dcacheinvalidatedir(int handle, uint64_t parent);
+void dcacheinvalidate(int handle);
+int dcachesetsize(uint64_t nentries);
+void dcachegetstats(struct dcachestats *stats);
+void dcacheresetstats(void);
+
+#endif
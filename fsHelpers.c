@@ -1,589 +1,3080 @@
 #include "fsHelpers.h"
+#include "blockCache.h"
+#include "journal.h"
+#include "bitmap.h"
+#include "dentryCache.h"
+#include "inodeCache.h"
+#include "ioEngine.h"
+#include "fsStats.h"
+#include "fsTrace.h"
+
+static int getextent(int handle, struct inode *node, uint64_t k, struct extent *out);
+static void mapcachedrop(int handle);
+static int groupflush(int handle);
+static int64_t applyfrees(int handle);
+static bool freespending(void);
+static struct pendingwrite* pendingof(struct inode *node);
+static int pendingflush(struct pendingwrite *p);
+static void pendingdrop(struct pendingwrite *p);
+static int pendingflushall(int handle);
+static uint64_t pendingcost(int handle, uint64_t inode, struct inode *node, uint64_t nblocks);
+static uint64_t mapcost(uint64_t k, uint64_t n);
+static uint64_t alloccost(uint64_t goal, uint64_t count);
+static int uninline(int handle, uint64_t inode, struct inode *node);
+static int zerorange(int handle, struct inode *node, uint64_t offset, uint64_t size);
+
+// Everything known about the disk being worked on.  It is shared by
+// every thread: the layout only changes when a disk is formatted or
+// mounted, the zone cursors and free counts are hints, and the bitmap
+// behind the zones is claimed with compare-and-swap.  The caches are
+// shared by all disks and keyed by handle, and guard themselves.
+// There is room here, and in the journal and the bitmap, for one disk,
+// so only one can be open at a time.
+static struct {
+  // the disk opendisk() returned, until closedisk()
+  int opened;
+
+  // in-memory copy of the superblock, and the disk it came from
+  struct superblock sb;
+  int handle;
+
+  // the group descriptor table as last written, and the inode and data
+  // parts of every group, allocated from separately
+  struct groupdesc *gdt;
+  struct allocgroup {
+    struct bitmapzone inodes;
+    struct bitmapzone data;
+    uint64_t freeinodes;    // free bits in each zone, kept up to date as
+    uint64_t freeblocks;    // they are claimed and given back
+  } *groups;
+  uint64_t datablocks;      // data blocks in all groups together
+  uint64_t rotor;           // where the search for a directory's group starts
+
+  // appended data waiting for blocks, see bufferwrite(); the slots are
+  // guarded by pendinglock, what is in them by the file's inode lock
+  struct pendingwrite {
+    int handle;
+    uint64_t inum;
+    struct inode *node;     // NULL for a free slot; holds a reference
+    uint64_t first;         // logical block data starts at, the file's first unmapped one
+    uint64_t nblocks;       // blocks of data in use
+    uint64_t capacity;      // blocks data has room for
+    uint8_t *data;
+  } pending[DELALLOC_MAX_FILES];
+  uint64_t npending;
+  uint64_t reserved;        // free blocks promised to the pending writes
+  pthread_mutex_t pendinglock;
+
+  // blocks and inodes given back since the last commit, which stay in use
+  // until it is on disk, see releaseblocks()
+  struct freedrun {
+    uint64_t start;
+    uint64_t count;
+  } *freed;
+  uint64_t nfreed;
+  uint64_t freedcapacity;
+  pthread_mutex_t freedlock;
+
+  // the disk image mapped by opendiskmapped(), if any; while it is mapped
+  // raw block I/O is memcpy to and from the mapping instead of system calls
+  struct {
+    int handle;
+    uint8_t *base;
+    uint64_t size;
+  } image;
+
+  // one batch of requests on the io_uring at a time
+  pthread_mutex_t ringlock;
+} mnt = { .opened = -1, .handle = -1, .image.handle = -1, .ringlock = PTHREAD_MUTEX_INITIALIZER, .pendinglock = PTHREAD_MUTEX_INITIALIZER,
+        .freedlock = PTHREAD_MUTEX_INITIALIZER };
+
+// address of a block inside the mapped image, or NULL
+static uint8_t* imageblock(int handle, uint64_t blocknum) {
+  if (mnt.image.handle != handle || (blocknum + 1) * BLOCK_SIZE > mnt.image.size) {
+    return NULL;
+  }
+  return mnt.image.base + blocknum * BLOCK_SIZE;
+}
+
+static void unmapimage(int handle) {
+  if (mnt.image.handle == handle) {
+    munmap(mnt.image.base, mnt.image.size);
+    mnt.image.handle = -1;
+    mnt.image.base = NULL;
+    mnt.image.size = 0;
+  }
+}
 
-uint32_t freeblocks[1024];
+static int mapimage(int handle) {
+  struct stat st;
+  if (fstat(handle, &st) < 0 || st.st_size == 0) {
+    return -1;
+  }
+  void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+  if (base == MAP_FAILED) {
+    FSLOG(FSLOG_ERROR, "could not map disk image: %d\n", errno);
+    return -1;
+  }
+  unmapimage(mnt.image.handle);
+  mnt.image.handle = handle;
+  mnt.image.base = base;
+  mnt.image.size = st.st_size;
+  return 0;
+}
 
 int opendisk(char *filename, uint64_t size) {
   // given a filename and a file size:
   // Open a virtual disk, or create one if one does not already exist.
   // Open a file with the provided file name.
   // Specify O_RDWR for read/write access.
+  // Only one disk can be open at a time.
+  if (mnt.opened >= 0) {
+    FSLOG(FSLOG_ERROR, "Another disk is already open\n");
+    return -1;
+  }
   int disk = open(filename, O_RDWR);
   // if open() returns -1, then the virtual disk does not yet exist.
   // open disk
   if (disk > -1) {
+    // finish any transactions a crash left in the journal
+    if (journalreplay(disk) < 0) {
+      FSLOG(FSLOG_ERROR, "Error replaying journal\n");
+    }
+    mnt.opened = disk;
     return disk;
   } else {
     // create disk
     // Set the file's size to the given size.
-    disk = open(filename, O_RDWR | O_CREAT);
+    disk = open(filename, O_RDWR | O_CREAT, 0644);
     // format the disk.
     ftruncate(disk, size);
     // if there was any error, return -1
     if (disk > -1) {
+      mnt.opened = disk;
       return disk;
     } else {
-      printf("Error formatting disk: %d\n", disk);
+      FSLOG(FSLOG_ERROR, "Error formatting disk: %d\n", disk);
       return -1;
     }
   }
   // Return the file's handle.
 }
 
-int readblock(int handle, uint64_t inode, void *buffer) {
-    if (lseek(handle, inode * BLOCK_SIZE, SEEK_SET) < 0) {
-        // perror("lseek error\n");
-        return -1;
-    }
+int opendiskmapped(char *filename, uint64_t size) {
+  // Same as opendisk(), but the image is mapped into memory once and
+  // blocks are copied to and from the mapping without system calls.
+  // Falls back to plain file I/O if the image cannot be mapped.
+  int disk = opendisk(filename, size);
+  if (disk > -1 && mapimage(disk) < 0) {
+    FSLOG(FSLOG_INFO, "Using file I/O for %s\n", filename);
+  }
+  return disk;
+}
 
-    int r = read(handle, buffer, BLOCK_SIZE);
+int rawreadblock(int handle, uint64_t inode, void *buffer) {
+    statsblocks(false, 1);
+    uint8_t *mapped = imageblock(handle, inode);
+    if (mapped != NULL) {
+        memcpy(buffer, mapped, BLOCK_SIZE);
+        return 0;
+    }
+    // positional, so it never moves a file offset another caller relies on
+    ssize_t r = pread(handle, buffer, BLOCK_SIZE, inode * BLOCK_SIZE);
     if (r == BLOCK_SIZE)
         return 0;
-    printf("read failed: %d\n", r);
-    printf("errno: %d\n", errno);
+    FSLOG(FSLOG_ERROR, "read failed: %ld\n", r);
+    FSLOG(FSLOG_ERROR, "errno: %d\n", errno);
     // handleerr(false, handle);
     return -1;
 }
 
-int writeblock(int handle, uint64_t inode, void *buffer) {
+int rawwriteblock(int handle, uint64_t inode, void *buffer) {
   // Write a block to the virtual disk from the given buffer.
   // The handle is the same one returned by opendisk().
   // inode is a block number.
   // Return 0 if successful, -1 if not.
-  if (lseek(handle, inode * BLOCK_SIZE, SEEK_SET) < 0) {
-    printf("error while doing lseek in writeblock\n");
-    return -1;
+  statsblocks(true, 1);
+  uint8_t *mapped = imageblock(handle, inode);
+  if (mapped != NULL) {
+    memcpy(mapped, buffer, BLOCK_SIZE);
+    return 0;
   }
-
-  int written = write(handle, buffer, BLOCK_SIZE);
-  if (written > 0) {
+  ssize_t written = pwrite(handle, buffer, BLOCK_SIZE, inode * BLOCK_SIZE);
+  if (written == BLOCK_SIZE) {
     return 0;
   } else {
-    printf("failed to write to block: %d\n", written);
+    FSLOG(FSLOG_ERROR, "failed to write to block: %ld\n", written);
     return -1;
   }
 }
 
-int syncdisk(int handle) {
-  // Write all buffers to disk.
-  // When done committing buffered data and metadata to disk, return.
-  // If successful, return 0.
-  // Else return -1.
-    int synched = fsync(handle);
-    if (synched < 0) {
-      printf("error while synching disk\n");
+// Runs one preadv()/pwritev() to completion, resubmitting what is left
+// after a short transfer.
+static int rawiov(int handle, struct iovec *iov, int n, uint64_t pos, bool write) {
+  uint64_t total = 0;
+  for (int i = 0; i < n; i++) {
+    total += iov[i].iov_len;
+  }
+  statsblocks(write, total / BLOCK_SIZE);
+  if (mnt.image.handle == handle && pos + total <= mnt.image.size) {
+    for (int i = 0; i < n; i++) {
+      if (write) {
+        memcpy(mnt.image.base + pos, iov[i].iov_base, iov[i].iov_len);
+      } else {
+        memcpy(iov[i].iov_base, mnt.image.base + pos, iov[i].iov_len);
+      }
+      pos += iov[i].iov_len;
+    }
+    return 0;
+  }
+  while (n > 0) {
+    ssize_t done = write ? pwritev(handle, iov, n, pos) : preadv(handle, iov, n, pos);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done < 0 || (done == 0 && write)) {
+      FSLOG(FSLOG_ERROR, "failed to %s blocks at %ld: %ld\n", write ? "write" : "read", pos / BLOCK_SIZE, done);
+      return -1;
+    }
+    if (done == 0) {
+      // past the end of the image reads as zeros
+      for (int i = 0; i < n; i++) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+      }
+      return 0;
+    }
+    pos += done;
+    while (n > 0 && (size_t) done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8_t*) iov->iov_base + done;
+      iov->iov_len -= done;
     }
-    return synched;
-}
-
-int closedisk(int handle) {
-  // Close the disk.
-  int c = close(handle);
-  assert(c >= 0);
-  return c;
-}
-
-int diskformat(int handle) {
-  // write the superblock
-  uint64_t superblock[BLOCK_SIZE];
-
-  // save data to superblock
-  superblock[0] = MAGIC_NUM;
-  superblock[1] = BLOCK_SIZE * 64;
-  superblock[2] = INODES;
-  writeblock(handle, 0, superblock);
-
-  // clear bitmap identifying used blocks
-  // i.e. set block 1 to all zeros,
-  // except for first two bits,
-  // marking superblock and free list block as used
-  setbit(0);
-  setbit(1);
-  for (int i = 2; i < INODES; i++) {
-    clearbit(i);
   }
-  writeblock(handle, 1, freeblocks);
-  syncdisk(handle);
-
   return 0;
 }
 
-void diskdump(int handle) {
-    uint64_t superblock[BLOCK_SIZE];
-    readblock(handle, 0, superblock);
+// rawblockv() on the io_uring: every run of the list is submitted before
+// the first one is waited for, so a fragmented range keeps the device
+// queue full instead of going one run at a time.  A run the kernel
+// transferred only part of is redone synchronously.
+static int rawblockvasync(int handle, const uint64_t *blocknums, void **buffers, uint64_t count, bool write) {
+  struct iovec *iov = malloc(count * sizeof(struct iovec));
+  struct aiorequest *reqs = malloc(count * sizeof(struct aiorequest));
+  if (iov == NULL || reqs == NULL) {
+    free(iov);
+    free(reqs);
+    return -1;
+  }
+  uint64_t nreq = 0;
+  uint64_t niov = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    struct aiorequest *r = nreq > 0 ? &reqs[nreq - 1] : NULL;
+    if (r != NULL && blocknums[i] == r->blocknum + r->tag / BLOCK_SIZE) {
+      struct iovec *lastiov = &iov[niov - 1];
+      if ((uint8_t*) lastiov->iov_base + lastiov->iov_len == buffers[i]) {
+        lastiov->iov_len += BLOCK_SIZE;
+        r->tag += BLOCK_SIZE;
+        continue;
+      }
+      if (r->niov < IO_MAX_IOVECS) {
+        iov[niov++] = (struct iovec) { buffers[i], BLOCK_SIZE };
+        r->niov++;
+        r->tag += BLOCK_SIZE;
+        continue;
+      }
+    }
+    // the tag holds the number of bytes the run should move
+    iov[niov] = (struct iovec) { buffers[i], BLOCK_SIZE };
+    reqs[nreq++] = (struct aiorequest) { write ? AIO_WRITE : AIO_READ, 1, blocknums[i], &iov[niov], BLOCK_SIZE, 0, NULL };
+    niov++;
+  }
 
-    int active = 0;
-    int inactive = 0;
-    printf("\nBegin Disk Dump...\n");
-    char nodes[INODES];
-    // show how many inodes are currently being used or free
-    for (uint64_t i = 0; i < INODES; i++) {
-      if (checkbitset(i)) {
-          active++;
-          nodes[i] = '+';
-      } else {
-        inactive++;
-        nodes[i] = '-';
+  int result = 0;
+  uint64_t submitted = 0;
+  uint64_t reaped = 0;
+  while (reaped < submitted || submitted < nreq) {
+    if (submitted < nreq) {
+      int s = aiosubmit(handle, &reqs[submitted], nreq - submitted);
+      if (s < 0) {
+        result = -1;
+        break;
       }
+      submitted += s;
     }
-    uint64_t magic = superblock[0];
-    printf("Magic: %lx\n", magic);
-    int64_t diskSize = superblock[1];
-    printf("Disk size (bytes): %ld\n", diskSize);
-    printf("Active blocks: %d\n", active);
-    printf("Inactive blocks: %d\n", inactive);
-    printf("Active inodes: %d\n", active - 2);
-    printf("Inactive inodes: %d\n", inactive - 2);
-    printf("inodes = %s\n", nodes);
-    printf("End disk dump\n");
+    struct aiorequest *done[64];
+    int d = aioreap(handle, done, countof(done), 1);
+    if (d < 0) {
+      result = -1;
+      break;
+    }
+    for (int k = 0; k < d; k++) {
+      // a run redone synchronously is counted by rawiov()
+      if (done[k]->result == (int64_t) done[k]->tag) {
+        statsblocks(write, done[k]->tag / BLOCK_SIZE);
+      } else if (rawiov(handle, done[k]->iov, done[k]->niov, done[k]->blocknum * BLOCK_SIZE, write) < 0) {
+        result = -1;
+      }
+    }
+    reaped += d;
+  }
+  if (reaped < submitted) {
+    // give up on the ring rather than free buffers the kernel may still use
+    aioclose(handle);
+  }
+  free(iov);
+  free(reqs);
+  return result;
 }
 
-int checkbitset(int n) {
-  // n is the number of the bit we want to check is set
-  uint32_t index = n / (8 * sizeof(uint32_t));
-  uint32_t offset = n % (8 * sizeof(uint32_t));
-  uint32_t mask = 1 << offset;
-
-  if (freeblocks[index] & mask) {
-    // returns true if free
-    return true;
-  } else {
-    // returns false if not free
-    return false;
+// Moves blocknums[i] to or from buffers[i] for every i, bypassing the
+// block cache.  Consecutive entries whose blocks are physically
+// contiguous share one system call, and neighbouring buffers that are
+// contiguous in memory share one iovec.
+static int rawblockv(int handle, const uint64_t *blocknums, void **buffers, uint64_t count, bool write) {
+  if (count > 1 && aioactive(handle) && mnt.image.handle != handle) {
+    // completions come back in no particular order, so only one
+    // batch may be waiting on the ring at a time
+    pthread_mutex_lock(&mnt.ringlock);
+    int result = rawblockvasync(handle, blocknums, buffers, count, write);
+    pthread_mutex_unlock(&mnt.ringlock);
+    return result;
+  }
+  struct iovec iov[IO_MAX_IOVECS];
+  uint64_t i = 0;
+  while (i < count) {
+    uint64_t start = blocknums[i];
+    int n = 0;
+    uint64_t k = 0;
+    for (; i + k < count && blocknums[i + k] == start + k; k++) {
+      uint8_t *buf = buffers[i + k];
+      if (n > 0 && (uint8_t*) iov[n - 1].iov_base + iov[n - 1].iov_len == buf) {
+        iov[n - 1].iov_len += BLOCK_SIZE;
+        continue;
+      }
+      if (n == IO_MAX_IOVECS) {
+        break;
+      }
+      iov[n].iov_base = buf;
+      iov[n].iov_len = BLOCK_SIZE;
+      n++;
+    }
+    if (rawiov(handle, iov, n, start * BLOCK_SIZE, write) < 0) {
+      return -1;
+    }
+    i += k;
   }
+  return 0;
 }
 
-void setbit(int n) {
-  // n is the number of the bit we want to check is set
-  uint32_t index = n / (8 * sizeof(uint32_t));
-  uint32_t offset = n % (8 * sizeof(uint32_t));
-  uint32_t mask = 1 << offset;
-
-  freeblocks[index] |= mask;
+int rawreadblockv(int handle, const uint64_t *blocknums, void **buffers, uint64_t count) {
+  return rawblockv(handle, blocknums, buffers, count, false);
 }
 
-void clearbit(int n) {
-  // n is the number of the bit we want to check is set
-  uint32_t index = n / (8 * sizeof(uint32_t));
-  uint32_t offset = n % (8 * sizeof(uint32_t));
-  uint32_t mask = 1 << offset;
+int rawwriteblockv(int handle, const uint64_t *blocknums, void **buffers, uint64_t count) {
+  return rawblockv(handle, blocknums, buffers, count, true);
+}
 
-  freeblocks[index] &= ~mask;
+int rawreadblocks(int handle, uint64_t start, uint64_t count, void *buffer) {
+  // Read count consecutive blocks starting at block start with one transfer.
+  struct iovec iov = { buffer, count * BLOCK_SIZE };
+  return rawiov(handle, &iov, 1, start * BLOCK_SIZE, false);
 }
 
-void dumpfileinfo(int handle, uint64_t inode) {
-  struct inode node;
-  readblock(handle, inode, &node);
+int rawwriteblocks(int handle, uint64_t start, uint64_t count, void *buffer) {
+  // Write count consecutive blocks starting at block start with one transfer.
+  struct iovec iov = { buffer, count * BLOCK_SIZE };
+  return rawiov(handle, &iov, 1, start * BLOCK_SIZE, true);
+}
 
-  printf("\nBegin file dump...\n");
-  printf("File size: %ld\n", node.size);
-  printf("Last modified: %ld\n", node.mtime);
-  if (node.type) {
-    printf("Type: Directory\n");
-    dumpdirectory(handle, inode);
-  } else {
-    printf("Type: Regular file\n");
+int readblock(int handle, uint64_t inode, void *buffer) {
+  // Read a block through the block cache.
+  // Only a miss touches the disk.
+  // A mapped image already is a cache of every block, so only blocks the
+  // cache holds (dirty ones among them) are looked up there.
+  uint8_t *mapped = imageblock(handle, inode);
+  if (mapped != NULL && !cachecontains(handle, inode)) {
+    memcpy(buffer, mapped, BLOCK_SIZE);
+    return 0;
   }
-  printf("Inode: %ld\n", node.blocks[0]);
-  printf("End file dump\n\n");
+  return cacheread(handle, inode, buffer);
 }
 
-void deletefile(int handle, uint64_t inode) {
-  struct inode node;
-  readblock(handle, inode, &node);
-  clearbit(inode);
-  clearbit(inode + INODES);
-  for (int i = 0; i < (node.size / BLOCK_SIZE); i++) {
-    clearbit(node.blocks[i + 1]);
-    clearbit(node.blocks[i + 1] + INODES);
+const void* blockptr(int handle, uint64_t blocknum, void *scratch) {
+  // Returns the current contents of a block for reading only.
+  // With a mapped image that is a pointer into the mapping, so nothing
+  // is copied; otherwise the block is read into scratch.
+  // The pointer is good until the next call that writes blocks.
+  uint8_t *mapped = imageblock(handle, blocknum);
+  if (mapped != NULL && !cachecontains(handle, blocknum)) {
+    return mapped;
   }
-  writeblock(handle, 1, freeblocks);
-  syncdisk(handle);
+  return readblock(handle, blocknum, scratch) < 0 ? NULL : scratch;
 }
 
-int createfile(int handle, uint64_t filesize, uint64_t filetype) {
-  // assert(filesize < 4096);
-  struct inode node;
-  node.size = filesize;
-  node.mtime = time(NULL);
-  node.type = filetype;
-  uint64_t used = 0;
-  uint64_t super[BLOCK_SIZE];
-  readblock(handle, 0, super);
-  // set file data blocks
-  // start after the free block list's block to prevent overwriting it or the sb
-  // search for unused bits in bitmap and mark them as belonging to the file
-  for (uint64_t i = 2; i < INODES && used <= (filesize / BLOCK_SIZE); i++) {
-    if (!checkbitset(i)) {
-      node.blocks[used] = i;
-      setbit(i);
-      setbit(i + INODES);
-      used++;
-    }
-  }
-
-  // write changes to disk
-  writeblock(handle, node.blocks[0], &node);
-  writeblock(handle, 1, freeblocks);
-  syncdisk(handle);
-  return node.blocks[0];
+int rawsync(int handle) {
+  // Make every block written so far durable.
+  uint64_t t = statsclock();
+  int result = mnt.image.handle == handle ? msync(mnt.image.base, mnt.image.size, MS_SYNC) : fsync(handle);
+  statssync(t);
+  return result;
 }
 
-int enlargefile(int handle, uint64_t inode, uint64_t size) {
-  // access the inode at the given block number
-  struct inode node;
-  readblock(handle, inode, &node);
-
-  if (size == 0) {
-    return node.size;
+void rawprefetch(int handle, uint64_t start, uint64_t count) {
+  // Ask the kernel to start reading count blocks from start in the
+  // background; later reads of them then find them in memory.
+  uint8_t *mapped = imageblock(handle, start + count - 1);
+  if (mapped != NULL) {
+    madvise(mnt.image.base + start * BLOCK_SIZE, count * BLOCK_SIZE, MADV_WILLNEED);
+    return;
   }
-  printf("Increasing size of file w/ inode %ld by %ld bytes...\n", inode, size);
+  posix_fadvise(handle, start * BLOCK_SIZE, count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
 
-  uint64_t superblock[BLOCK_SIZE];
-  readblock(handle, 0, superblock);
+int writeblock(int handle, uint64_t inode, void *buffer) {
+  // Write a block into the block cache and mark it dirty.
+  // It becomes part of the running transaction and reaches the disk
+  // through the journal when that transaction commits.
+  return cachewrite(handle, inode, buffer);
+}
 
-  // assert((node.size + size) < 4096);
+// Metadata, and any block the cache already holds (directory blocks,
+// say), has to go through the cache so the journal sees it.  Everything
+// else is file data and goes straight to the disk.
+static bool cachedblock(int handle, uint64_t blocknum) {
+  return mnt.sb.magic != MAGIC_NUM || blocknum < mnt.sb.datastart || cachecontains(handle, blocknum);
+}
 
-  if (size < 0) {
-    printf("Invalid size, please enter a size of 0 or greater\n");
-    return node.size;
+static int blocklistio(int handle, const uint64_t *blocknums, void **buffers, uint64_t count, bool write) {
+  uint64_t *direct = malloc(count * sizeof(uint64_t));
+  void **directbufs = malloc(count * sizeof(void*));
+  if (direct == NULL || directbufs == NULL) {
+    free(direct);
+    free(directbufs);
+    return -1;
   }
-
-  // check that increasing the file size wouldn't go past the limit
-  // printf("%ld\n%ld\n", (node.size + size), superblock[1]);
-  if ((node.size + size) > superblock[1]) {
-    printf("Insufficient space, continuing\n");
-    return node.size;
+  uint64_t n = 0;
+  int result = 0;
+  for (uint64_t i = 0; i < count && result == 0; i++) {
+    if (cachedblock(handle, blocknums[i])) {
+      result = write ? writeblock(handle, blocknums[i], buffers[i]) : readblock(handle, blocknums[i], buffers[i]);
+    } else {
+      direct[n] = blocknums[i];
+      directbufs[n++] = buffers[i];
+    }
+  }
+  if (result == 0 && n > 0) {
+    result = rawblockv(handle, direct, directbufs, n, write);
   }
+  free(direct);
+  free(directbufs);
+  return result;
+}
 
-  // calculate how many blocks the node currently uses
-  // and how many more it needs in order to store the current file size plus the increase in file size
-  uint64_t used = node.size / BLOCK_SIZE;
-  uint64_t needed = (node.size + size) / BLOCK_SIZE;
-
-  // if the file needs exactly as many blocks as it is currently using, then just allocate more space to the node
-  if (used == needed) {
-    node.size += size;
-    writeblock(handle, inode, &node);
-    printf("Done!\n");
-    return node.size;
-  } else {
-    // otherwise, start allocating more blocks to the node's block list.
-    // start setting more data blocks to the file.
-    // start after the free block list's block to prevent overwriting it or the sb
-    // search for unused bits in bitmap and mark them as belonging to the file
-    printf("More blocks needed for size increase by %ld bytes. Attempting...\n", size);
-    for (uint64_t i = 2; i < INODES && (used + 1) <= needed; i++) {
-      if (!checkbitset(i)) {
-        node.blocks[used + 1] = i;
-        setbit(i);
-        setbit(i + INODES);
-        used++;
-      }
+int readblocks(int handle, const uint64_t *blocknums, void **buffers, uint64_t count) {
+  // Read blocknums[i] into buffers[i] for every i.
+  // List physically contiguous blocks next to each other:
+  // each such run is read with one preadv().
+  return blocklistio(handle, blocknums, buffers, count, false);
+}
+
+int writeblocks(int handle, const uint64_t *blocknums, void **buffers, uint64_t count) {
+  // Write buffers[i] to blocknums[i] for every i, one pwritev() per run.
+  return blocklistio(handle, blocknums, buffers, count, true);
+}
+
+// writes the bitmap, the group counts and the inodes changed since the
+// last commit to the cache and commits them with everything else dirty
+// there; returns the number of blocks committed, or -1 on error
+static int commitdisk(int handle) {
+    bitmapflush(handle);
+    if (groupflush(handle) < 0 || iflush(handle) < 0) {
+      FSLOG(FSLOG_ERROR, "error while writing back cached inodes\n");
+      return -1;
     }
-    printf("Done!\n");
-    node.size += size;
-    writeblock(handle, inode, &node);
-    syncdisk(handle);
-    return node.size;
-  }
+    int committed = journalcommit(handle);
+    if (committed < 0) {
+      FSLOG(FSLOG_ERROR, "error while writing back cached blocks\n");
+    }
+    return committed;
 }
 
-int shrinkfile(int handle, uint64_t inode, uint64_t size) {
-  printf("Decreasing file size by %ld bytes...\n", size);
-  // access the inode at the given block number
-  struct inode node;
-  readblock(handle, inode, &node);
+static int dosyncdisk(int handle) {
+  // Write all buffers to disk.
+  // When done committing buffered data and metadata to disk, return.
+  // If successful, return 0.
+  // Else return -1.
+    // operations running in other threads finish first,
+    // so the commit holds only whole operations
+    txnquiesce(handle);
+    // appends kept in memory get their blocks, and they, the inodes and
+    // the group free counts changed since the last commit join this one
+    pendingflushall(handle);
+    int committed = commitdisk(handle);
+    // what the committed operations freed can be handed out again; a sync
+    // asked for commits that as well, while one txnbegin() or txnend()
+    // makes on its own leaves a few bitmap blocks of it to the next
+    // transaction, which has room for TXN_CREDITS of them to spare
+    if (committed >= 0) {
+      int64_t applied = applyfrees(handle);
+      if (applied < 0) {
+        committed = -1;
+      } else if (applied > 0 && (!txncommitting() || bitmapdirtycount() > TXN_CREDITS)) {
+        int more = commitdisk(handle);
+        committed = more < 0 ? -1 : committed + more;
+      }
+    }
+    int synched = committed < 0 ? -1 : 0;
+    // a journal commit already fsynced everything written before it
+    if (committed == 0) {
+      synched = rawsync(handle);
+      if (synched < 0) {
+        FSLOG(FSLOG_ERROR, "error while synching disk\n");
+      }
+    }
+    txnresume(handle);
+    return synched;
+}
 
-  // calculate how many blocks the node currently uses
-  // and how many more it needs in order to store the current file size plus the increase in file size
-  uint64_t used = node.size / BLOCK_SIZE;
-  uint64_t needed = (node.size - size) / BLOCK_SIZE;
+int syncdisk(int handle) {
+  uint64_t t = statsclock();
+  int synched = dosyncdisk(handle);
+  statsop(OP_SYNC, t, synched < 0);
+  // a replay commits on its own too, so only syncs asked for are traced
+  if (!txncommitting()) {
+    TRACE(TRACE_SYNC, t, NULL, synched);
+  }
+  return synched;
+}
 
-  if (size < 0) {
-    printf("Invalid size, please enter a size of 0 or greater\n");
-    return node.size;
+int closedisk(int handle) {
+  // Close the disk.
+  // The running transaction is committed first, and then the blocks
+  // it freed going back to the bitmap.
+  dosyncdisk(handle);
+  journalclose(handle);
+  aioclose(handle);
+  cacheflush(handle);
+  if (mnt.image.handle == handle) {
+    msync(mnt.image.base, mnt.image.size, MS_SYNC);
+    unmapimage(handle);
   }
+  if (mnt.handle == handle && mnt.sb.magic == MAGIC_NUM) {
+    // everything is home and durable, so the journal is spent: clear it
+    // and let the next mount trust the bitmap and the group counts
+    mnt.sb.state = SB_CLEAN;
+    if (rawsync(handle) < 0 || journalclear(handle, mnt.sb.journalstart, mnt.sb.journalblocks) < 0 ||
+        rawwriteblock(handle, 0, &mnt.sb) < 0 || rawsync(handle) < 0) {
+      FSLOG(FSLOG_ERROR, "could not mark the disk clean\n");
+    }
+    mnt.handle = -1;
+  }
+  mapcachedrop(handle);
+  iinvalidate(handle);
+  cacheinvalidate(handle);
+  dcacheinvalidate(handle);
+  if (mnt.opened == handle) {
+    mnt.opened = -1;
+  }
+  int c = close(handle);
+  assert(c >= 0);
+  return c;
+}
 
-  // if we're shrinking past the size of the file:
-  if ((node.size - size) < 0) {
-    printf("Invalid size, shrink size is greater than file size\n");
-    return node.size;
-  }
-
-  // check if any fewer blocks are needed
-  if (used == needed) {
-    node.size -= size;
-    writeblock(handle, inode, &node);
-    // syncdisk(handle);
-    printf("Done!\n");
-    return node.size;
-  } else {
-    // otherwise, start deallocating more blocks from the node's block list.
-    // start freeing data blocks from the file.
-    // start after the free block list's block to prevent overwriting it or the sb
-    // search for unused bits in bitmap and mark them as belonging to the file
-    printf("Decreasing number of blocks allocated to file...\n");
-    for (uint64_t i = used; i > needed; i--) {
-        clearbit(node.blocks[i]);
-        clearbit(node.blocks[i] + INODES);
-    }
-    printf("Done!\n");
-    node.size -= size;
-    writeblock(handle, inode, &node);
-    syncdisk(handle);
-    return node.size;
+// Allocation groups.  A new directory goes to a group with more free
+// inodes and blocks than most, so directories spread over the disk; a
+// new file goes to its directory's group, and a file's blocks are taken
+// from its own group until it is full.  Files that belong together stay
+// close, and threads working in different directories claim bits in
+// different parts of the bitmap.
+
+// builds the zones of every group from the superblock
+static int groupsetup(void) {
+  free(mnt.groups);
+  free(mnt.gdt);
+  mnt.groups = calloc(mnt.sb.ngroups, sizeof(struct allocgroup));
+  mnt.gdt = calloc(mnt.sb.gdtblocks * GROUPS_PER_BLOCK, sizeof(struct groupdesc));
+  if (mnt.groups == NULL || mnt.gdt == NULL) {
+    FSLOG(FSLOG_ERROR, "could not allocate %ld allocation groups\n", mnt.sb.ngroups);
+    return -1;
+  }
+  mnt.datablocks = 0;
+  for (uint64_t g = 0; g < mnt.sb.ngroups; g++) {
+    uint64_t start = mnt.sb.datastart + g * mnt.sb.groupblocks;
+    uint64_t end = g + 1 < mnt.sb.ngroups ? start + mnt.sb.groupblocks : mnt.sb.nblocks;
+    uint64_t datastart = start + mnt.sb.groupinodes;
+    mnt.groups[g].inodes = (struct bitmapzone) { start, datastart, start };
+    mnt.groups[g].data = (struct bitmapzone) { datastart, end, datastart };
+    mnt.groups[g].freeinodes = datastart - start;
+    mnt.groups[g].freeblocks = end - datastart;
+    mnt.datablocks += end - datastart;
   }
+  mnt.rotor = 0;
+  return 0;
 }
 
-int readfile(int handle, uint64_t inode, void *buffer, uint64_t size) {
-    struct inode node;
-    readblock(handle, inode, &node);
-
-    uint8_t bufferBlock[BLOCK_SIZE];
-    int curr = 0;
-    for (uint64_t i = 0; i < size; i++) {
-        if (i % (BLOCK_SIZE - 1) == 0) {
-            readblock(handle, node.blocks[curr] + INODES, bufferBlock);
-            curr++;
-        }
-        ((uint8_t*)buffer)[i] = bufferBlock[i % BLOCK_SIZE];
+// writes the descriptor blocks whose counts changed since they were last written
+static int groupflush(int handle) {
+  if (mnt.sb.magic != MAGIC_NUM || mnt.gdt == NULL) {
+    return 0;
+  }
+  for (uint64_t b = 0; b < mnt.sb.gdtblocks; b++) {
+    struct groupdesc descs[GROUPS_PER_BLOCK];
+    memset(descs, 0, sizeof(descs));
+    for (uint64_t i = 0; i < GROUPS_PER_BLOCK && b * GROUPS_PER_BLOCK + i < mnt.sb.ngroups; i++) {
+      struct allocgroup *g = &mnt.groups[b * GROUPS_PER_BLOCK + i];
+      descs[i].start = g->inodes.from;
+      descs[i].nblocks = g->data.to - g->inodes.from;
+      descs[i].ninodes = g->inodes.to - g->inodes.from;
+      descs[i].freeblocks = __atomic_load_n(&g->freeblocks, __ATOMIC_RELAXED);
+      descs[i].freeinodes = __atomic_load_n(&g->freeinodes, __ATOMIC_RELAXED);
+    }
+    struct groupdesc *written = &mnt.gdt[b * GROUPS_PER_BLOCK];
+    if (memcmp(descs, written, sizeof(descs)) != 0) {
+      if (writeblock(handle, mnt.sb.gdtstart + b, descs) < 0) {
+        return -1;
+      }
+      memcpy(written, descs, sizeof(descs));
     }
+  }
+  return 0;
+}
 
-    return size;
+// the group a block, and so an inode, belongs to
+static uint64_t groupof(uint64_t blocknum) {
+  if (blocknum < mnt.sb.datastart || mnt.sb.ngroups == 0) {
+    return 0;
+  }
+  uint64_t g = (blocknum - mnt.sb.datastart) / mnt.sb.groupblocks;
+  return g < mnt.sb.ngroups ? g : mnt.sb.ngroups - 1;
 }
 
-// returns the directory's starting inode
-int createdirectory(int handle) {
-  // assert that string length is 15 or less
-  // when translating an inode to a block, it's the block number plus 2
-  // struct dirent initdirent;
-  // initdirent.name = "init";
-  // create a helper function to create a free inode for a terminating dirent
-  // initdirent.finode = freenode;
-  // struct dirent entries[] = {initdirent};
-  int dir_inode = createfile(handle, 4096, 1);
-
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-
-  // 204 = block size / (finode size (4 ) + name size (16))
-  int i = 0;
-  memset(bufferBlock, 0, 4096);
-  // dirlist[0].finode = 0;
-  // strcpy(dirlist[0].name, "init");
-
-  dirlist[0].finode = 0xffffffff;
-  // strcpy(dirlist[0].name, "init");
+// block of the i-th inode, counting through the groups in order
+static uint64_t inodeblock(uint64_t i) {
+  return mnt.groups[i / mnt.sb.groupinodes].inodes.from + i % mnt.sb.groupinodes;
+}
 
-  return dir_inode;
+// free data blocks not already promised to appends waiting for them;
+// negative if more were promised than there are
+static int64_t freedatablocks(void) {
+  uint64_t count = 0;
+  for (uint64_t g = 0; g < mnt.sb.ngroups; g++) {
+    count += __atomic_load_n(&mnt.groups[g].freeblocks, __ATOMIC_RELAXED);
+  }
+  return (int64_t) count - (int64_t) __atomic_load_n(&mnt.reserved, __ATOMIC_RELAXED);
 }
 
-void dumpdirectory(int handle, uint64_t dir_inode) {
-  // unpack entries, print their file names and inodes
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-  readfile(handle, dir_inode, bufferBlock, 4096);
+// the group a new directory goes to: the first one from the rotor on
+// with at least the average share of free inodes and data blocks
+static uint64_t dirgroup(void) {
+  uint64_t n = mnt.sb.ngroups;
+  uint64_t inodes = 0;
+  uint64_t blocks = 0;
+  for (uint64_t g = 0; g < n; g++) {
+    inodes += __atomic_load_n(&mnt.groups[g].freeinodes, __ATOMIC_RELAXED);
+    blocks += __atomic_load_n(&mnt.groups[g].freeblocks, __ATOMIC_RELAXED);
+  }
+  uint64_t start = __atomic_fetch_add(&mnt.rotor, 1, __ATOMIC_RELAXED) % n;
+  for (uint64_t i = 0; i < n; i++) {
+    struct allocgroup *g = &mnt.groups[(start + i) % n];
+    uint64_t freeinodes = __atomic_load_n(&g->freeinodes, __ATOMIC_RELAXED);
+    if (freeinodes > 0 && freeinodes * n >= inodes &&
+        __atomic_load_n(&g->freeblocks, __ATOMIC_RELAXED) * n >= blocks) {
+      return (start + i) % n;
+    }
+  }
+  return start;
+}
 
-  int dircount = 0;
-  printf("--- Directory entries ---\n");
-  int i = 0;
-  // while (i < 204) {
-  //   if (dirlist[i].name != "" && dirlist[i].finode != 0) {
-  //     printf("Filename: %s\nInode: %ld\n\n", dirlist[i].name, dirlist[i].finode);
-  //     // dircount++;
-  //   }
-  //   i++;
-  // }
-
-  // while (dirlist[i].finode != 0xffffffff) {
-  //   // printf("Filename: %s\nInode: %ld\n\n", dirlist[i].name, dirlist[i].finode);
-  //     dircount++;
-  //   i++;
-  // }
-  // for (int i = 0; i < length; i++) {
-  //   printf("Filename: %s, inode: %ld\n", dirlist[i].name, dirlist[i].finode);
-  // }
-  printf("--- End directory entries ---\n");
-  printf("# of entries: %d\n", dircount);
+// the group a file created outside any directory goes to; every thread
+// keeps to one, so threads allocate apart from each other
+static uint64_t threadgroup(void) {
+  static __thread uint64_t group = UINT64_MAX;
+  if (group == UINT64_MAX) {
+    group = __atomic_fetch_add(&mnt.rotor, 1, __ATOMIC_RELAXED);
+  }
+  return group % mnt.sb.ngroups;
 }
 
-char* ls(int handle, uint64_t dir_inode) {
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-  readfile(handle, dir_inode, bufferBlock, 4096);
+// moves count blocks from start on between the free counts of their
+// groups and the blocks in use
+static void groupcount(uint64_t start, uint64_t count, bool used) {
+  while (count > 0 && start >= mnt.sb.datastart) {
+    struct allocgroup *g = &mnt.groups[groupof(start)];
+    bool inodes = start < g->inodes.to;
+    uint64_t end = inodes ? g->inodes.to : g->data.to;
+    uint64_t n = end - start < count ? end - start : count;
+    uint64_t *counter = inodes ? &g->freeinodes : &g->freeblocks;
+    if (used) {
+      __atomic_sub_fetch(counter, n, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+    }
+    start += n;
+    count -= n;
+  }
+}
 
-  char strs[204][16];
-  int i = 0;
-  while (i < 204) {
-    if (dirlist[i].name != "" && dirlist[i].finode != 0) {
-      printf("Filename: %s\nInode: %ld\n\n", dirlist[i].name, dirlist[i].finode);
-      strcpy(strs[i], dirlist[i].name);
+// gives blocks or an inode back.  They only return to the bitmap and to
+// their group once the transaction that freed them has committed: until
+// then a crash brings back the file that held them, so nothing else may
+// be given them and write over its data, see applyfrees()
+static void releaseblocks(uint64_t start, uint64_t count) {
+  pthread_mutex_lock(&mnt.freedlock);
+  struct freedrun *last = mnt.nfreed > 0 ? &mnt.freed[mnt.nfreed - 1] : NULL;
+  if (last != NULL && last->start + last->count == start) {
+    last->count += count;
+    pthread_mutex_unlock(&mnt.freedlock);
+    return;
+  }
+  if (mnt.nfreed == mnt.freedcapacity) {
+    uint64_t capacity = mnt.freedcapacity > 0 ? mnt.freedcapacity * 2 : 64;
+    struct freedrun *freed = realloc(mnt.freed, capacity * sizeof(struct freedrun));
+    if (freed == NULL) {
+      // losing track of them only leaks them until a repair
+      pthread_mutex_unlock(&mnt.freedlock);
+      FSLOG(FSLOG_ERROR, "Out of memory, leaking %ld blocks from %ld\n", count, start);
+      return;
     }
-    i++;
+    mnt.freed = freed;
+    mnt.freedcapacity = capacity;
   }
-  return strs;
+  mnt.freed[mnt.nfreed++] = (struct freedrun) { start, count };
+  pthread_mutex_unlock(&mnt.freedlock);
 }
 
-int findinodebyfilename(int handle, uint64_t dir_inode, char* name) {
-  printf("Searching for file with name '%s'...\n", name);
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-  readfile(handle, dir_inode, bufferBlock, 4096);
+// gives everything freed before the last commit back to the bitmap and
+// the groups, for syncdisk() while it holds operations back.  The bitmap
+// blocks this changes join the next transaction, which is committed on
+// the way whenever it has no room left for them.  Returns how many runs
+// went back, or -1 if one of those commits failed
+static int64_t applyfrees(int handle) {
+  pthread_mutex_lock(&mnt.freedlock);
+  struct freedrun *freed = mnt.freed;
+  uint64_t n = mnt.nfreed;
+  mnt.freed = NULL;
+  mnt.nfreed = 0;
+  mnt.freedcapacity = 0;
+  pthread_mutex_unlock(&mnt.freedlock);
+  int64_t result = n;
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t start = freed[i].start;
+    uint64_t count = freed[i].count;
+    while (count > 0) {
+      // up to the end of a bitmap block at a time, so it dirties one
+      uint64_t span = BLOCK_SIZE * 8 - start % (BLOCK_SIZE * 8);
+      span = span < count ? span : count;
+      if (!txnroom(handle, 1) && commitdisk(handle) < 0) {
+        result = -1;
+      }
+      bitmapfree(start, span);
+      groupcount(start, span, false);
+      start += span;
+      count -= span;
+    }
+  }
+  free(freed);
+  return result;
+}
+
+// whether there are blocks that the next commit will free
+static bool freespending(void) {
+  return __atomic_load_n(&mnt.nfreed, __ATOMIC_RELAXED) > 0;
+}
 
-  int i = 0;
-  while (i < 204) {
-    if (dirlist[i].name == name) {
-      return dirlist[i].finode;
+// a free inode, from group g if it has one and otherwise from the next
+// group that does
+static int64_t allocinode(uint64_t g) {
+  for (uint64_t i = 0; i < mnt.sb.ngroups; i++) {
+    int64_t inode = bitmapalloc(&mnt.groups[(g + i) % mnt.sb.ngroups].inodes, 0);
+    if (inode >= 0) {
+      groupcount(inode, 1, true);
+      return inode;
     }
-    i++;
   }
-  printf("Could not find file with name '%s'\n\n", name);
   return -1;
 }
 
-void removedirentry(int handle, uint64_t dir_inode) {
-  // memmove in strings package
-  // you tell it 'here's where to go, wheres where to start'
+// one data block, in the group of goal if there is room, else in the next
+static int64_t allocblock(uint64_t goal) {
+  uint64_t g = groupof(goal);
+  for (uint64_t i = 0; i < mnt.sb.ngroups; i++) {
+    int64_t blocknum = bitmapalloc(&mnt.groups[(g + i) % mnt.sb.ngroups].data, goal);
+    if (blocknum >= 0) {
+      groupcount(blocknum, 1, true);
+      return blocknum;
+    }
+  }
+  return -1;
 }
 
-int hierdirsearch(int handle, char* name, int root_inode) {
-  // split filename into an array using / as a delimiter
-  // for each name in the split filename array, starting at the first inode,
-  // find the inode associated with that name
-  char *find;
-  find = strtok(name, "/");
-
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-  readfile(handle, root_inode, bufferBlock, 4096);
-  // start at the root inode.
-  int current_directory = root_inode;
-  int name_inode = 0;
-  // char* current_name = "";
-  char* last_name = find[countof(find) - 1];
-  for (int i = 0; i < countof(find); i++) {
-    // check the current directory for the current name.
-    // for each name in the file path, check if that file exists in current_directory.
-    // if so, update the name to that file's name, and current_directory to that file's inode.
-    name_inode = findinodebyfilename(handle, current_directory, find[i]);
-    // if the current name being searched for can't be found in the current directory, it doesn't exist.
-    if (name_inode < 0) {
-      break;
-    } else {
-      // if the current name searched for was found,
-      // and that name is the same as the last name,
-      // return that name's inode.
-      if (find[i] == last_name) {
-        return name_inode;
-      } else {
-        // otherwise, update the current directory.
-        current_directory = name_inode;
-      }
+// up to want contiguous data blocks, looked for the same way
+static uint64_t allocrun(uint64_t goal, uint64_t want, uint64_t *got) {
+  uint64_t g = groupof(goal);
+  *got = 0;
+  for (uint64_t i = 0; i < mnt.sb.ngroups; i++) {
+    uint64_t start = bitmapallocrun(&mnt.groups[(g + i) % mnt.sb.ngroups].data, goal, want, got);
+    if (*got > 0) {
+      groupcount(start, *got, true);
+      return start;
     }
   }
-  return -1;
+  return 0;
 }
 
-int adddirentry(int handle, uint64_t dir_inode, uint64_t file_inode, char* filename) {
-  assert(strlen(filename) <= 15);
-  // need to have writetofile done first, since you are recording a list of file inodes and their respective names to the dir inode's data blocks.
-  // struct dirent dirent;
-  // dirent.name = filename; // how to pad for 16 bytes?
-  // dirent.finode = ((uint8_t) file_inode);
-  // struct inode node;
-  // to grow an array, use realloc
-
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-  readfile(handle, dir_inode, bufferBlock, 4096);
-
-  bool nofreespace = false;
-  int i = 0;
-
-  while (dirlist[i].finode != dirlist[204].finode) {
-    if (dirlist[i].name == filename) {
-      printf("%s already exists in directory\n", filename);
-      return -1;
+// drops everything held in memory about the filesystem on a disk
+static void forgetdisk(int handle) {
+  for (int i = 0; i < DELALLOC_MAX_FILES; i++) {
+    if (mnt.pending[i].node != NULL && mnt.pending[i].handle == handle) {
+      pendingdrop(&mnt.pending[i]);
     }
-    i++;
   }
+  pthread_mutex_lock(&mnt.freedlock);
+  free(mnt.freed);
+  mnt.freed = NULL;
+  mnt.nfreed = 0;
+  mnt.freedcapacity = 0;
+  pthread_mutex_unlock(&mnt.freedlock);
+  mapcachedrop(handle);
+  iinvalidate(handle);
+  dcacheinvalidate(handle);
+}
 
-  assert(nofreespace == false);
+int diskformat(int handle, uint64_t size, uint64_t ninodes) {
+  // lay the disk out from its size and inode count;
+  // ninodes of 0 picks one inode per 16 blocks
+  uint64_t nblocks = size / BLOCK_SIZE;
+  if (ninodes == 0) {
+    ninodes = nblocks / 16 > 16 ? nblocks / 16 : 16;
+  }
 
-  i = 0;
-  // iterate through dir list until we find an empty entry
-  while (dirlist[i].finode != dirlist[204].finode) {
-    if (dirlist[i].finode == 0) {
-      // printf("!!!!!!!!!!!!!!free spot found for file entry!!!!!!!!!!!!!!!!\n");
-      // struct dirent new_entry;
-      // dirlist[i] = new_entry;
-      strcpy(dirlist[i].name, filename);
-      dirlist[i].finode = file_inode;
-      printf("In adddirentry: dirlist[i].name: %s\nExpected name: %s\nInode: %ld\n\n", dirlist[i].name, filename, dirlist[i].finode);
-      break;
+  // groups get smaller on small disks, so threads still have several
+  // to spread over; the descriptor table is sized for the most there
+  // can be
+  uint64_t groupblocks = GROUP_MAX_BLOCKS;
+  while (groupblocks > GROUP_MIN_BLOCKS && nblocks / groupblocks < GROUP_MIN_COUNT) {
+    groupblocks /= 2;
+  }
+  uint64_t maxgroups = nblocks / groupblocks > 0 ? nblocks / groupblocks : 1;
+
+  memset(&mnt.sb, 0, sizeof(mnt.sb));
+  mnt.sb.magic = MAGIC_NUM;
+  mnt.sb.nblocks = nblocks;
+  mnt.sb.disksize = nblocks * BLOCK_SIZE;
+  mnt.sb.gdtstart = 1;
+  mnt.sb.gdtblocks = (maxgroups + GROUPS_PER_BLOCK - 1) / GROUPS_PER_BLOCK;
+  mnt.sb.bitmapstart = mnt.sb.gdtstart + mnt.sb.gdtblocks;
+  mnt.sb.bitmapblocks = (nblocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+  mnt.sb.journalstart = mnt.sb.bitmapstart + mnt.sb.bitmapblocks;
+  // the journal grows with the disk, up to what one header can describe
+  mnt.sb.journalblocks = nblocks / 256;
+  if (mnt.sb.journalblocks < JOURNAL_BLOCKS) {
+    mnt.sb.journalblocks = JOURNAL_BLOCKS;
+  }
+  if (mnt.sb.journalblocks > JOURNAL_MAX_BLOCKS) {
+    mnt.sb.journalblocks = JOURNAL_MAX_BLOCKS;
+  }
+  mnt.sb.datastart = mnt.sb.journalstart + mnt.sb.journalblocks;
+  mnt.sb.inodestart = mnt.sb.datastart;
+
+  // the inodes are shared out evenly, and every group keeps some data blocks
+  uint64_t area = nblocks > mnt.sb.datastart ? nblocks - mnt.sb.datastart : 0;
+  mnt.sb.ngroups = area / groupblocks > 0 ? area / groupblocks : 1;
+  mnt.sb.groupblocks = mnt.sb.ngroups > 1 ? groupblocks : area;
+  mnt.sb.groupinodes = (ninodes + mnt.sb.ngroups - 1) / mnt.sb.ngroups;
+  mnt.sb.ninodes = mnt.sb.groupinodes * mnt.sb.ngroups;
+  uint64_t lastinode = mnt.sb.datastart + (mnt.sb.ngroups - 1) * mnt.sb.groupblocks + mnt.sb.groupinodes - 1;
+
+  // inode numbers are block numbers and are handed out as ints
+  if (mnt.sb.groupinodes >= mnt.sb.groupblocks || lastinode > INT32_MAX) {
+    FSLOG(FSLOG_ERROR, "Disk of %ld bytes is too small for %ld inodes\n", size, ninodes);
+    return -1;
+  }
+  // make sure every block of the layout can be read back
+  struct stat st;
+  if (fstat(handle, &st) == 0 && (uint64_t) st.st_size < mnt.sb.disksize) {
+    ftruncate(handle, mnt.sb.disksize);
+    if (mnt.image.handle == handle) {
+      // the mapping has to cover the grown image
+      unmapimage(handle);
+      mapimage(handle);
     }
-    i++;
   }
-  writetofile(handle, dir_inode, bufferBlock, 4096);
-  syncdisk(handle);
+
+  forgetdisk(handle);
+  mnt.handle = handle;
+  // the layout goes straight home, through the cache but not the journal,
+  // which only starts once it is there: a bitmap can outgrow a
+  // transaction, and a crash half way leaves no filesystem either way
+  cacheinvalidate(handle);
+  journalclose(handle);
+  writeblock(handle, 0, &mnt.sb);
+
+  // clear bitmap identifying used blocks,
+  // except for everything in front of the first group;
+  // inode blocks are marked as inodes get created
+  if (bitmapsetup(nblocks, mnt.sb.bitmapstart) < 0 || groupsetup() < 0) {
+    return -1;
+  }
+  for (uint64_t i = 0; i < mnt.sb.datastart; i++) {
+    setbit(i);
+  }
+  if (bitmapflush(handle) < 0 || groupflush(handle) < 0 || cacheflush(handle) < 0 ||
+      journalformat(handle, mnt.sb.journalstart, mnt.sb.journalblocks, mnt.sb.gdtblocks + 1) < 0 ||
+      rawsync(handle) < 0) {
+    FSLOG(FSLOG_ERROR, "could not write the layout\n");
+    return -1;
+  }
 
   return 0;
 }
 
-int writetofile(int handle, uint64_t inode, void *buffer, uint64_t size) {
-	struct inode node;
-	readblock(handle, inode, &node);
-
-  uint8_t bufferBlock[BLOCK_SIZE];
+// whether a superblock describes a layout diskformat() could have made
+static bool layoutvalid(const struct superblock *sb) {
+  return sb->nblocks > 0 && sb->disksize == sb->nblocks * BLOCK_SIZE &&
+         sb->gdtstart == 1 && sb->gdtblocks > 0 && sb->gdtblocks < sb->nblocks &&
+         sb->bitmapstart == sb->gdtstart + sb->gdtblocks &&
+         sb->bitmapblocks == (sb->nblocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8) &&
+         sb->journalstart == sb->bitmapstart + sb->bitmapblocks &&
+         sb->journalblocks >= 2 && sb->journalblocks <= JOURNAL_MAX_BLOCKS &&
+         sb->datastart == sb->journalstart + sb->journalblocks && sb->inodestart == sb->datastart &&
+         sb->ngroups > 0 && sb->ngroups <= sb->gdtblocks * GROUPS_PER_BLOCK &&
+         sb->groupinodes > 0 && sb->groupinodes < sb->groupblocks &&
+         sb->ninodes == sb->groupinodes * sb->ngroups &&
+         sb->groupblocks <= sb->nblocks && sb->datastart + sb->ngroups * sb->groupblocks <= sb->nblocks;
+}
 
-	if (size <= node.size && (node.size / BLOCK_SIZE) == 0) {
-  		writeblock(handle, inode + INODES, buffer);
-      syncdisk(handle);
-      return size;
-	}
+int mountdisk(int handle) {
+  // Take up the filesystem already on the disk instead of formatting it.
+  // Returns -1 if there is none, and the caller can format the disk.
+  // The superblock and the group descriptors are read, and after a clean
+  // closedisk() that is all: the free counts come from the descriptors
+  // and each bitmap block is read when it is first needed.  Otherwise
+  // the whole bitmap is read at once and the counts are rebuilt from it.
+  struct superblock sb;
+  struct stat st;
+  if (rawreadblock(handle, 0, &sb) < 0 || sb.magic != MAGIC_NUM) {
+    FSLOG(FSLOG_INFO, "No filesystem on the disk\n");
+    return -1;
+  }
+  if (!layoutvalid(&sb) || fstat(handle, &st) < 0 || (uint64_t) st.st_size < sb.disksize) {
+    FSLOG(FSLOG_ERROR, "Superblock describes a layout the disk cannot hold\n");
+    return -1;
+  }
 
-  else enlargefile(handle, inode, (size - node.size));
+  forgetdisk(handle);
+  mnt.sb = sb;
+  bool clean = sb.state == SB_CLEAN;
+  if (groupsetup() < 0 || rawreadblocks(handle, sb.gdtstart, sb.gdtblocks, mnt.gdt) < 0) {
+    mnt.sb.magic = 0;
+    return -1;
+  }
+  for (uint64_t g = 0; g < sb.ngroups; g++) {
+    struct allocgroup *group = &mnt.groups[g];
+    struct groupdesc *desc = &mnt.gdt[g];
+    if (desc->start != group->inodes.from || desc->ninodes != group->inodes.to - group->inodes.from ||
+        desc->nblocks != group->data.to - group->inodes.from) {
+      FSLOG(FSLOG_ERROR, "Group %ld does not match the superblock\n", g);
+      mnt.sb.magic = 0;
+      return -1;
+    }
+    // counts that cannot be right mean the disk needs checking after all
+    clean = clean && desc->freeinodes <= group->freeinodes && desc->freeblocks <= group->freeblocks;
+  }
+  if (bitmapsetup(sb.nblocks, sb.bitmapstart) < 0 || bitmapload(handle, clean) < 0) {
+    mnt.sb.magic = 0;
+    return -1;
+  }
 
-  int curr = 0;
-  for (uint64_t i = 0; i < size; i++) {
-    // if (i % (BLOCK_SIZE - 1) == 0) {
-      if (i % (BLOCK_SIZE) == 0) {
-        writeblock(handle, node.blocks[curr] + INODES, bufferBlock);
-        curr++;
+  uint64_t fixed = 0;
+  for (uint64_t g = 0; g < sb.ngroups; g++) {
+    struct allocgroup *group = &mnt.groups[g];
+    if (clean) {
+      group->freeinodes = mnt.gdt[g].freeinodes;
+      group->freeblocks = mnt.gdt[g].freeblocks;
+      continue;
     }
-    bufferBlock[i % BLOCK_SIZE] = ((uint8_t*) buffer)[i];
+    group->freeinodes = bitmapcountfree(group->inodes.from, group->inodes.to);
+    group->freeblocks = bitmapcountfree(group->data.from, group->data.to);
+    fixed += group->freeinodes != mnt.gdt[g].freeinodes || group->freeblocks != mnt.gdt[g].freeblocks;
   }
-  syncdisk(handle);
-  return size;
+  if (!clean) {
+    // the layout in front of the groups is always in use
+    for (uint64_t i = 0; i < sb.datastart; i++) {
+      if (!checkbitset(i)) {
+        setbit(i);
+        fixed++;
+      }
+    }
+    FSLOG(FSLOG_INFO, "Disk was not closed cleanly: bitmap checked, %ld counts corrected\n", fixed);
+  }
+
+  // until closedisk() says otherwise, the disk is checked on the next mount
+  mnt.handle = handle;
+  mnt.sb.state = 0;
+  if (rawwriteblock(handle, 0, &mnt.sb) < 0 || rawsync(handle) < 0) {
+    FSLOG(FSLOG_ERROR, "could not mark the disk in use\n");
+    return -1;
+  }
+  if (fixed > 0) {
+    bitmapflush(handle);
+    groupflush(handle);
+    syncdisk(handle);
+  }
+  FSLOG(FSLOG_INFO, "Mounted disk of %ld blocks, %ld groups%s\n", sb.nblocks, sb.ngroups,
+        clean ? "" : " after checking it");
+  return 0;
 }
 
-void deletedirectory(int handle, uint64_t dir_inode) {
-  // check if directory is empty.
-  uint8_t bufferBlock[BLOCK_SIZE];
-  struct dirent *dirlist = (struct dirent*) bufferBlock;
-  readfile(handle, dir_inode, bufferBlock, 4096);
-
-  bool empty = true;
-  int i = 0;
-  if (dirlist[0].finode == 0xffffffff) {
-    deletefile(handle, dir_inode);
-    printf("Success\n");
-    empty = true;
-  } else {
-    empty = false;
-    printf("huh\n");
-  }
-  // assert(empty == true);
-  // struct dirent* entries = unpackdata(handle, inode);
-  // if (countof(entries) == 0 || (entries[0].finode == 0)) {
-  //   deletefile(handle, inode);
-  //   return 0;
-  // } else {
-  //   printf("Directory with inode %ld is not empty\n", inode);
-  //   return -1;
-  // }
-  // if len(entries) == 0 or entry[0].finode == 0:
-    // deletefile(handle, inode);
-    // return 0
-  // else print error message
+void diskdump(int handle) {
+    // only the formatted disk has a layout to show
+    if (handle != mnt.handle) {
+      return;
+    }
+    printf("\nBegin Disk Dump...\n");
+    uint64_t freeinodes = 0;
+    uint64_t inactive = 0;
+    for (uint64_t g = 0; g < mnt.sb.ngroups; g++) {
+      freeinodes += mnt.groups[g].freeinodes;
+      inactive += mnt.groups[g].freeinodes + mnt.groups[g].freeblocks;
+    }
+    printf("Magic: %lx\n", mnt.sb.magic);
+    printf("Disk size (bytes): %ld\n", mnt.sb.disksize);
+    printf("Layout: groups table %ld+%ld, bitmap %ld+%ld, journal %ld+%ld, groups %ld+%ld\n",
+           mnt.sb.gdtstart, mnt.sb.gdtblocks, mnt.sb.bitmapstart, mnt.sb.bitmapblocks,
+           mnt.sb.journalstart, mnt.sb.journalblocks, mnt.sb.datastart, mnt.sb.nblocks - mnt.sb.datastart);
+    printf("Groups: %ld of %ld blocks, %ld inodes each\n",
+           mnt.sb.ngroups, mnt.sb.groupblocks, mnt.sb.groupinodes);
+    // a disk mounted after a clean close reads its bitmap as it goes
+    printf("Bitmap blocks read: %ld of %ld\n", mnt.sb.bitmapblocks - bitmapunloaded(), mnt.sb.bitmapblocks);
+    printf("Active blocks: %ld\n", mnt.sb.nblocks - inactive);
+    printf("Inactive blocks: %ld\n", inactive);
+    printf("Active inodes: %ld\n", mnt.sb.ninodes - freeinodes);
+    printf("Inactive inodes: %ld\n", freeinodes);
+    // show which inodes are currently being used or free on small disks
+    if (mnt.sb.ninodes <= INODES) {
+      char nodes[INODES + 1];
+      for (uint64_t i = 0; i < mnt.sb.ninodes; i++) {
+        nodes[i] = checkbitset(inodeblock(i)) ? '+' : '-';
+      }
+      nodes[mnt.sb.ninodes] = '\0';
+      printf("inodes = %s\n", nodes);
+    }
+    printf("End disk dump\n");
+}
+
+void dumpfileinfo(int handle, uint64_t inode) {
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    return;
+  }
+  ilock(node, false);
+
+  printf("\nBegin file dump...\n");
+  printf("File size: %ld\n", node->size);
+  printf("Last modified: %ld\n", node->mtime);
+  if (node->type) {
+    printf("Type: Directory\n");
+    dumpdirectory(handle, inode);
+  } else {
+    printf("Type: Regular file\n");
+  }
+  printf("Inode: %ld\n", inode);
+  if (node->flags & INODE_INLINE) {
+    printf("Data: inline, in the inode block\n");
+  }
+  printf("Extents: %d\n", node->nextents);
+  struct pendingwrite *p = pendingof(node);
+  if (p != NULL) {
+    printf("Blocks waiting for allocation: %ld\n", p->nblocks);
+  }
+  if (node->indirect != 0) {
+    printf("Indirect extent block: %ld\n", node->indirect);
+  }
+  if (node->dindirect != 0) {
+    printf("Double indirect extent block: %ld\n", node->dindirect);
+  }
+  for (uint32_t i = 0; i < node->nextents; i++) {
+    struct extent e;
+    getextent(handle, node, i, &e);
+    printf("  [%d] logical %d, %d blocks at block %ld\n", i, e.lblk, e.len, e.start);
+  }
+  printf("End file dump\n\n");
+  iunlock(node);
+  iput(node);
+}
+
+// number of blocks needed to hold size bytes
+uint64_t blocksfor(uint64_t size) {
+  return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Extents past the ones held in the inode live in map blocks: the
+// indirect block holds the next EXTENTS_PER_BLOCK of them, and the double
+// indirect block points at further blocks of extents.  Decoded map blocks
+// are kept in a small cache so that walking a file's extents in order
+// reads each map block once instead of once per data block.  The cache
+// is shared by every file, so its slots are only touched with maplock
+// held; extents held in the inode need nothing beyond the inode's lock.
+
+#define MAPCACHE_SLOTS 16
+
+struct mapblock {
+  int handle;
+  uint64_t blocknum;        // 0 marks an empty slot
+  uint64_t lastuse;
+  union {
+    struct extent extents[EXTENTS_PER_BLOCK];
+    uint64_t pointers[POINTERS_PER_BLOCK];
+  };
+};
+
+static struct mapblock mapcache[MAPCACHE_SLOTS];
+static uint64_t mapclock = 0;
+static pthread_mutex_t maplock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mapblock *loadmapblock(int handle, uint64_t blocknum) {
+  struct mapblock *victim = &mapcache[0];
+  for (int i = 0; i < MAPCACHE_SLOTS; i++) {
+    if (mapcache[i].blocknum == blocknum && mapcache[i].handle == handle) {
+      mapcache[i].lastuse = ++mapclock;
+      return &mapcache[i];
+    }
+    if (mapcache[i].lastuse < victim->lastuse) {
+      victim = &mapcache[i];
+    }
+  }
+  if (readblock(handle, blocknum, victim->extents) < 0) {
+    return NULL;
+  }
+  victim->handle = handle;
+  victim->blocknum = blocknum;
+  victim->lastuse = ++mapclock;
+  return victim;
+}
+
+static void mapcacheinvalidate(int handle, uint64_t blocknum) {
+  // blocknum of 0 drops every map block of handle
+  for (int i = 0; i < MAPCACHE_SLOTS; i++) {
+    if (mapcache[i].handle == handle && (blocknum == 0 || mapcache[i].blocknum == blocknum)) {
+      mapcache[i].blocknum = 0;
+      mapcache[i].lastuse = 0;
+    }
+  }
+}
+
+// forgets every map block of handle, for closedisk() and diskformat()
+static void mapcachedrop(int handle) {
+  pthread_mutex_lock(&maplock);
+  mapcacheinvalidate(handle, 0);
+  pthread_mutex_unlock(&maplock);
+}
+
+// claims a zeroed map block near goal, or returns 0 if the disk is full;
+// this and freemapblock() are called with maplock held
+static uint64_t newmapblock(int handle, uint64_t goal) {
+  int64_t blocknum = allocblock(goal);
+  if (blocknum < 0) {
+    return 0;
+  }
+  uint8_t zero[BLOCK_SIZE];
+  memset(zero, 0, BLOCK_SIZE);
+  mapcacheinvalidate(handle, blocknum);
+  writeblock(handle, blocknum, zero);
+  return blocknum;
+}
+
+static void freemapblock(int handle, uint64_t blocknum) {
+  // the block may come back as file data, which bypasses the cache,
+  // so no stale copy of it may be written home later
+  mapcacheinvalidate(handle, blocknum);
+  cachediscard(handle, blocknum);
+  releaseblocks(blocknum, 1);
+}
+
+// copies extent k of the file into out
+static int getextent(int handle, struct inode *node, uint64_t k, struct extent *out) {
+  if (k < NEXTENTS) {
+    *out = node->extents[k];
+    return 0;
+  }
+  k -= NEXTENTS;
+  pthread_mutex_lock(&maplock);
+  uint64_t blocknum = node->indirect;
+  if (k >= EXTENTS_PER_BLOCK) {
+    k -= EXTENTS_PER_BLOCK;
+    struct mapblock *dind = loadmapblock(handle, node->dindirect);
+    blocknum = dind != NULL ? dind->pointers[k / EXTENTS_PER_BLOCK] : 0;
+    k %= EXTENTS_PER_BLOCK;
+  }
+  struct mapblock *leaf = blocknum != 0 ? loadmapblock(handle, blocknum) : NULL;
+  if (leaf != NULL) {
+    *out = leaf->extents[k];
+  }
+  pthread_mutex_unlock(&maplock);
+  return leaf != NULL ? 0 : -1;
+}
+
+// stores extent k past the ones in the inode, with maplock held
+static int putmapextent(int handle, struct inode *node, uint64_t k, struct extent *in) {
+  uint64_t *slot = &node->indirect;
+  if (k >= EXTENTS_PER_BLOCK) {
+    k -= EXTENTS_PER_BLOCK;
+    if (node->dindirect == 0 && (node->dindirect = newmapblock(handle, in->start)) == 0) {
+      return -1;
+    }
+    struct mapblock *dind = loadmapblock(handle, node->dindirect);
+    if (dind == NULL) {
+      return -1;
+    }
+    if (dind->pointers[k / EXTENTS_PER_BLOCK] == 0) {
+      uint64_t leafnum = newmapblock(handle, in->start);
+      if (leafnum == 0) {
+        return -1;
+      }
+      dind = loadmapblock(handle, node->dindirect);
+      dind->pointers[k / EXTENTS_PER_BLOCK] = leafnum;
+      writeblock(handle, dind->blocknum, dind->pointers);
+    }
+    slot = &dind->pointers[k / EXTENTS_PER_BLOCK];
+    k %= EXTENTS_PER_BLOCK;
+  }
+  if (*slot == 0 && (*slot = newmapblock(handle, in->start)) == 0) {
+    return -1;
+  }
+  struct mapblock *leaf = loadmapblock(handle, *slot);
+  if (leaf == NULL) {
+    return -1;
+  }
+  leaf->extents[k] = *in;
+  return writeblock(handle, leaf->blocknum, leaf->extents);
+}
+
+// stores extent k of the file, allocating map blocks on the way if needed;
+// the caller writes the inode afterwards
+static int putextent(int handle, struct inode *node, uint64_t k, struct extent *in) {
+  if (k < NEXTENTS) {
+    node->extents[k] = *in;
+    return 0;
+  }
+  pthread_mutex_lock(&maplock);
+  int result = putmapextent(handle, node, k - NEXTENTS, in);
+  pthread_mutex_unlock(&maplock);
+  return result;
+}
+
+// frees the map blocks no longer needed by the first node->nextents extents
+static void trimmapblocks(int handle, struct inode *node) {
+  uint64_t n = node->nextents;
+  pthread_mutex_lock(&maplock);
+  if (node->dindirect != 0) {
+    uint64_t beyond = n > NEXTENTS + EXTENTS_PER_BLOCK ? n - NEXTENTS - EXTENTS_PER_BLOCK : 0;
+    uint64_t keep = (beyond + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    struct mapblock *dind = loadmapblock(handle, node->dindirect);
+    if (dind != NULL) {
+      bool changed = false;
+      for (uint64_t i = keep; i < POINTERS_PER_BLOCK; i++) {
+        if (dind->pointers[i] != 0) {
+          uint64_t leafnum = dind->pointers[i];
+          dind->pointers[i] = 0;
+          changed = true;
+          freemapblock(handle, leafnum);
+          dind = loadmapblock(handle, node->dindirect);
+        }
+      }
+      if (keep == 0) {
+        freemapblock(handle, node->dindirect);
+        node->dindirect = 0;
+      } else if (changed) {
+        writeblock(handle, dind->blocknum, dind->pointers);
+      }
+    }
+  }
+  if (node->indirect != 0 && n <= NEXTENTS) {
+    freemapblock(handle, node->indirect);
+    node->indirect = 0;
+  }
+  pthread_mutex_unlock(&maplock);
+}
+
+// number of logical blocks the extent list currently maps
+static uint64_t mappedblocks(int handle, struct inode *node) {
+  struct extent last;
+  if (node->nextents == 0 || getextent(handle, node, node->nextents - 1, &last) < 0) {
+    return 0;
+  }
+  return (uint64_t) last.lblk + last.len;
+}
+
+// extends the extent list so it maps nblocks logical blocks;
+// returns -1 if the disk is full or the extent list has no room
+static int mapblocks(int handle, uint64_t inode, struct inode *node, uint64_t nblocks) {
+  uint64_t have = mappedblocks(handle, node);
+  while (have < nblocks) {
+    // right after the last extent, or in the inode's own group
+    struct extent last;
+    bool haslast = node->nextents > 0 && getextent(handle, node, node->nextents - 1, &last) == 0;
+    uint64_t goal = haslast ? last.start + last.len : inode;
+    uint64_t got = 0;
+    uint64_t start = allocrun(goal, nblocks - have, &got);
+    if (got == 0) {
+      return -1;
+    }
+
+    if (haslast && last.start + last.len == start && last.len + got <= UINT32_MAX) {
+      last.len += got;
+      putextent(handle, node, node->nextents - 1, &last);
+    } else {
+      struct extent e = { have, got, start };
+      if (node->nextents >= MAX_EXTENTS || putextent(handle, node, node->nextents, &e) < 0) {
+        releaseblocks(start, got);
+        return -1;
+      }
+      node->nextents++;
+    }
+    have += got;
+  }
+  return 0;
+}
+
+// releases every mapped block at or past logical block nblocks
+static void unmapblocks(int handle, struct inode *node, uint64_t nblocks) {
+  while (node->nextents > 0) {
+    struct extent e;
+    if (getextent(handle, node, node->nextents - 1, &e) < 0) {
+      break;
+    }
+    if ((uint64_t) e.lblk + e.len <= nblocks) {
+      break;
+    }
+    uint64_t keep = e.lblk >= nblocks ? 0 : nblocks - e.lblk;
+    releaseblocks(e.start + keep, e.len - keep);
+    if (node->type == FILETYPE_DIRECTORY) {
+      // directory blocks went through the cache; file data never does
+      for (uint64_t i = keep; i < e.len; i++) {
+        cachediscard(handle, e.start + i);
+      }
+    }
+    if (keep == 0) {
+      node->nextents--;
+    } else {
+      e.len = keep;
+      putextent(handle, node, node->nextents - 1, &e);
+    }
+  }
+  trimmapblocks(handle, node);
+}
+
+// releases the blocks and the number of an inode the caller holds
+// locked exclusively, along with the caller's reference
+static void freeinode(int handle, uint64_t inode, struct inode *node) {
+  if (node->type == FILETYPE_DIRECTORY) {
+    // names looked up in it mean nothing once its inode is reused
+    dcacheinvalidatedir(handle, inode);
+  }
+  struct pendingwrite *p = pendingof(node);
+  if (p != NULL) {
+    pendingdrop(p);
+  }
+  unmapblocks(handle, node, 0);
+  iunlock(node);
+  iput(node);
+  idiscard(handle, inode);
+  releaseblocks(inode, 1);
+  bitmapflush(handle);
+}
+
+static void dodeletefile(int handle, uint64_t inode) {
+  txnbegin(handle);
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    txnend(handle);
+    return;
+  }
+  ilock(node, true);
+  freeinode(handle, inode, node);
+  txnend(handle);
+}
+
+void deletefile(int handle, uint64_t inode) {
+  uint64_t t = statsclock();
+  dodeletefile(handle, inode);
+  statsop(OP_DELETE, t, false);
+  TRACE(TRACE_DELETE, t, NULL, inode);
+}
+
+int createfile(int handle, uint64_t filesize, uint64_t filetype) {
+  return createfilein(handle, filesize, filetype, 0);
+}
+
+static int docreatefilein(int handle, uint64_t filesize, uint64_t filetype, uint64_t dir_inode) {
+  // Same as createfile(), for a file that will be entered in dir_inode:
+  // it is placed in the directory's allocation group.
+  // A dir_inode of 0 means no directory.
+  txnbegin(handle);
+
+  // the inode gets the next free block of its group's inode slice
+  uint64_t group = 0;
+  if (mnt.sb.ngroups > 0) {
+    if (filetype == FILETYPE_DIRECTORY) {
+      group = dirgroup();
+    } else if (dir_inode != 0) {
+      group = groupof(dir_inode);
+    } else {
+      group = threadgroup();
+    }
+  }
+  // the inode and its bitmap block, and a directory's blocks
+  uint64_t cost = 2;
+  if (filetype != FILETYPE_REGULAR && mnt.sb.ngroups > 0) {
+    cost += alloccost(mnt.groups[group].inodes.from, blocksfor(filesize)) + mapcost(0, blocksfor(filesize));
+  }
+  int reserved = txnreserve(handle, cost);
+  if (reserved < 0) {
+    txnend(handle);
+    return reserved;
+  }
+  int64_t inode = allocinode(group);
+  if (inode < 0) {
+    FSLOG(FSLOG_ERROR, "No free inodes\n");
+    txnend(handle);
+    return -1;
+  }
+  struct inode *node = inew(handle, inode);
+  if (node == NULL) {
+    releaseblocks(inode, 1);
+    txnend(handle);
+    return -1;
+  }
+  node->size = filesize;
+  node->mtime = time(NULL);
+  node->type = filetype;
+
+  // a small file lives in its inode block and needs no data blocks;
+  // a bigger one starts out as a hole and gets them as it is written,
+  // while a directory gets its blocks handed out as contiguous runs
+  if (filetype == FILETYPE_REGULAR && filesize <= INLINE_MAX) {
+    node->flags = INODE_INLINE;
+  } else if (filetype == FILETYPE_REGULAR ? blocksfor(filesize) > UINT32_MAX :
+             freedatablocks() < (int64_t) blocksfor(filesize) || mapblocks(handle, inode, node, blocksfor(filesize)) < 0) {
+    FSLOG(FSLOG_ERROR, "Insufficient space for file of %ld bytes\n", filesize);
+    unmapblocks(handle, node, 0);
+    iput(node);
+    idiscard(handle, inode);
+    releaseblocks(inode, 1);
+    txnend(handle);
+    return -1;
+  }
+
+  // the inode itself reaches the disk when the transaction commits
+  iput(node);
+  bitmapflush(handle);
+  txnend(handle);
+  return inode;
+}
+
+int createfilein(int handle, uint64_t filesize, uint64_t filetype, uint64_t dir_inode) {
+  uint64_t t = statsclock();
+  int inode;
+  do {
+    inode = docreatefilein(handle, filesize, filetype, dir_inode);
+  } while (inode == TXN_FULL);
+  inode = inode == TXN_TOOBIG ? -1 : inode;
+  statsop(OP_CREATE, t, inode < 0);
+  TRACE(TRACE_CREATE, t, NULL, filesize, filetype, dir_inode, inode);
+  return inode;
+}
+
+// grows the file to newsize bytes, mapping blocks for the new part;
+// returns -1 if the disk is full and -2 if the extent list is
+static int growfile(int handle, uint64_t inode, struct inode *node, uint64_t newsize) {
+  if (node->flags & INODE_INLINE) {
+    if (newsize <= INLINE_MAX) {
+      node->size = newsize;
+      node->mtime = time(NULL);
+      return 0;
+    }
+    if (uninline(handle, inode, node) < 0) {
+      return -1;
+    }
+  }
+  uint64_t used = mappedblocks(handle, node);
+  uint64_t needed = blocksfor(newsize);
+  if (needed > used) {
+    if (freedatablocks() < (int64_t) (needed - used)) {
+      return -1;
+    }
+    if (mapblocks(handle, inode, node, needed) < 0) {
+      unmapblocks(handle, node, used);
+      bitmapflush(handle);
+      return -2;
+    }
+    bitmapflush(handle);
+  }
+  node->size = newsize;
+  node->mtime = time(NULL);
+  return 0;
+}
+
+static int doenlargefile(int handle, uint64_t inode, uint64_t size) {
+  // access the inode at the given block number
+  txnbegin(handle);
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    txnend(handle);
+    return -1;
+  }
+  ilock(node, true);
+  // appends waiting for blocks get them first, behind the ones the file has
+  struct pendingwrite *p = pendingof(node);
+  uint64_t cost = 1 + (p != NULL ? pendingcost(handle, inode, node, p->nblocks) : 0) +
+                  ((node->flags & INODE_INLINE) ? alloccost(inode, 1) : 0);
+  int reserved = txnreserve(handle, cost);
+  if (reserved < 0) {
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return reserved;
+  }
+  if (p != NULL) {
+    pendingflush(p);
+  }
+  int result = node->size;
+
+  if (size == 0) {
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return result;
+  }
+  FSLOG(FSLOG_INFO, "Increasing size of file w/ inode %ld by %ld bytes...\n", inode, size);
+
+  // check that the file would still fit in the logical blocks an extent
+  // can address; the disk itself need not have room, see below
+  if (blocksfor(node->size + size) > UINT32_MAX) {
+    FSLOG(FSLOG_ERROR, "File would be too large, continuing\n");
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return result;
+  }
+
+  // the new part is a hole: it reads back as zeros and only gets blocks
+  // once something is written to it, so only an inline file that no
+  // longer fits in its inode needs any space here
+  if ((node->flags & INODE_INLINE) && node->size + size > INLINE_MAX && uninline(handle, inode, node) < 0) {
+    FSLOG(FSLOG_ERROR, "Insufficient space, continuing\n");
+  } else {
+    node->size += size;
+    node->mtime = time(NULL);
+    FSLOG(FSLOG_INFO, "Done!\n");
+    imarkdirty(node);
+  }
+  result = node->size;
+  iunlock(node);
+  iput(node);
+  txnend(handle);
+  return result;
+}
+
+int enlargefile(int handle, uint64_t inode, uint64_t size) {
+  uint64_t t = statsclock();
+  int result;
+  do {
+    result = doenlargefile(handle, inode, size);
+  } while (result == TXN_FULL);
+  result = result == TXN_TOOBIG ? -1 : result;
+  statsop(OP_ENLARGE, t, result < 0);
+  TRACE(TRACE_ENLARGE, t, NULL, inode, size, result);
+  return result;
+}
+
+static int doshrinkfile(int handle, uint64_t inode, uint64_t size) {
+  FSLOG(FSLOG_INFO, "Decreasing file size by %ld bytes...\n", size);
+  // access the inode at the given block number
+  txnbegin(handle);
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    txnend(handle);
+    return -1;
+  }
+  ilock(node, true);
+  struct pendingwrite *p = pendingof(node);
+  int reserved = txnreserve(handle, 4 + (p != NULL ? pendingcost(handle, inode, node, p->nblocks) : 0));
+  if (reserved < 0) {
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return reserved;
+  }
+  if (p != NULL) {
+    pendingflush(p);
+  }
+
+  // if we're shrinking past the size of the file:
+  if (size > node->size) {
+    FSLOG(FSLOG_ERROR, "Invalid size, shrink size is greater than file size\n");
+    int result = node->size;
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return result;
+  }
+
+  // calculate how many blocks the node currently uses
+  // and how many it needs once the file is smaller
+  uint64_t used = mappedblocks(handle, node);
+  uint64_t needed = blocksfor(node->size - size);
+
+  // bytes past the end of a file are kept zero, so that growing it
+  // again reads back a hole rather than what was cut off
+  if (node->flags & INODE_INLINE) {
+    memset(node->data + (node->size - size), 0, size);
+  } else if ((node->size - size) % BLOCK_SIZE != 0) {
+    uint64_t cut = node->size - size;
+    uint64_t blockend = blocksfor(cut) * BLOCK_SIZE;
+    zerorange(handle, node, cut, (blockend < node->size ? blockend : node->size) - cut);
+  }
+  if (needed < used) {
+    // free the tail of the extent list
+    FSLOG(FSLOG_INFO, "Decreasing number of blocks allocated to file...\n");
+    unmapblocks(handle, node, needed);
+    bitmapflush(handle);
+  }
+  FSLOG(FSLOG_INFO, "Done!\n");
+  node->size -= size;
+  node->mtime = time(NULL);
+  imarkdirty(node);
+  int result = node->size;
+  iunlock(node);
+  iput(node);
+  txnend(handle);
+  return result;
+}
+
+int shrinkfile(int handle, uint64_t inode, uint64_t size) {
+  uint64_t t = statsclock();
+  int result;
+  do {
+    result = doshrinkfile(handle, inode, size);
+  } while (result == TXN_FULL);
+  result = result == TXN_TOOBIG ? -1 : result;
+  statsop(OP_SHRINK, t, result < 0);
+  TRACE(TRACE_SHRINK, t, NULL, inode, size, result);
+  return result;
+}
+
+// index of the first extent that ends past logical block lblk,
+// or node->nextents if there is none
+static uint32_t extentindex(int handle, struct inode *node, uint64_t lblk) {
+  uint32_t lo = 0;
+  uint32_t hi = node->nextents;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    struct extent e;
+    if (getextent(handle, node, mid, &e) < 0) {
+      return node->nextents;
+    }
+    if ((uint64_t) e.lblk + e.len <= lblk) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// physical block behind logical block lblk of a file, or 0 if there is none
+static uint64_t bmap(int handle, struct inode *node, uint64_t lblk) {
+  uint32_t i = extentindex(handle, node, lblk);
+  struct extent e;
+  if (i >= node->nextents || getextent(handle, node, i, &e) < 0 || lblk < e.lblk) {
+    return 0;
+  }
+  return e.start + (lblk - e.lblk);
+}
+
+// Sparse files.  Logical blocks that no extent covers are holes: they
+// read back as zeros without any I/O and get blocks only once they are
+// written, so growing a file costs nothing and punchhole() can hand the
+// blocks in the middle of one back.  The extent list stays sorted by
+// lblk, with the gaps in it where the holes are.
+
+// moves extents k onwards up one place and stores e as extent k
+static int insertextent(int handle, struct inode *node, uint64_t k, struct extent *e) {
+  if (node->nextents >= MAX_EXTENTS) {
+    return -1;
+  }
+  for (uint64_t i = node->nextents; i > k; i--) {
+    struct extent moved;
+    if (getextent(handle, node, i - 1, &moved) < 0 || putextent(handle, node, i, &moved) < 0) {
+      return -1;
+    }
+  }
+  if (putextent(handle, node, k, e) < 0) {
+    return -1;
+  }
+  node->nextents++;
+  return 0;
+}
+
+// drops extent k, moving the ones after it down one place;
+// the caller trims the map blocks once it is done
+static void removeextent(int handle, struct inode *node, uint64_t k) {
+  for (uint64_t i = k + 1; i < node->nextents; i++) {
+    struct extent moved;
+    if (getextent(handle, node, i, &moved) == 0) {
+      putextent(handle, node, i - 1, &moved);
+    }
+  }
+  node->nextents--;
+}
+
+// number of logical blocks in [first, last] that fall in holes
+static uint64_t holeblocks(int handle, struct inode *node, uint64_t first, uint64_t last) {
+  uint64_t holes = 0;
+  uint64_t lblk = first;
+  for (uint32_t k = extentindex(handle, node, first); k < node->nextents && lblk <= last; k++) {
+    struct extent e;
+    if (getextent(handle, node, k, &e) < 0 || e.lblk > last) {
+      break;
+    }
+    if (e.lblk > lblk) {
+      holes += e.lblk - lblk;
+    }
+    lblk = (uint64_t) e.lblk + e.len;
+  }
+  return lblk <= last ? holes + (last - lblk + 1) : holes;
+}
+
+// Room in the running transaction.  An operation that may dirty more
+// blocks than TXN_CREDITS adds up an upper bound on them before it
+// changes anything and asks txnreserve() for it.
+
+// map blocks rewritten when extents k onwards of a file that ends up
+// with n of them are stored, the double indirect block included
+static uint64_t mapcost(uint64_t k, uint64_t n) {
+  n = n < MAX_EXTENTS ? n : MAX_EXTENTS;
+  if (n <= NEXTENTS || k >= n) {
+    return 0;
+  }
+  uint64_t from = k > NEXTENTS ? k - NEXTENTS : 0;
+  return (n - 1 - NEXTENTS) / EXTENTS_PER_BLOCK - from / EXTENTS_PER_BLOCK + 2;
+}
+
+// bitmap blocks dirtied by handing out count blocks from goal on: a
+// group is used up before the next is tried, so two for every group it
+// takes to find that many free, and two for the map blocks on the way
+static uint64_t alloccost(uint64_t goal, uint64_t count) {
+  uint64_t groups = 0;
+  uint64_t found = 0;
+  for (uint64_t g = groupof(goal); found < count && groups < mnt.sb.ngroups; g = (g + 1) % mnt.sb.ngroups) {
+    found += __atomic_load_n(&mnt.groups[g].freeblocks, __ATOMIC_RELAXED);
+    groups++;
+  }
+  uint64_t cost = 2 * groups + 2;
+  return cost < mnt.sb.bitmapblocks ? cost : mnt.sb.bitmapblocks;
+}
+
+// blocks dirtied by mapholes() filling the holes among logical blocks
+// [first, last], each from the goal it will use
+static uint64_t holecost(int handle, uint64_t inode, struct inode *node, uint64_t first, uint64_t last) {
+  uint32_t k = extentindex(handle, node, first);
+  struct extent prev;
+  bool hasprev = k > 0 && getextent(handle, node, k - 1, &prev) == 0;
+  uint64_t holes = 0;
+  uint64_t bitmap = 0;
+  uint64_t lblk = first;
+  for (uint32_t i = k; lblk <= last; i++) {
+    struct extent e;
+    bool hasnext = i < node->nextents && getextent(handle, node, i, &e) == 0 && e.lblk <= last;
+    uint64_t holeend = hasnext ? e.lblk : last + 1;
+    if (holeend > lblk) {
+      bitmap += alloccost(hasprev ? prev.start + (lblk - prev.lblk) : inode, holeend - lblk);
+      holes += holeend - lblk;
+    }
+    if (!hasnext) {
+      break;
+    }
+    lblk = (uint64_t) e.lblk + e.len;
+    prev = e;
+    hasprev = true;
+  }
+  if (holes == 0) {
+    return 0;
+  }
+  bitmap = bitmap < mnt.sb.bitmapblocks ? bitmap : mnt.sb.bitmapblocks;
+  return bitmap + mapcost(k, node->nextents + holes);
+}
+
+// gives blocks to every hole among logical blocks [first, last]; each
+// goes where it would sit if the file were contiguous from the extent
+// before it, so filling a file in any order still lays it out in one run
+static int mapholes(int handle, uint64_t inode, struct inode *node, uint64_t first, uint64_t last) {
+  uint64_t lblk = first;
+  while (lblk <= last) {
+    uint32_t k = extentindex(handle, node, lblk);
+    struct extent next;
+    bool hasnext = k < node->nextents && getextent(handle, node, k, &next) == 0;
+    if (hasnext && next.lblk <= lblk) {
+      lblk = (uint64_t) next.lblk + next.len;
+      continue;
+    }
+    uint64_t holeend = hasnext && next.lblk <= last ? next.lblk : last + 1;
+    struct extent prev;
+    bool hasprev = k > 0 && getextent(handle, node, k - 1, &prev) == 0;
+    uint64_t goal = hasprev ? prev.start + (lblk - prev.lblk) : inode;
+    uint64_t got = 0;
+    uint64_t start = allocrun(goal, holeend - lblk, &got);
+    if (got == 0) {
+      return -1;
+    }
+
+    if (hasprev && (uint64_t) prev.lblk + prev.len == lblk && prev.start + prev.len == start &&
+        prev.len + got <= UINT32_MAX) {
+      prev.len += got;
+      putextent(handle, node, k - 1, &prev);
+    } else {
+      struct extent e = { lblk, got, start };
+      if (insertextent(handle, node, k, &e) < 0) {
+        releaseblocks(start, got);
+        return -1;
+      }
+    }
+    lblk += got;
+  }
+  return 0;
+}
+
+// makes sure every block the bytes [offset, offset + size) fall in is
+// mapped before they are written; the rest of a partly written block that
+// was a hole still has to read as zeros, so such a block is cleared first
+static int mapwrite(int handle, uint64_t inode, struct inode *node, uint64_t offset, uint64_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  uint64_t first = offset / BLOCK_SIZE;
+  uint64_t last = (offset + size - 1) / BLOCK_SIZE;
+  uint64_t holes = holeblocks(handle, node, first, last);
+  if (holes == 0) {
+    return 0;
+  }
+  if (freedatablocks() < (int64_t) holes) {
+    return -1;
+  }
+  bool clearhead = offset % BLOCK_SIZE != 0 || size < BLOCK_SIZE;
+  bool cleartail = last != first && (offset + size) % BLOCK_SIZE != 0;
+  clearhead = clearhead && bmap(handle, node, first) == 0;
+  cleartail = cleartail && bmap(handle, node, last) == 0;
+  int result = mapholes(handle, inode, node, first, last);
+  bitmapflush(handle);
+  if (result < 0) {
+    return -1;
+  }
+
+  uint8_t zeros[BLOCK_SIZE] = {0};
+  uint64_t blocknums[2];
+  void *buffers[2] = { zeros, zeros };
+  int n = 0;
+  if (clearhead) {
+    blocknums[n++] = bmap(handle, node, first);
+  }
+  if (cleartail) {
+    blocknums[n++] = bmap(handle, node, last);
+  }
+  return n > 0 ? writeblocks(handle, blocknums, buffers, n) : 0;
+}
+
+// where logical block lblk of a range starting at byte offset is moved to
+// or from: the caller's buffer, or the bounce block of a partial end
+static uint8_t* rangeblock(uint8_t *buffer, uint64_t offset, uint64_t lblk, uint64_t last, uint8_t *head, uint8_t *tail) {
+  if (lblk == offset / BLOCK_SIZE && head != NULL) {
+    return head;
+  }
+  if (lblk == last && tail != NULL) {
+    return tail;
+  }
+  return buffer + (lblk * BLOCK_SIZE - offset);
+}
+
+// Moves the bytes [offset, offset + size) of a file between the disk and
+// buffer, touching only the extents that overlap the range.  Whole blocks
+// go straight to or from the caller's buffer; only a partly covered first
+// or last block passes through a bounce block, and a write keeps the bytes
+// of it that fall outside the range.  The blocks are handed to
+// readblocks()/writeblocks() in batches, so every physically contiguous
+// run costs one system call.  A read fills holes with zeros; a write
+// skips them, so the caller maps them first.
+static int filerange(int handle, struct inode *node, uint8_t *buffer, uint64_t offset, uint64_t size, bool write) {
+  if (size == 0) {
+    return 0;
+  }
+  uint64_t end = offset + size;
+  uint64_t first = offset / BLOCK_SIZE;
+  uint64_t last = (end - 1) / BLOCK_SIZE;
+  bool headpartial = offset % BLOCK_SIZE != 0 || end < (first + 1) * BLOCK_SIZE;
+  bool tailpartial = last != first && end % BLOCK_SIZE != 0;
+  uint64_t headbytes = (first + 1) * BLOCK_SIZE - offset < size ? (first + 1) * BLOCK_SIZE - offset : size;
+  uint64_t tailbytes = end - last * BLOCK_SIZE;
+  uint8_t headblock[BLOCK_SIZE];
+  uint8_t tailblock[BLOCK_SIZE];
+  uint8_t *head = headpartial ? headblock : NULL;
+  uint8_t *tail = tailpartial ? tailblock : NULL;
+
+  // a write merges into the old contents of the partial blocks
+  if (write && (headpartial || tailpartial)) {
+    uint64_t blocknums[2];
+    void *buffers[2];
+    int n = 0;
+    if (headpartial) {
+      blocknums[n] = bmap(handle, node, first);
+      buffers[n++] = head;
+    }
+    if (tailpartial) {
+      blocknums[n] = bmap(handle, node, last);
+      buffers[n++] = tail;
+    }
+    if (blocknums[0] == 0 || blocknums[n - 1] == 0 || readblocks(handle, blocknums, buffers, n) < 0) {
+      return -1;
+    }
+    if (headpartial) {
+      memcpy(head + offset % BLOCK_SIZE, buffer, headbytes);
+    }
+    if (tailpartial) {
+      memcpy(tail, buffer + (last * BLOCK_SIZE - offset), tailbytes);
+    }
+  }
+
+  uint64_t *blocknums = malloc(IO_BATCH_BLOCKS * sizeof(uint64_t));
+  void **buffers = malloc(IO_BATCH_BLOCKS * sizeof(void*));
+  if (blocknums == NULL || buffers == NULL) {
+    free(blocknums);
+    free(buffers);
+    return -1;
+  }
+  int result = 0;
+  uint64_t n = 0;
+  uint64_t hole = first;
+  for (uint32_t e = extentindex(handle, node, first); e < node->nextents && result == 0; e++) {
+    struct extent ext;
+    if (getextent(handle, node, e, &ext) < 0) {
+      result = -1;
+      break;
+    }
+    if (ext.lblk > last) {
+      break;
+    }
+    uint64_t from = ext.lblk > first ? ext.lblk : first;
+    uint64_t to = (uint64_t) ext.lblk + ext.len - 1 < last ? (uint64_t) ext.lblk + ext.len - 1 : last;
+    for (; hole < from && !write; hole++) {
+      memset(rangeblock(buffer, offset, hole, last, head, tail), 0, BLOCK_SIZE);
+    }
+    hole = to + 1;
+    for (uint64_t lblk = from; lblk <= to; lblk++) {
+      blocknums[n] = ext.start + (lblk - ext.lblk);
+      buffers[n] = rangeblock(buffer, offset, lblk, last, head, tail);
+      if (++n == IO_BATCH_BLOCKS) {
+        result = write ? writeblocks(handle, blocknums, buffers, n) : readblocks(handle, blocknums, buffers, n);
+        n = 0;
+        if (result < 0) {
+          break;
+        }
+      }
+    }
+  }
+  if (result == 0 && n > 0) {
+    result = write ? writeblocks(handle, blocknums, buffers, n) : readblocks(handle, blocknums, buffers, n);
+  }
+  for (; hole <= last && !write; hole++) {
+    memset(rangeblock(buffer, offset, hole, last, head, tail), 0, BLOCK_SIZE);
+  }
+  free(blocknums);
+  free(buffers);
+
+  if (result == 0 && !write) {
+    if (headpartial) {
+      memcpy(buffer, head + offset % BLOCK_SIZE, headbytes);
+    }
+    if (tailpartial) {
+      memcpy(buffer + (last * BLOCK_SIZE - offset), tail, tailbytes);
+    }
+  }
+  return result;
+}
+
+// zeroes the bytes [offset, offset + size) in the blocks a file has there,
+// leaving the holes in the range as they are
+static int zerorange(int handle, struct inode *node, uint64_t offset, uint64_t size) {
+  uint8_t zeros[BLOCK_SIZE] = {0};
+  while (size > 0) {
+    uint64_t n = BLOCK_SIZE - offset % BLOCK_SIZE < size ? BLOCK_SIZE - offset % BLOCK_SIZE : size;
+    if (bmap(handle, node, offset / BLOCK_SIZE) != 0 && filerange(handle, node, zeros, offset, n, true) < 0) {
+      return -1;
+    }
+    offset += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// moves the bytes of an inline file out to a data block, after which it
+// grows like any other; the caller holds the inode locked exclusively
+static int uninline(int handle, uint64_t inode, struct inode *node) {
+  uint8_t data[INLINE_MAX];
+  uint64_t size = node->size;
+  memcpy(data, node->data, INLINE_MAX);
+  memset(node->data, 0, INLINE_MAX);
+  node->flags &= ~INODE_INLINE;
+  node->size = 0;
+  if (growfile(handle, inode, node, size) < 0 || filerange(handle, node, data, 0, size, true) < 0) {
+    unmapblocks(handle, node, 0);
+    memcpy(node->data, data, INLINE_MAX);
+    node->flags |= INODE_INLINE;
+    node->size = size;
+    return -1;
+  }
+  return 0;
+}
+
+// Delayed allocation.  A small write that reaches past the blocks a
+// file has does not get blocks straight away: the part past them is kept
+// in memory, in a slot of mnt.pending, and the free blocks it will need
+// are only reserved.  Later appends land in the same memory, and reads
+// are served from it.  The blocks are chosen when the data is flushed,
+// by syncdisk() or once a file has DELALLOC_MAX_BLOCKS waiting, and by
+// then the file's final size is known, so it gets one run next to its
+// last extent and the whole stretch goes out in a single write.
+// Anything else that changes what a file maps flushes it first.
+
+// the pending write of a file, or NULL; the caller holds the inode locked
+static struct pendingwrite* pendingof(struct inode *node) {
+  if (__atomic_load_n(&mnt.npending, __ATOMIC_RELAXED) == 0) {
+    return NULL;
+  }
+  struct pendingwrite *p = NULL;
+  pthread_mutex_lock(&mnt.pendinglock);
+  for (int i = 0; i < DELALLOC_MAX_FILES && p == NULL; i++) {
+    if (mnt.pending[i].node == node) {
+      p = &mnt.pending[i];
+    }
+  }
+  pthread_mutex_unlock(&mnt.pendinglock);
+  return p;
+}
+
+// takes a slot for a file whose first first logical blocks are mapped,
+// or returns NULL if every slot is in use
+static struct pendingwrite* pendingadd(int handle, uint64_t inode, uint64_t first) {
+  // the slot keeps a reference, so the inode stays cached with its new size
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    return NULL;
+  }
+  struct pendingwrite *p = NULL;
+  pthread_mutex_lock(&mnt.pendinglock);
+  for (int i = 0; i < DELALLOC_MAX_FILES && p == NULL; i++) {
+    if (mnt.pending[i].node == NULL) {
+      p = &mnt.pending[i];
+      *p = (struct pendingwrite) { .handle = handle, .inum = inode, .node = node, .first = first };
+      __atomic_fetch_add(&mnt.npending, 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&mnt.pendinglock);
+  if (p == NULL) {
+    iput(node);
+  }
+  return p;
+}
+
+// frees the slot, its memory and its reservation without writing anything
+static void pendingdrop(struct pendingwrite *p) {
+  struct inode *node = p->node;
+  __atomic_fetch_sub(&mnt.reserved, p->nblocks, __ATOMIC_RELAXED);
+  free(p->data);
+  pthread_mutex_lock(&mnt.pendinglock);
+  p->node = NULL;
+  p->data = NULL;
+  __atomic_fetch_sub(&mnt.npending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&mnt.pendinglock);
+  iput(node);
+}
+
+// copies size bytes at byte offset of the file into the slot, growing
+// the file to cover them; bytes before the slot's first block go to the
+// blocks the file already has, or to holes before it
+static int bufferwrite(struct pendingwrite *p, const uint8_t *buffer, uint64_t offset, uint64_t size) {
+  uint64_t base = p->first * BLOCK_SIZE;
+  if (offset < base) {
+    uint64_t n = base - offset < size ? base - offset : size;
+    if (mapwrite(p->handle, p->inum, p->node, offset, n) < 0 ||
+        filerange(p->handle, p->node, (uint8_t*) buffer, offset, n, true) < 0) {
+      return -1;
+    }
+    buffer += n;
+    offset += n;
+    size -= n;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  uint64_t nblocks = blocksfor(offset + size) - p->first;
+  if (nblocks > p->nblocks) {
+    // reserve before checking, so two writers cannot both take the last blocks
+    uint64_t more = nblocks - p->nblocks;
+    __atomic_fetch_add(&mnt.reserved, more, __ATOMIC_RELAXED);
+    if (freedatablocks() < 0) {
+      __atomic_fetch_sub(&mnt.reserved, more, __ATOMIC_RELAXED);
+      return -1;
+    }
+    if (nblocks > p->capacity) {
+      uint64_t capacity = p->capacity > 0 ? p->capacity : 1;
+      while (capacity < nblocks) {
+        capacity *= 2;
+      }
+      uint8_t *data = realloc(p->data, capacity * BLOCK_SIZE);
+      if (data == NULL) {
+        __atomic_fetch_sub(&mnt.reserved, more, __ATOMIC_RELAXED);
+        return -1;
+      }
+      p->data = data;
+      p->capacity = capacity;
+    }
+    memset(p->data + p->nblocks * BLOCK_SIZE, 0, more * BLOCK_SIZE);
+    p->nblocks = nblocks;
+  }
+  memcpy(p->data + (offset - base), buffer, size);
+  if (offset + size > p->node->size) {
+    p->node->size = offset + size;
+  }
+  return 0;
+}
+
+// gives the slot's data blocks and writes it, then frees the slot;
+// the caller holds the inode locked exclusively
+static int pendingflush(struct pendingwrite *p) {
+  int handle = p->handle;
+  struct inode *node = p->node;
+  int result = 0;
+  if (p->nblocks > 0) {
+    // the blocks were reserved, so only a full extent list can stop this;
+    // the reservation is given back once they are taken
+    result = mapblocks(handle, p->inum, node, p->first + p->nblocks);
+    if (result == 0) {
+      result = filerange(handle, node, p->data, p->first * BLOCK_SIZE, p->nblocks * BLOCK_SIZE, true);
+    }
+    if (result < 0) {
+      FSLOG(FSLOG_ERROR, "Could not write %ld delayed blocks of inode %ld\n", p->nblocks, p->inum);
+      unmapblocks(handle, node, p->first);
+      node->size = p->first * BLOCK_SIZE < node->size ? p->first * BLOCK_SIZE : node->size;
+    }
+    bitmapflush(handle);
+    imarkdirty(node);
+  }
+  pendingdrop(p);
+  return result;
+}
+
+// blocks dirtied by flushing nblocks pending blocks of a file
+static uint64_t pendingcost(int handle, uint64_t inode, struct inode *node, uint64_t nblocks) {
+  if (nblocks == 0) {
+    return 0;
+  }
+  struct extent last;
+  bool haslast = node->nextents > 0 && getextent(handle, node, node->nextents - 1, &last) == 0;
+  uint64_t goal = haslast ? last.start + last.len : inode;
+  return 1 + alloccost(goal, nblocks) + mapcost(node->nextents, node->nextents + nblocks);
+}
+
+// flushes every pending write of handle
+static int pendingflushall(int handle) {
+  int result = 0;
+  for (int i = 0; i < DELALLOC_MAX_FILES; i++) {
+    pthread_mutex_lock(&mnt.pendinglock);
+    struct inode *node = mnt.pending[i].handle == handle ? mnt.pending[i].node : NULL;
+    pthread_mutex_unlock(&mnt.pendinglock);
+    if (node == NULL) {
+      continue;
+    }
+    // it may have been flushed while the lock was taken
+    ilock(node, true);
+    struct pendingwrite *p = &mnt.pending[i];
+    if (pendingof(node) == p) {
+      // each flush joins the transaction whole, committing it first if
+      // there is no room left for one more
+      if (!txnroom(handle, pendingcost(handle, p->inum, node, p->nblocks)) && commitdisk(handle) < 0) {
+        result = -1;
+      }
+      if (pendingflush(p) < 0) {
+        result = -1;
+      }
+    }
+    iunlock(node);
+  }
+  return result;
+}
+
+// starts reading logical blocks [from, to) of a file in the background,
+// one request per physically contiguous run
+static void prefetchrange(int handle, struct inode *node, uint64_t from, uint64_t to) {
+  for (uint32_t e = extentindex(handle, node, from); e < node->nextents; e++) {
+    struct extent ext;
+    if (getextent(handle, node, e, &ext) < 0 || ext.lblk >= to) {
+      break;
+    }
+    uint64_t first = ext.lblk > from ? ext.lblk : from;
+    uint64_t last = (uint64_t) ext.lblk + ext.len < to ? (uint64_t) ext.lblk + ext.len : to;
+    rawprefetch(handle, ext.start + (first - ext.lblk), last - first);
+  }
+}
+
+static int doreadfileat(int handle, uint64_t inode, void *buffer, uint64_t offset, uint64_t size) {
+    // reads up to size bytes starting at byte offset;
+    // returns how many were read, 0 at or past the end of the file
+    struct inode *node = iget(handle, inode);
+    if (node == NULL) {
+        return -1;
+    }
+    ilock(node, false);
+    if (offset >= node->size) {
+        size = 0;
+    } else if (size > node->size - offset) {
+        size = node->size - offset;
+    }
+
+    // an inline file is all in the inode, which is already in memory
+    if (node->flags & INODE_INLINE) {
+        memcpy(buffer, node->data + offset, size);
+        iunlock(node);
+        iput(node);
+        return size;
+    }
+
+    // a stream of reads gets the blocks after it prefetched,
+    // so their I/O overlaps with this read and what the caller does next
+    uint64_t from;
+    uint64_t to;
+    if (size > 0 && node->type == FILETYPE_REGULAR &&
+        raaccess(ireadahead(node), offset, size, blocksfor(node->size), &from, &to)) {
+        prefetchrange(handle, node, from, to);
+    }
+
+    // the part past the blocks the file has may still be in memory,
+    // and whatever lies past that memory is a hole
+    struct pendingwrite *p = pendingof(node);
+    uint64_t split = offset + size;
+    if (p != NULL && split > p->first * BLOCK_SIZE) {
+        uint64_t base = p->first * BLOCK_SIZE;
+        uint64_t held = base + p->nblocks * BLOCK_SIZE;
+        split = offset > base ? offset : base;
+        uint64_t n = offset + size < held ? offset + size - split : (held > split ? held - split : 0);
+        memcpy((uint8_t*) buffer + (split - offset), p->data + (split - base), n);
+        memset((uint8_t*) buffer + (split - offset) + n, 0, offset + size - split - n);
+    }
+    int read = filerange(handle, node, buffer, offset, split - offset, false);
+    iunlock(node);
+    iput(node);
+
+    return read < 0 ? -1 : (int) size;
+}
+
+int readfileat(int handle, uint64_t inode, void *buffer, uint64_t offset, uint64_t size) {
+  uint64_t t = statsclock();
+  int read = doreadfileat(handle, inode, buffer, offset, size);
+  statsop(OP_READ, t, read < 0);
+  TRACE(TRACE_READ, t, NULL, inode, offset, size, read);
+  if (read > 0) {
+    statsbytes(false, read);
+  }
+  return read;
+}
+
+int readfile(int handle, uint64_t inode, void *buffer, uint64_t size) {
+    return readfileat(handle, inode, buffer, 0, size);
+}
+
+// Directories are linear hash tables.  Logical block 0 of a directory
+// holds a struct dirheader and bucket b lives at logical block 1 + b.
+// A name hashes to exactly one bucket, so lookup, insert and remove read
+// one bucket block no matter how big the directory is.  The table grows
+// one bucket at a time: once it is three quarters full, or the bucket an
+// insert lands in is full, the bucket at the split pointer is divided
+// between itself and a new bucket appended to the directory.
+
+static uint64_t namehash(const char *name) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (int i = 0; i < DIRENT_NAME_LEN && name[i] != '\0'; i++) {
+    h ^= (uint8_t) name[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+// directory blocks are metadata: they go through the block cache and the journal
+static int dirread(int handle, struct inode *dir, uint64_t lblk, void *buffer) {
+  uint64_t blocknum = bmap(handle, dir, lblk);
+  return blocknum == 0 ? -1 : readblock(handle, blocknum, buffer);
+}
+
+// a directory block to look at without changing it; see blockptr()
+static const void* dirpeek(int handle, struct inode *dir, uint64_t lblk, void *scratch) {
+  uint64_t blocknum = bmap(handle, dir, lblk);
+  return blocknum == 0 ? NULL : blockptr(handle, blocknum, scratch);
+}
+
+static int dirwrite(int handle, struct inode *dir, uint64_t lblk, void *buffer) {
+  uint64_t blocknum = bmap(handle, dir, lblk);
+  return blocknum == 0 ? -1 : writeblock(handle, blocknum, buffer);
+}
+
+// gets and locks the inode and reads the header of a directory, checking
+// that it is one; the caller hands the inode back with dirclose()
+static struct inode* diropen(int handle, uint64_t dir_inode, struct dirheader *hdr, bool exclusive) {
+  struct inode *dir = iget(handle, dir_inode);
+  if (dir != NULL) {
+    ilock(dir, exclusive);
+  }
+  if (dir == NULL || dir->type != FILETYPE_DIRECTORY) {
+    FSLOG(FSLOG_ERROR, "Inode %ld is not a directory\n", dir_inode);
+    if (dir != NULL) {
+      iunlock(dir);
+      iput(dir);
+    }
+    return NULL;
+  }
+  if (dirread(handle, dir, 0, hdr) < 0 || hdr->magic != DIR_MAGIC) {
+    FSLOG(FSLOG_ERROR, "Directory with inode %ld is damaged\n", dir_inode);
+    iunlock(dir);
+    iput(dir);
+    return NULL;
+  }
+  return dir;
+}
+
+static void dirclose(struct inode *dir) {
+  iunlock(dir);
+  iput(dir);
+}
+
+static uint64_t dirbucketof(struct dirheader *hdr, uint64_t hash) {
+  uint64_t b = hash & ((1ULL << hdr->level) - 1);
+  if (b < hdr->split) {
+    b = hash & ((1ULL << (hdr->level + 1)) - 1);
+  }
+  return b;
+}
+
+// index of name in bucket, or -1
+static int dirbucketfind(const struct dirbucket *bucket, const char *name) {
+  for (uint32_t i = 0; i < bucket->count; i++) {
+    if (strncmp(bucket->entries[i].name, name, DIRENT_NAME_LEN) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// divides the bucket at the split pointer between itself and a new bucket
+static int dirsplit(int handle, uint64_t dir_inode, struct inode *dir, struct dirheader *hdr) {
+  uint64_t oldb = hdr->split;
+  uint64_t newb = hdr->nbuckets;
+  if (growfile(handle, dir_inode, dir, (newb + 2) * BLOCK_SIZE) < 0) {
+    return -1;
+  }
+  imarkdirty(dir);
+
+  struct dirbucket old;
+  struct dirbucket moved;
+  if (dirread(handle, dir, 1 + oldb, &old) < 0) {
+    return -1;
+  }
+  memset(&moved, 0, sizeof(moved));
+  uint64_t mask = (1ULL << (hdr->level + 1)) - 1;
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < old.count; i++) {
+    if ((namehash(old.entries[i].name) & mask) == newb) {
+      moved.entries[moved.count++] = old.entries[i];
+    } else {
+      old.entries[kept++] = old.entries[i];
+    }
+  }
+  old.count = kept;
+  dirwrite(handle, dir, 1 + oldb, &old);
+  dirwrite(handle, dir, 1 + newb, &moved);
+
+  hdr->nbuckets++;
+  if (++hdr->split == (1ULL << hdr->level)) {
+    hdr->level++;
+    hdr->split = 0;
+  }
+  return 0;
+}
+
+// blocks one dirsplit() dirties: the two buckets, and growing the
+// directory by one
+static uint64_t splitcost(int handle, uint64_t dir_inode, struct inode *dir) {
+  struct extent last;
+  bool haslast = dir->nextents > 0 && getextent(handle, dir, dir->nextents - 1, &last) == 0;
+  uint64_t goal = haslast ? last.start + last.len : dir_inode;
+  return 3 + alloccost(goal, 1) + mapcost(dir->nextents > 0 ? dir->nextents - 1 : 0, dir->nextents + 1);
+}
+
+// returns the directory's starting inode
+static int docreatedirectory(int handle) {
+  // a new directory is its header block and a single empty bucket
+  txnbegin(handle);
+  int dir_inode = docreatefilein(handle, 2 * BLOCK_SIZE, FILETYPE_DIRECTORY, 0);
+  if (dir_inode < 0) {
+    txnend(handle);
+    return -1;
+  }
+  struct inode *dir = iget(handle, dir_inode);
+  if (dir == NULL) {
+    txnend(handle);
+    return -1;
+  }
+  ilock(dir, true);
+
+  struct dirheader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = DIR_MAGIC;
+  hdr.nbuckets = 1;
+  dirwrite(handle, dir, 0, &hdr);
+
+  struct dirbucket bucket;
+  memset(&bucket, 0, sizeof(bucket));
+  dirwrite(handle, dir, 1, &bucket);
+  dirclose(dir);
+  txnend(handle);
+
+  return dir_inode;
+}
+
+int createdirectory(int handle) {
+  uint64_t t = statsclock();
+  int dir_inode = docreatedirectory(handle);
+  statsop(OP_MKDIR, t, dir_inode < 0);
+  TRACE(TRACE_MKDIR, t, NULL, dir_inode);
+  return dir_inode;
+}
+
+void dumpdirectory(int handle, uint64_t dir_inode) {
+  // unpack entries, print their file names and inodes
+  struct dirheader hdr;
+  struct inode *dir = diropen(handle, dir_inode, &hdr, false);
+  if (dir == NULL) {
+    return;
+  }
+
+  int dircount = 0;
+  printf("--- Directory entries ---\n");
+  struct dirbucket scratch;
+  for (uint64_t b = 0; b < hdr.nbuckets; b++) {
+    const struct dirbucket *bucket = dirpeek(handle, dir, 1 + b, &scratch);
+    if (bucket == NULL) {
+      continue;
+    }
+    for (uint32_t i = 0; i < bucket->count; i++) {
+      printf("Filename: %.16s, inode: %ld\n", bucket->entries[i].name, bucket->entries[i].finode);
+      dircount++;
+    }
+  }
+  dirclose(dir);
+  printf("--- End directory entries ---\n");
+  printf("# of entries: %d\n", dircount);
+}
+
+char* ls(int handle, uint64_t dir_inode) {
+  // returns the names in the directory, one per line;
+  // the caller frees the string
+  struct dirheader hdr;
+  struct inode *dir = diropen(handle, dir_inode, &hdr, false);
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  char *strs = malloc(hdr.nentries * (DIRENT_NAME_LEN + 1) + 1);
+  if (strs == NULL) {
+    dirclose(dir);
+    return NULL;
+  }
+  uint64_t len = 0;
+  struct dirbucket scratch;
+  for (uint64_t b = 0; b < hdr.nbuckets; b++) {
+    const struct dirbucket *bucket = dirpeek(handle, dir, 1 + b, &scratch);
+    if (bucket == NULL) {
+      continue;
+    }
+    for (uint32_t i = 0; i < bucket->count && len < hdr.nentries * (DIRENT_NAME_LEN + 1); i++) {
+      len += sprintf(strs + len, "%.15s\n", bucket->entries[i].name);
+    }
+  }
+  dirclose(dir);
+  strs[len] = '\0';
+  return strs;
+}
+
+// looks name up in a directory without printing anything;
+// answers from the dentry cache when it can
+static int64_t dirlookup(int handle, uint64_t dir_inode, const char *name) {
+  // a name too long for an entry is in no directory
+  if (strnlen(name, DIRENT_NAME_LEN) > DIRENT_NAME_LEN - 1) {
+    return -1;
+  }
+  int64_t found;
+  if (dcachelookup(handle, dir_inode, name, &found)) {
+    return found;
+  }
+
+  struct dirheader hdr;
+  struct inode *dir = diropen(handle, dir_inode, &hdr, false);
+  if (dir == NULL) {
+    return -1;
+  }
+  // only the bucket the name hashes to can hold it
+  struct dirbucket scratch;
+  const struct dirbucket *bucket = dirpeek(handle, dir, 1 + dirbucketof(&hdr, namehash(name)), &scratch);
+  if (bucket == NULL) {
+    dirclose(dir);
+    return -1;
+  }
+  int i = dirbucketfind(bucket, name);
+  found = i >= 0 ? (int64_t) bucket->entries[i].finode : -1;
+  // still under the directory's lock, so a concurrent add or remove
+  // cannot be overwritten with what this lookup saw
+  dcacheinsert(handle, dir_inode, name, found);
+  dirclose(dir);
+  return found;
+}
+
+static int dofindinodebyfilename(int handle, uint64_t dir_inode, char* name) {
+  FSLOG(FSLOG_INFO, "Searching for file with name '%s'...\n", name);
+  int64_t found = dirlookup(handle, dir_inode, name);
+  if (found < 0) {
+    FSLOG(FSLOG_ERROR, "Could not find file with name '%s'\n\n", name);
+    return -1;
+  }
+  return found;
+}
+
+int findinodebyfilename(int handle, uint64_t dir_inode, char* name) {
+  uint64_t t = statsclock();
+  int found = dofindinodebyfilename(handle, dir_inode, name);
+  statsop(OP_LOOKUP, t, found < 0);
+  TRACE(TRACE_LOOKUP, t, name, dir_inode, found);
+  return found;
+}
+
+static int doremovedirentry(int handle, uint64_t dir_inode, char* filename) {
+  txnbegin(handle);
+  struct dirheader hdr;
+  struct inode *dir = diropen(handle, dir_inode, &hdr, true);
+  if (dir == NULL) {
+    txnend(handle);
+    return -1;
+  }
+
+  uint64_t b = dirbucketof(&hdr, namehash(filename));
+  struct dirbucket bucket;
+  if (dirread(handle, dir, 1 + b, &bucket) < 0) {
+    dirclose(dir);
+    txnend(handle);
+    return -1;
+  }
+  int i = dirbucketfind(&bucket, filename);
+  if (i < 0) {
+    FSLOG(FSLOG_ERROR, "%s does not exist in directory\n", filename);
+    dirclose(dir);
+    txnend(handle);
+    return -1;
+  }
+
+  // the last entry of the bucket takes the removed one's place
+  bucket.entries[i] = bucket.entries[--bucket.count];
+  memset(&bucket.entries[bucket.count], 0, sizeof(struct dirent));
+  dirwrite(handle, dir, 1 + b, &bucket);
+  hdr.nentries--;
+  dirwrite(handle, dir, 0, &hdr);
+  dcacheinsert(handle, dir_inode, filename, -1);
+  dirclose(dir);
+  txnend(handle);
+  return 0;
+}
+
+int removedirentry(int handle, uint64_t dir_inode, char* filename) {
+  uint64_t t = statsclock();
+  int result = doremovedirentry(handle, dir_inode, filename);
+  statsop(OP_UNLINK, t, result < 0);
+  TRACE(TRACE_UNLINK, t, filename, dir_inode, result);
+  return result;
+}
+
+static int dohierdirsearch(int handle, char* name, int root_inode) {
+  // split the path on / and, starting at root_inode, look each component
+  // up in the directory the previous one named; once the dentry cache is
+  // warm this reads nothing from disk
+  char path[PATH_MAX];
+  if (strlen(name) >= sizeof(path)) {
+    return -1;
+  }
+  strcpy(path, name);
+
+  int64_t current = root_inode;
+  char *saveptr;
+  for (char *find = strtok_r(path, "/", &saveptr); find != NULL; find = strtok_r(NULL, "/", &saveptr)) {
+    current = dirlookup(handle, current, find);
+    // if the current name can't be found in the current directory, it doesn't exist
+    if (current < 0) {
+      return -1;
+    }
+  }
+  return current;
+}
+
+int hierdirsearch(int handle, char* name, int root_inode) {
+  uint64_t t = statsclock();
+  int found = dohierdirsearch(handle, name, root_inode);
+  statsop(OP_LOOKUP, t, found < 0);
+  TRACE(TRACE_PATH, t, name, root_inode, found);
+  return found;
+}
+
+static int doadddirentry(int handle, uint64_t dir_inode, uint64_t file_inode, char* filename) {
+  if (strlen(filename) == 0 || strlen(filename) > DIRENT_NAME_LEN - 1) {
+    FSLOG(FSLOG_ERROR, "Invalid file name '%s'\n", filename);
+    return -1;
+  }
+  txnbegin(handle);
+  struct dirheader hdr;
+  struct inode *dir = diropen(handle, dir_inode, &hdr, true);
+  if (dir == NULL) {
+    txnend(handle);
+    return -1;
+  }
+
+  uint64_t hash = namehash(filename);
+  uint64_t b = dirbucketof(&hdr, hash);
+  struct dirbucket bucket;
+  if (dirread(handle, dir, 1 + b, &bucket) < 0) {
+    dirclose(dir);
+    txnend(handle);
+    return -1;
+  }
+  if (dirbucketfind(&bucket, filename) >= 0) {
+    FSLOG(FSLOG_ERROR, "%s already exists in directory\n", filename);
+    dirclose(dir);
+    txnend(handle);
+    return -1;
+  }
+
+  // room for the header, the bucket and the splits it takes; one more
+  // split than the first is asked for up front, so a directory that is
+  // only going to split once can still start over for it
+  uint64_t split = splitcost(handle, dir_inode, dir);
+  bool splitting = bucket.count == DIRENTS_PER_BUCKET;
+  int reserved = txnreserve(handle, 2 + (splitting ? 2 * split : split));
+  if (reserved < 0) {
+    dirclose(dir);
+    txnend(handle);
+    return reserved;
+  }
+
+  // a full bucket is split until the name's bucket has room;
+  // the split pointer reaches it within one round.  Each split leaves a
+  // whole directory, so when the transaction has no room for another
+  // the ones made are kept and the entry is added in a new one
+  uint64_t rounds = 0;
+  while (bucket.count == DIRENTS_PER_BUCKET) {
+    if (rounds > 0 && txnreserve(handle, 2 + (rounds + 2) * split) < 0) {
+      dirwrite(handle, dir, 0, &hdr);
+      dirclose(dir);
+      txnend(handle);
+      return TXN_FULL;
+    }
+    if (rounds++ > 2 * hdr.nbuckets || dirsplit(handle, dir_inode, dir, &hdr) < 0) {
+      FSLOG(FSLOG_ERROR, "No room for %s in directory\n", filename);
+      dirwrite(handle, dir, 0, &hdr);
+      dirclose(dir);
+      txnend(handle);
+      return -1;
+    }
+    b = dirbucketof(&hdr, hash);
+    dirread(handle, dir, 1 + b, &bucket);
+  }
+
+  struct dirent *entry = &bucket.entries[bucket.count++];
+  memset(entry, 0, sizeof(*entry));
+  strcpy(entry->name, filename);
+  entry->finode = file_inode;
+  dirwrite(handle, dir, 1 + b, &bucket);
+
+  // keep buckets at most three quarters full on average, if the
+  // transaction has room for one more split
+  hdr.nentries++;
+  if (hdr.nentries * 4 > hdr.nbuckets * DIRENTS_PER_BUCKET * 3 &&
+      txnreserve(handle, 2 + (rounds + 1) * split) == 0) {
+    dirsplit(handle, dir_inode, dir, &hdr);
+  }
+  dirwrite(handle, dir, 0, &hdr);
+  dcacheinsert(handle, dir_inode, filename, file_inode);
+  dirclose(dir);
+  txnend(handle);
+
+  return 0;
+}
+
+int adddirentry(int handle, uint64_t dir_inode, uint64_t file_inode, char* filename) {
+  uint64_t t = statsclock();
+  int result;
+  do {
+    result = doadddirentry(handle, dir_inode, file_inode, filename);
+  } while (result == TXN_FULL);
+  result = result == TXN_TOOBIG ? -1 : result;
+  statsop(OP_LINK, t, result < 0);
+  TRACE(TRACE_LINK, t, filename, dir_inode, file_inode, result);
+  return result;
+}
+
+// whether a write of size bytes at offset waits in memory for its
+// blocks, for a file whose first mapped blocks are mapped and whose
+// pending write, if it has one, is p: a small write past the blocks the
+// file has does, a large one has its size known now and gets them
+static bool delaywrite(struct inode *node, struct pendingwrite *p, uint64_t mapped, uint64_t offset, uint64_t size) {
+  return node->type == FILETYPE_REGULAR && (p != NULL || blocksfor(offset + size) > mapped) &&
+         blocksfor(offset + size) <= mapped + DELALLOC_MAX_BLOCKS;
+}
+
+// blocks dowritefileat() may dirty writing size bytes at offset, from
+// the same choices it is about to make
+static uint64_t writecost(int handle, uint64_t inode, struct inode *node, uint64_t offset, uint64_t size) {
+  if (size == 0 || ((node->flags & INODE_INLINE) && offset + size <= INLINE_MAX)) {
+    return 1;
+  }
+  uint64_t first = offset / BLOCK_SIZE;
+  uint64_t last = (offset + size - 1) / BLOCK_SIZE;
+  uint64_t cost = 1;
+  struct pendingwrite *p = NULL;
+  uint64_t mapped;
+  if (node->flags & INODE_INLINE) {
+    // it moves out to a block first
+    cost += alloccost(inode, 1);
+    mapped = blocksfor(node->size);
+  } else {
+    p = pendingof(node);
+    mapped = p != NULL ? p->first : mappedblocks(handle, node);
+  }
+  if (!delaywrite(node, p, mapped, offset, size)) {
+    // directory blocks are written through the cache
+    cost += node->type == FILETYPE_DIRECTORY ? last - first + 1 : 0;
+    cost += p != NULL ? pendingcost(handle, inode, node, p->nblocks) : 0;
+    return cost + holecost(handle, inode, node, first, last);
+  }
+  // the part in front of the pending data gets blocks now, the pending
+  // data once there is DELALLOC_MAX_BLOCKS of it
+  if (first < mapped) {
+    cost += holecost(handle, inode, node, first, last < mapped ? last : mapped - 1);
+  }
+  uint64_t pending = blocksfor(offset + size) - mapped;
+  if (p != NULL && p->nblocks > pending) {
+    pending = p->nblocks;
+  }
+  return pending >= DELALLOC_MAX_BLOCKS ? cost + pendingcost(handle, inode, node, pending) : cost;
+}
+
+static int dowritefileat(int handle, uint64_t inode, void *buffer, uint64_t offset, uint64_t size) {
+  // writes size bytes at byte offset, growing the file if they end past it;
+  // only the blocks the range overlaps are read or written.  Returns
+  // TXN_FULL or TXN_TOOBIG, having changed nothing, if the running
+  // transaction or any transaction has no room for it
+  txnbegin(handle);
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    txnend(handle);
+    return -1;
+  }
+  ilock(node, true);
+  int reserved = txnreserve(handle, writecost(handle, inode, node, offset, size));
+  if (reserved < 0) {
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return reserved;
+  }
+
+  // a write that leaves an inline file small enough stays in the inode;
+  // one that does not moves the file out to blocks first
+  if (node->flags & INODE_INLINE) {
+    if (offset + size <= INLINE_MAX) {
+      memcpy(node->data + offset, buffer, size);
+      if (offset + size > node->size) {
+        node->size = offset + size;
+      }
+      node->mtime = time(NULL);
+      imarkdirty(node);
+      iunlock(node);
+      iput(node);
+      txnend(handle);
+      return size;
+    }
+    if (uninline(handle, inode, node) < 0) {
+      FSLOG(FSLOG_ERROR, "Insufficient space, continuing\n");
+      iunlock(node);
+      iput(node);
+      txnend(handle);
+      return -1;
+    }
+  }
+
+  // a small write past the blocks the file has waits in memory for them;
+  // a large one has its size known now and gets them straight away
+  struct pendingwrite *p = pendingof(node);
+  uint64_t mapped = p != NULL ? p->first : mappedblocks(handle, node);
+  bool delay = delaywrite(node, p, mapped, offset, size);
+  if (p != NULL && !delay) {
+    pendingflush(p);
+    p = NULL;
+  }
+  if (delay && p == NULL) {
+    p = pendingadd(handle, inode, mapped);
+  }
+  if (p != NULL) {
+    int result = bufferwrite(p, buffer, offset, size);
+    if (result < 0) {
+      FSLOG(FSLOG_ERROR, "Insufficient space, continuing\n");
+    } else {
+      node->mtime = time(NULL);
+      imarkdirty(node);
+      if (p->nblocks >= DELALLOC_MAX_BLOCKS) {
+        result = pendingflush(p);
+      }
+    }
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return result < 0 ? -1 : (int) size;
+  }
+
+  // only the holes the range falls in get blocks, wherever it lands
+  if (mapwrite(handle, inode, node, offset, size) < 0) {
+    FSLOG(FSLOG_ERROR, "Insufficient space, continuing\n");
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return -1;
+  }
+
+  if (filerange(handle, node, buffer, offset, size, true) < 0) {
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return -1;
+  }
+
+  if (offset + size > node->size) {
+    node->size = offset + size;
+  }
+  node->mtime = time(NULL);
+  imarkdirty(node);
+  iunlock(node);
+  iput(node);
+  txnend(handle);
+  return size;
+}
+
+// writes size bytes at offset as one operation, starting it over while
+// the running transaction has no room for it; one no transaction can
+// hold goes out as two, split at a block boundary, and so on
+static int writepieces(int handle, uint64_t inode, uint8_t *buffer, uint64_t offset, uint64_t size) {
+  int written;
+  do {
+    written = dowritefileat(handle, inode, buffer, offset, size);
+  } while (written == TXN_FULL);
+  if (written != TXN_TOOBIG) {
+    return written;
+  }
+  if (size <= BLOCK_SIZE) {
+    FSLOG(FSLOG_ERROR, "Write of %ld bytes does not fit in a transaction\n", size);
+    return -1;
+  }
+  uint64_t half = (offset + size / 2) / BLOCK_SIZE * BLOCK_SIZE - offset;
+  if (half == 0 || half >= size) {
+    half = size / 2;
+  }
+  int front = writepieces(handle, inode, buffer, offset, half);
+  if (front < 0) {
+    return front;
+  }
+  int back = writepieces(handle, inode, buffer + half, offset + half, size - half);
+  // a failed back half leaves a short write
+  return back < 0 ? front : front + back;
+}
+
+int writefileat(int handle, uint64_t inode, void *buffer, uint64_t offset, uint64_t size) {
+  uint64_t t = statsclock();
+  int written = writepieces(handle, inode, buffer, offset, size);
+  // a disk that looks full may only be waiting for a commit to free blocks;
+  // writing the same bytes again is harmless whatever the first try did
+  if (written < 0 && freespending() && syncdisk(handle) == 0) {
+    written = writepieces(handle, inode, buffer, offset, size);
+  }
+  statsop(OP_WRITE, t, written < 0);
+  TRACE(TRACE_WRITE, t, NULL, inode, offset, size, written);
+  if (written > 0) {
+    statsbytes(true, written);
+  }
+  return written;
+}
+
+int writetofile(int handle, uint64_t inode, void *buffer, uint64_t size) {
+  // writes size bytes at the start of the file, growing it if they end
+  // past it; writefileat() decides when the new part gets its blocks
+  return writefileat(handle, inode, buffer, 0, size);
+}
+
+// frees the blocks of logical blocks [first, stop) of a regular file,
+// trimming or splitting the extents that reach into the range;
+// returns -1 if a split finds the extent list full
+static int unmaprange(int handle, struct inode *node, uint64_t first, uint64_t stop) {
+  uint32_t k = extentindex(handle, node, first);
+  while (k < node->nextents) {
+    struct extent e;
+    if (getextent(handle, node, k, &e) < 0 || e.lblk >= stop) {
+      break;
+    }
+    uint64_t end = (uint64_t) e.lblk + e.len;
+    uint64_t from = e.lblk > first ? e.lblk : first;
+    uint64_t to = end < stop ? end : stop;
+    if (from > e.lblk && to < end) {
+      // the range is inside the extent, which becomes two
+      struct extent rest = { to, end - to, e.start + (to - e.lblk) };
+      if (insertextent(handle, node, k + 1, &rest) < 0) {
+        return -1;
+      }
+      e.len = from - e.lblk;
+      putextent(handle, node, k, &e);
+      k += 2;
+    } else if (from > e.lblk) {
+      e.len = from - e.lblk;
+      putextent(handle, node, k, &e);
+      k++;
+    } else if (to < end) {
+      struct extent rest = { to, end - to, e.start + (to - e.lblk) };
+      putextent(handle, node, k, &rest);
+      k++;
+    } else {
+      removeextent(handle, node, k);
+    }
+    releaseblocks(e.start + (from - e.lblk), to - from);
+  }
+  return 0;
+}
+
+static int dopunchhole(int handle, uint64_t inode, uint64_t offset, uint64_t len) {
+  // turns the bytes [offset, offset + len) of a regular file into a hole:
+  // the blocks wholly inside the range go back to the free pool, the
+  // parts of blocks at its ends are zeroed, and the size stays the same
+  txnbegin(handle);
+  struct inode *node = iget(handle, inode);
+  if (node == NULL) {
+    txnend(handle);
+    return -1;
+  }
+  ilock(node, true);
+  if (node->type != FILETYPE_REGULAR) {
+    FSLOG(FSLOG_ERROR, "Cannot punch a hole in directory w/ inode %ld\n", inode);
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return -1;
+  }
+  // splitting an extent moves every one after it
+  struct pendingwrite *p = pendingof(node);
+  uint64_t cost = 2 + (p != NULL ? pendingcost(handle, inode, node, p->nblocks) : 0) +
+                  mapcost(extentindex(handle, node, offset / BLOCK_SIZE), node->nextents + 1 + (p != NULL ? p->nblocks : 0));
+  int reserved = txnreserve(handle, cost);
+  if (reserved < 0) {
+    iunlock(node);
+    iput(node);
+    txnend(handle);
+    return reserved;
+  }
+  if (p != NULL) {
+    pendingflush(p);
+  }
+
+  uint64_t end = len < node->size - offset ? offset + len : node->size;
+  int result = 0;
+  if (offset >= node->size || len == 0) {
+    end = offset;
+  } else if (node->flags & INODE_INLINE) {
+    memset(node->data + offset, 0, end - offset);
+  } else {
+    // a block the range only partly covers keeps its other bytes;
+    // the last block of the file is freed whole if the range reaches the end
+    uint64_t first = blocksfor(offset);
+    uint64_t stop = end == node->size ? blocksfor(end) : end / BLOCK_SIZE;
+    if (offset % BLOCK_SIZE != 0) {
+      result = zerorange(handle, node, offset, (first * BLOCK_SIZE < end ? first * BLOCK_SIZE : end) - offset);
+    }
+    if (result == 0 && stop >= first && stop * BLOCK_SIZE < end) {
+      result = zerorange(handle, node, stop * BLOCK_SIZE, end - stop * BLOCK_SIZE);
+    }
+    if (result == 0 && first < stop) {
+      result = unmaprange(handle, node, first, stop);
+      trimmapblocks(handle, node);
+      bitmapflush(handle);
+    }
+    if (result < 0) {
+      FSLOG(FSLOG_ERROR, "Could not punch a hole in file w/ inode %ld\n", inode);
+    }
+  }
+  if (end > offset) {
+    node->mtime = time(NULL);
+    imarkdirty(node);
+  }
+  iunlock(node);
+  iput(node);
+  txnend(handle);
+  return result;
+}
+
+int punchhole(int handle, uint64_t inode, uint64_t offset, uint64_t len) {
+  uint64_t t = statsclock();
+  int result;
+  do {
+    result = dopunchhole(handle, inode, offset, len);
+  } while (result == TXN_FULL);
+  result = result == TXN_TOOBIG ? -1 : result;
+  statsop(OP_PUNCH, t, result < 0);
+  TRACE(TRACE_PUNCH, t, NULL, inode, offset, len, result);
+  return result;
+}
+
+static void dodeletedirectory(int handle, uint64_t dir_inode) {
+  // only an empty directory can be deleted; it stays locked from the
+  // check to the delete so no name can be added in between
+  txnbegin(handle);
+  struct dirheader hdr;
+  struct inode *dir = diropen(handle, dir_inode, &hdr, true);
+  if (dir == NULL) {
+    txnend(handle);
+    return;
+  }
+  if (hdr.nentries == 0) {
+    freeinode(handle, dir_inode, dir);
+    FSLOG(FSLOG_INFO, "Success\n");
+  } else {
+    dirclose(dir);
+    FSLOG(FSLOG_ERROR, "Directory with inode %ld is not empty\n", dir_inode);
+  }
+  txnend(handle);
+}
+
+void deletedirectory(int handle, uint64_t dir_inode) {
+  uint64_t t = statsclock();
+  dodeletedirectory(handle, dir_inode);
+  statsop(OP_RMDIR, t, false);
+  TRACE(TRACE_RMDIR, t, NULL, dir_inode);
 }
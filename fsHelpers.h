@@ -1,5 +1,12 @@
+#ifndef FSHELPERS_H
+#define FSHELPERS_H
+
 #include <inttypes.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -8,46 +15,164 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #define BLOCK_SIZE 4096
-#define INODES 128
+#define INODES 128               /* default inode count for small disks */
 #define MAGIC_NUM 0x1234BEAD
+#define SB_CLEAN 1               /* superblock state: closedisk() finished, nothing to check */
+#define DIR_MAGIC 0x44495248ULL
+#define FILETYPE_REGULAR 0
+#define FILETYPE_DIRECTORY 1
+#define DIRENT_NAME_LEN 16
+#define DIRENTS_PER_BUCKET 170
+#define IO_BATCH_BLOCKS 8192     /* blocks of file data gathered per readblocks()/writeblocks() */
+#define IO_MAX_IOVECS 1024       /* iovecs in one preadv()/pwritev(), at most IOV_MAX */
+#define NEXTENTS 253
+#define INLINE_MAX (NEXTENTS * 16)   /* bytes a file can keep in its inode block */
+#define INODE_INLINE 0x1         /* inode flag: the file's bytes are in data[], it has no blocks */
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / 16)
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / 8)
+#define MAX_EXTENTS (NEXTENTS + EXTENTS_PER_BLOCK + POINTERS_PER_BLOCK * EXTENTS_PER_BLOCK)
+#define GROUP_MAX_BLOCKS (BLOCK_SIZE * 8)  /* blocks in an allocation group, one bitmap block's worth */
+#define GROUP_MIN_BLOCKS 4096    /* groups shrink to this on small disks ... */
+#define GROUP_MIN_COUNT 8        /* ... to give the disk at least this many */
+#define GROUPS_PER_BLOCK (BLOCK_SIZE / sizeof(struct groupdesc))
+#define DELALLOC_MAX_FILES 64    /* files whose appends can wait for blocks at once */
+#define DELALLOC_MAX_BLOCKS 256  /* appended blocks a file keeps in memory (1 MiB) */
 #define countof( arr) (sizeof(arr)/sizeof(*arr))
 
+// Messages about what the filesystem is doing go through FSLOG(), which
+// compiles to nothing for a level above FSLOG_LEVEL.  Build with
+// -DFSLOG_LEVEL=1 to keep only the errors, or 0 for none at all.
+#define FSLOG_ERROR 1            /* something failed */
+#define FSLOG_INFO 2             /* progress of an operation */
+#ifndef FSLOG_LEVEL
+#define FSLOG_LEVEL FSLOG_INFO
+#endif
+#define FSLOG(level, ...) do { if ((level) <= FSLOG_LEVEL) printf(__VA_ARGS__); } while (0)
+
+// Block 0.  The layout on disk is, in order: superblock, group
+// descriptors, free block bitmap, journal, allocation groups.  Each group
+// is its slice of the inode table (one block per inode) followed by the
+// data blocks its files are given first; the last group also takes the
+// blocks left over at the end of the disk.
+// The first five fields keep the positions they had when the layout
+// was fixed at compile time.
+struct superblock {
+    uint64_t magic;         /* MAGIC_NUM */
+    uint64_t disksize;      /* size in bytes */
+    uint64_t ninodes;       /* length of the inode table */
+    uint64_t journalstart;  /* first journal block */
+    uint64_t journalblocks; /* length of the journal */
+    uint64_t nblocks;       /* blocks on the disk */
+    uint64_t bitmapstart;   /* first bitmap block */
+    uint64_t bitmapblocks;  /* length of the bitmap */
+    uint64_t inodestart;    /* first inode block; inode numbers are block numbers */
+    uint64_t datastart;     /* first block of the first group */
+    uint64_t gdtstart;      /* first group descriptor block */
+    uint64_t gdtblocks;     /* length of the group descriptor table */
+    uint64_t ngroups;       /* allocation groups on the disk */
+    uint64_t groupblocks;   /* length of every group but the last */
+    uint64_t groupinodes;   /* inodes at the front of every group */
+    uint64_t state;         /* SB_CLEAN, or 0 while mounted */
+    uint64_t pad[496];
+};
+
+// One per allocation group, GROUPS_PER_BLOCK to a block.  The free counts
+// are brought up to date whenever the disk is synced.
+struct groupdesc {
+    uint64_t start;         /* first block, which is its first inode */
+    uint64_t nblocks;       /* length, inode slice included */
+    uint64_t ninodes;       /* inode blocks at the front */
+    uint64_t freeblocks;    /* free data blocks */
+    uint64_t freeinodes;    /* free inodes */
+    uint64_t pad[3];
+};
+
+struct extent {
+    uint32_t lblk;          /* first logical block of the file it covers */
+    uint32_t len;           /* number of blocks in the run */
+    uint64_t start;         /* first physical block of the run */
+};
+
 struct inode {
     uint64_t size;          /* size in bytes */
     uint64_t mtime;         /* same as returned by time(NULL) */
     uint64_t type;          /* regular or directory */
-    uint64_t blocks[509];   /* list of data block numbers */
+    uint32_t nextents;      /* extents in use, sorted by lblk */
+    uint32_t flags;         /* INODE_INLINE */
+    uint64_t indirect;      /* block holding the next EXTENTS_PER_BLOCK extents */
+    uint64_t dindirect;     /* block of pointers to further blocks of extents */
+    union {
+        struct extent extents[NEXTENTS];  /* runs of contiguous data blocks */
+        uint8_t data[INLINE_MAX];         /* or the file itself, if small enough */
+    };
 };
 
 struct dirent {
-  char name[16]; // use strlen; when storing, add 1 to that bc youre adding a null terminator
+  char name[DIRENT_NAME_LEN]; // use strlen; when storing, add 1 to that bc youre adding a null terminator
   uint64_t finode;
 };
 
+// Logical block 0 of a directory.  Buckets follow at logical block 1 + b.
+struct dirheader {
+  uint64_t magic;           // DIR_MAGIC
+  uint64_t nentries;        // entries in the whole directory
+  uint64_t nbuckets;        // buckets in use, always 2^level + split
+  uint64_t level;           // buckets are addressed by the low level or level+1 hash bits
+  uint64_t split;           // next bucket to split; buckets below it use level+1 bits
+  uint64_t pad[507];
+};
+
+struct dirbucket {
+  uint32_t count;           // entries in use, packed at the front
+  uint32_t pad[3];
+  struct dirent entries[DIRENTS_PER_BUCKET];
+};
+
 int opendisk(char *filename, uint64_t size);
+int opendiskmapped(char *filename, uint64_t size);
 int readblock(int handle, uint64_t blocknum, void *buffer);
 int writeblock(int handle, uint64_t blocknum, void *buffer);
+int rawreadblock(int handle, uint64_t blocknum, void *buffer);
+int rawwriteblock(int handle, uint64_t blocknum, void *buffer);
+int rawreadblocks(int handle, uint64_t start, uint64_t count, void *buffer);
+int rawwriteblocks(int handle, uint64_t start, uint64_t count, void *buffer);
+int rawreadblockv(int handle, const uint64_t *blocknums, void **buffers, uint64_t count);
+int rawwriteblockv(int handle, const uint64_t *blocknums, void **buffers, uint64_t count);
+int readblocks(int handle, const uint64_t *blocknums, void **buffers, uint64_t count);
+int writeblocks(int handle, const uint64_t *blocknums, void **buffers, uint64_t count);
+const void* blockptr(int handle, uint64_t blocknum, void *scratch);
+int rawsync(int handle);
+void rawprefetch(int handle, uint64_t start, uint64_t count);
 int syncdisk(int handle);
 int closedisk(int handle);
-int diskformat(int handle);
+int diskformat(int handle, uint64_t size, uint64_t ninodes);
+int mountdisk(int handle);
 void diskdump(int handle);
 int checkbitset(int n);
 void setbit(int n);
 void clearbit(int n);
+uint64_t blocksfor(uint64_t size);
 int createfile(int handle, uint64_t filesize, uint64_t filetype);
+int createfilein(int handle, uint64_t filesize, uint64_t filetype, uint64_t dir_inode);
 void dumpfileinfo(int handle, uint64_t inode);
 void deletefile(int handle, uint64_t inode);
 int enlargefile(int handle, uint64_t inode, uint64_t size);
 int shrinkfile(int handle, uint64_t inode, uint64_t size);
+int punchhole(int handle, uint64_t inode, uint64_t offset, uint64_t len);
 int readfile(int handle, uint64_t blocknum, void *buffer, uint64_t sz);
 int writetofile(int handle, uint64_t inode, void* buffer, uint64_t size);
+int readfileat(int handle, uint64_t inode, void *buffer, uint64_t offset, uint64_t size);
+int writefileat(int handle, uint64_t inode, void *buffer, uint64_t offset, uint64_t size);
 int createdirectory(int handle);
 void deletedirectory(int handle, uint64_t dir_inode);
 int adddirentry(int handle, uint64_t dir_inode, uint64_t file_inode, char* filename);
 void dumpdirectory(int handle, uint64_t inode);
 char* ls(int handle, uint64_t dir_inode);
 int findinodebyfilename(int handle, uint64_t dir_inode, char* name);
-void removedirentry(int handle, uint64_t dir_inode);
+int removedirentry(int handle, uint64_t dir_inode, char* filename);
 int hierdirsearch(int handle, char* name, int root_inode);
+
+#endif
@@ -0,0 +1,180 @@
+#include "fsStats.h"
+#include "blockCache.h"
+#include "dentryCache.h"
+#include "inodeCache.h"
+#include "readAhead.h"
+
+// Counters for where the time goes.  Every thread adds to one of
+// STATS_STRIPES copies of struct fsstats, picked the first time it counts
+// something, so threads working at once seldom touch the same cache
+// lines; fsgetstats() adds the copies up.  The counters are bumped with
+// relaxed atomics and never take a lock.  Latencies go into histograms
+// of power-of-two buckets, which is enough to tell a p99 from a p50
+// without keeping every sample.
+// Building with -DFSSTATS=0 turns the calls that count into empty inline
+// functions, so the filesystem pays nothing for them.
+
+static struct fsstats stripes[STATS_STRIPES];
+
+static const char *opnames[OP_COUNT] = {
+  "create", "delete", "read", "write", "enlarge", "shrink", "punch",
+  "mkdir", "rmdir", "link", "unlink", "lookup", "sync",
+};
+
+#if FSSTATS
+static uint64_t nextstripe = 0;
+static __thread struct fsstats *mine = NULL;
+
+static struct fsstats* mystripe(void) {
+  if (mine == NULL) {
+    mine = &stripes[__atomic_fetch_add(&nextstripe, 1, __ATOMIC_RELAXED) % STATS_STRIPES];
+  }
+  return mine;
+}
+
+static void add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void raisemax(uint64_t *counter, uint64_t n) {
+  uint64_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  while (n > old && !__atomic_compare_exchange_n(counter, &old, n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+uint64_t statsclock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void statsop(enum fsop op, uint64_t start, bool failed) {
+  // an operation that started at start has just finished
+  uint64_t ns = statsclock() - start;
+  int bucket = 63 - __builtin_clzll(ns | 1);
+  struct opstats *s = &mystripe()->ops[op];
+  add(&s->count, 1);
+  add(&s->errors, failed);
+  add(&s->totalns, ns);
+  add(&s->hist[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+  raisemax(&s->maxns, ns);
+}
+
+void statsblocks(bool write, uint64_t count) {
+  struct fsstats *s = mystripe();
+  add(write ? &s->blockwrites : &s->blockreads, count);
+}
+
+void statsbytes(bool write, uint64_t count) {
+  struct fsstats *s = mystripe();
+  add(write ? &s->byteswritten : &s->bytesread, count);
+}
+
+void statssync(uint64_t start) {
+  struct fsstats *s = mystripe();
+  add(&s->syncs, 1);
+  add(&s->syncns, statsclock() - start);
+}
+
+void statsalloc(uint64_t blocks, uint64_t scanned) {
+  struct fsstats *s = mystripe();
+  add(&s->allocs, 1);
+  add(&s->allocblocks, blocks);
+  add(&s->allocscanned, scanned);
+  raisemax(&s->allocmaxscan, scanned);
+}
+#endif
+
+uint64_t statspercentile(const struct opstats *s, double q) {
+  // latency in ns that the fraction q of the operations stayed within,
+  // rounded up to the end of its histogram bucket
+  uint64_t want = q * s->count;
+  uint64_t seen = 0;
+  for (int b = 0; b < STATS_BUCKETS && s->count > 0; b++) {
+    seen += s->hist[b];
+    if (seen > want || seen == s->count) {
+      uint64_t upto = 2ULL << b;
+      return upto < s->maxns ? upto : s->maxns;
+    }
+  }
+  return 0;
+}
+
+const char* statsopname(enum fsop op) {
+  return op < OP_COUNT ? opnames[op] : "?";
+}
+
+void fsgetstats(struct fsstats *out) {
+  // the stripes are sums of uint64_t counters, except for the maxima
+  memset(out, 0, sizeof(*out));
+  uint64_t *sum = (uint64_t*) out;
+  for (int i = 0; i < STATS_STRIPES; i++) {
+    uint64_t *words = (uint64_t*) &stripes[i];
+    for (uint64_t w = 0; w < sizeof(struct fsstats) / sizeof(uint64_t); w++) {
+      sum[w] += __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+    }
+  }
+  for (int op = 0; op < OP_COUNT; op++) {
+    out->ops[op].maxns = 0;
+    for (int i = 0; i < STATS_STRIPES; i++) {
+      uint64_t m = __atomic_load_n(&stripes[i].ops[op].maxns, __ATOMIC_RELAXED);
+      out->ops[op].maxns = m > out->ops[op].maxns ? m : out->ops[op].maxns;
+    }
+  }
+  out->allocmaxscan = 0;
+  for (int i = 0; i < STATS_STRIPES; i++) {
+    uint64_t m = __atomic_load_n(&stripes[i].allocmaxscan, __ATOMIC_RELAXED);
+    out->allocmaxscan = m > out->allocmaxscan ? m : out->allocmaxscan;
+  }
+}
+
+void fsresetstats(void) {
+  for (int i = 0; i < STATS_STRIPES; i++) {
+    uint64_t *words = (uint64_t*) &stripes[i];
+    for (uint64_t w = 0; w < sizeof(struct fsstats) / sizeof(uint64_t); w++) {
+      __atomic_store_n(&words[w], 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void fsdumpstats(void) {
+  // prints the counters kept here and those of the caches
+  struct fsstats s;
+  fsgetstats(&s);
+  printf("\nBegin stats dump...\n");
+  if (!FSSTATS) {
+    printf("Operation counters were compiled out (FSSTATS=0)\n");
+  }
+  printf("%-8s %10s %7s %10s %10s %10s %10s %10s\n",
+         "op", "count", "errors", "avg_us", "p50_us", "p99_us", "p999_us", "max_us");
+  for (int op = 0; op < OP_COUNT; op++) {
+    struct opstats *o = &s.ops[op];
+    if (o->count == 0) {
+      continue;
+    }
+    printf("%-8s %10ld %7ld %10.2f %10.2f %10.2f %10.2f %10.2f\n", opnames[op], o->count, o->errors,
+           o->totalns / 1e3 / o->count, statspercentile(o, 0.50) / 1e3, statspercentile(o, 0.99) / 1e3,
+           statspercentile(o, 0.999) / 1e3, o->maxns / 1e3);
+  }
+  printf("Blocks read: %ld, written: %ld\n", s.blockreads, s.blockwrites);
+  printf("File bytes read: %ld, written: %ld\n", s.bytesread, s.byteswritten);
+  printf("Syncs: %ld, %.3f ms in all\n", s.syncs, s.syncns / 1e6);
+  printf("Allocator: %ld calls, %ld blocks, %.1f words scanned per call, %ld at most\n",
+         s.allocs, s.allocblocks, s.allocs > 0 ? (double) s.allocscanned / s.allocs : 0.0, s.allocmaxscan);
+
+  struct cachestats cs;
+  struct icachestats is;
+  struct dcachestats ds;
+  struct rastats ra;
+  cachegetstats(&cs);
+  icachegetstats(&is);
+  dcachegetstats(&ds);
+  ragetstats(&ra);
+  printf("Block cache: %ld hits, %ld misses, %ld evictions, %ld writebacks\n",
+         cs.hits, cs.misses, cs.evictions, cs.writebacks);
+  printf("Inode cache: %ld hits, %ld misses, %ld writebacks\n", is.hits, is.misses, is.writebacks);
+  printf("Dentry cache: %ld hits (%ld negative), %ld misses\n", ds.hits, ds.negativehits, ds.misses);
+  printf("Readahead: %ld windows, %ld blocks prefetched, %ld hit, %ld wasted\n",
+         ra.windows, ra.prefetched, ra.hits, ra.wasted);
+  printf("End stats dump\n");
+}
@@ -0,0 +1,74 @@
+#ifndef FSSTATS_H
+#define FSSTATS_H
+
+#include "fsHelpers.h"
+
+#ifndef FSSTATS
+#define FSSTATS 1                 /* 0 compiles every counter below out */
+#endif
+#define STATS_BUCKETS 40          /* bucket b counts operations of [2^b, 2^(b+1)) ns */
+#define STATS_STRIPES 16          /* copies of the counters, shared out among threads */
+
+// The calls that are counted and timed.  readfile(), writetofile() and
+// createfile() count as the call they are built on.
+enum fsop {
+    OP_CREATE,              /* createfilein() */
+    OP_DELETE,              /* deletefile() */
+    OP_READ,                /* readfileat() */
+    OP_WRITE,               /* writefileat() */
+    OP_ENLARGE,             /* enlargefile() */
+    OP_SHRINK,              /* shrinkfile() */
+    OP_PUNCH,               /* punchhole() */
+    OP_MKDIR,               /* createdirectory() */
+    OP_RMDIR,               /* deletedirectory() */
+    OP_LINK,                /* adddirentry() */
+    OP_UNLINK,              /* removedirentry() */
+    OP_LOOKUP,              /* findinodebyfilename() and hierdirsearch() */
+    OP_SYNC,                /* syncdisk() */
+    OP_COUNT
+};
+
+struct opstats {
+    uint64_t count;         /* calls made */
+    uint64_t errors;        /* calls that failed */
+    uint64_t totalns;       /* time spent in them */
+    uint64_t maxns;         /* the slowest one */
+    uint64_t hist[STATS_BUCKETS];
+};
+
+struct fsstats {
+    struct opstats ops[OP_COUNT];
+    uint64_t blockreads;    /* blocks read from the disk image */
+    uint64_t blockwrites;   /* blocks written to it */
+    uint64_t bytesread;     /* file bytes readfileat() returned */
+    uint64_t byteswritten;  /* file bytes writefileat() took */
+    uint64_t syncs;         /* fsync()/msync() calls */
+    uint64_t syncns;        /* time spent in them */
+    uint64_t allocs;        /* calls into the block allocator */
+    uint64_t allocblocks;   /* blocks they handed out */
+    uint64_t allocscanned;  /* bitmap words they looked at */
+    uint64_t allocmaxscan;  /* most words one call looked at */
+};
+
+#if FSSTATS
+uint64_t statsclock(void);
+void statsop(enum fsop op, uint64_t start, bool failed);
+void statsblocks(bool write, uint64_t count);
+void statsbytes(bool write, uint64_t count);
+void statssync(uint64_t start);
+void statsalloc(uint64_t blocks, uint64_t scanned);
+#else
+static inline uint64_t statsclock(void) { return 0; }
+static inline void statsop(enum fsop op, uint64_t start, bool failed) { (void) op; (void) start; (void) failed; }
+static inline void statsblocks(bool write, uint64_t count) { (void) write; (void) count; }
+static inline void statsbytes(bool write, uint64_t count) { (void) write; (void) count; }
+static inline void statssync(uint64_t start) { (void) start; }
+static inline void statsalloc(uint64_t blocks, uint64_t scanned) { (void) blocks; (void) scanned; }
+#endif
+uint64_t statspercentile(const struct opstats *s, double q);
+const char* statsopname(enum fsop op);
+void fsgetstats(struct fsstats *stats);
+void fsresetstats(void);
+void fsdumpstats(void);
+
+#endif
@@ -0,0 +1,219 @@
+#include "fsTrace.h"
+
+// Records the calls made into the filesystem so a workload can be played
+// back later, see tools/replay.c.  Each call the public functions finish
+// becomes one record: the op in a byte, the time since the previous
+// record, then the arguments and result, all as zigzagged varints, and a
+// length-prefixed name for the calls that take one.  Most records come
+// to a dozen bytes or so.  File contents are not kept, only the sizes.
+// Records from all threads go into one buffer under a lock, in the order
+// the calls finished, and reach the file TRACE_BUFFER bytes at a time.
+
+bool tracing = false;
+
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *tracefile = NULL;
+static uint8_t *buffer = NULL;
+static size_t used = 0;
+static uint64_t origin = 0;     /* clock reading the trace started at */
+static uint64_t last = 0;       /* time of the previous record, from origin */
+
+// arguments each op records, result included, and whether a name follows
+static const int nargs[TRACE_OPS] = {
+  [TRACE_CREATE] = 4, [TRACE_DELETE] = 1, [TRACE_READ] = 4, [TRACE_WRITE] = 4,
+  [TRACE_ENLARGE] = 3, [TRACE_SHRINK] = 3, [TRACE_PUNCH] = 4, [TRACE_MKDIR] = 1,
+  [TRACE_RMDIR] = 1, [TRACE_LINK] = 3, [TRACE_UNLINK] = 2, [TRACE_LOOKUP] = 2,
+  [TRACE_PATH] = 2, [TRACE_SYNC] = 1,
+};
+static const bool named[TRACE_OPS] = {
+  [TRACE_LINK] = true, [TRACE_UNLINK] = true, [TRACE_LOOKUP] = true, [TRACE_PATH] = true,
+};
+static const char *opnames[TRACE_OPS] = {
+  [TRACE_CREATE] = "create", [TRACE_DELETE] = "delete", [TRACE_READ] = "read",
+  [TRACE_WRITE] = "write", [TRACE_ENLARGE] = "enlarge", [TRACE_SHRINK] = "shrink",
+  [TRACE_PUNCH] = "punch", [TRACE_MKDIR] = "mkdir", [TRACE_RMDIR] = "rmdir",
+  [TRACE_LINK] = "link", [TRACE_UNLINK] = "unlink", [TRACE_LOOKUP] = "lookup",
+  [TRACE_PATH] = "path", [TRACE_SYNC] = "sync",
+};
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t zigzag(int64_t v) {
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static size_t putvarint(uint8_t *out, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  out[n++] = v;
+  return n;
+}
+
+static int getvarint(FILE *file, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(file);
+    if (c == EOF) {
+      return -1;
+    }
+    *v |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void flush(void) {
+  if (used > 0 && fwrite(buffer, 1, used, tracefile) != used) {
+    FSLOG(FSLOG_ERROR, "Error: could not write the trace\n");
+  }
+  used = 0;
+}
+
+int tracestart(const char *path, uint64_t disksize, uint64_t ninodes) {
+  // starts recording every call into the file at path, replacing it
+  pthread_mutex_lock(&tracelock);
+  if (tracefile != NULL) {
+    pthread_mutex_unlock(&tracelock);
+    FSLOG(FSLOG_ERROR, "Error: a trace is already being recorded\n");
+    return -1;
+  }
+  if (buffer == NULL && (buffer = malloc(TRACE_BUFFER)) == NULL) {
+    pthread_mutex_unlock(&tracelock);
+    FSLOG(FSLOG_ERROR, "Error: no memory for the trace buffer\n");
+    return -1;
+  }
+  struct traceheader hdr = { .magic = TRACE_MAGIC, .disksize = disksize, .ninodes = ninodes };
+  FILE *file = fopen(path, "wb");
+  if (file == NULL || fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+    if (file != NULL) {
+      fclose(file);
+    }
+    pthread_mutex_unlock(&tracelock);
+    FSLOG(FSLOG_ERROR, "Error: could not create trace %s\n", path);
+    return -1;
+  }
+  tracefile = file;
+  used = 0;
+  origin = now();
+  last = 0;
+  __atomic_store_n(&tracing, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&tracelock);
+  FSLOG(FSLOG_INFO, "Tracing calls to %s\n", path);
+  return 0;
+}
+
+int tracestop(void) {
+  // writes out what is buffered and closes the trace
+  pthread_mutex_lock(&tracelock);
+  __atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+  if (tracefile == NULL) {
+    pthread_mutex_unlock(&tracelock);
+    return -1;
+  }
+  flush();
+  int result = fclose(tracefile) == 0 ? 0 : -1;
+  tracefile = NULL;
+  pthread_mutex_unlock(&tracelock);
+  return result;
+}
+
+void traceop(enum traceop op, uint64_t start, const char *name, const int64_t *args, int n) {
+  // a call that began at start has finished; with FSSTATS=0 there is no
+  // start reading, and the record gets the time it finished instead
+  uint8_t rec[1 + 10 * (1 + TRACE_MAX_ARGS) + 10 + PATH_MAX];
+  size_t len = 1;
+  rec[0] = op;
+  if (start == 0) {
+    start = now();
+  }
+  size_t namelen = named[op] && name != NULL ? strnlen(name, PATH_MAX - 1) : 0;
+
+  pthread_mutex_lock(&tracelock);
+  if (tracefile == NULL) {
+    pthread_mutex_unlock(&tracelock);
+    return;
+  }
+  uint64_t time = start > origin ? start - origin : 0;
+  len += putvarint(rec + len, zigzag(time - last));
+  last = time;
+  for (int i = 0; i < nargs[op]; i++) {
+    len += putvarint(rec + len, zigzag(i < n ? args[i] : 0));
+  }
+  if (named[op]) {
+    len += putvarint(rec + len, namelen);
+    memcpy(rec + len, name, namelen);
+    len += namelen;
+  }
+  if (used + len > TRACE_BUFFER) {
+    flush();
+  }
+  memcpy(buffer + used, rec, len);
+  used += len;
+  pthread_mutex_unlock(&tracelock);
+}
+
+FILE* traceopen(const char *path, struct traceheader *hdr) {
+  // opens a trace for reading and checks it is one
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    FSLOG(FSLOG_ERROR, "Error: could not open trace %s\n", path);
+    return NULL;
+  }
+  if (fread(hdr, sizeof(*hdr), 1, file) != 1 || hdr->magic != TRACE_MAGIC) {
+    fclose(file);
+    FSLOG(FSLOG_ERROR, "Error: %s is not a trace\n", path);
+    return NULL;
+  }
+  return file;
+}
+
+int tracenext(FILE *file, struct tracerecord *rec) {
+  // reads the next record into rec, which must start out zeroed since
+  // times are kept relative to the previous record; 1 for a record, 0 at
+  // the end of the trace, -1 if it is damaged
+  int op = getc(file);
+  if (op == EOF) {
+    return 0;
+  }
+  if (op <= 0 || op >= TRACE_OPS) {
+    return -1;
+  }
+  uint64_t v;
+  if (getvarint(file, &v) < 0) {
+    return -1;
+  }
+  rec->op = op;
+  rec->time += unzigzag(v);
+  rec->nargs = nargs[op];
+  for (int i = 0; i < rec->nargs; i++) {
+    if (getvarint(file, &v) < 0) {
+      return -1;
+    }
+    rec->args[i] = unzigzag(v);
+  }
+  rec->name[0] = '\0';
+  if (named[op]) {
+    if (getvarint(file, &v) < 0 || v >= PATH_MAX || fread(rec->name, 1, v, file) != v) {
+      return -1;
+    }
+    rec->name[v] = '\0';
+  }
+  return 1;
+}
+
+const char* traceopname(int op) {
+  return op > 0 && op < TRACE_OPS ? opnames[op] : "?";
+}
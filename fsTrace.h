@@ -0,0 +1,68 @@
+#ifndef FSTRACE_H
+#define FSTRACE_H
+
+#include "fsHelpers.h"
+
+#define TRACE_MAGIC 0x31454341525453ULL   /* "STRACE1" */
+#define TRACE_BUFFER (256 << 10)          /* bytes of records gathered per write to the file */
+#define TRACE_MAX_ARGS 4
+
+// The calls a trace records, one record each, in the order they finished.
+enum traceop {
+    TRACE_CREATE = 1,       /* filesize, filetype, dir_inode -> inode */
+    TRACE_DELETE,           /* inode */
+    TRACE_READ,             /* inode, offset, size -> bytes */
+    TRACE_WRITE,            /* inode, offset, size -> bytes */
+    TRACE_ENLARGE,          /* inode, size -> new size */
+    TRACE_SHRINK,           /* inode, size -> new size */
+    TRACE_PUNCH,            /* inode, offset, len -> result */
+    TRACE_MKDIR,            /* -> inode */
+    TRACE_RMDIR,            /* dir_inode */
+    TRACE_LINK,             /* dir_inode, file_inode, name -> result */
+    TRACE_UNLINK,           /* dir_inode, name -> result */
+    TRACE_LOOKUP,           /* dir_inode, name -> inode */
+    TRACE_PATH,             /* root_inode, path -> inode */
+    TRACE_SYNC,             /* -> result */
+    TRACE_OPS
+};
+
+// Start of a trace file; the records follow.
+struct traceheader {
+    uint64_t magic;         /* TRACE_MAGIC */
+    uint64_t disksize;      /* size of the disk the calls were made on */
+    uint64_t ninodes;       /* inodes it was formatted with, 0 for the default */
+};
+
+// One record as tracenext() hands it back.  The result is the last arg.
+struct tracerecord {
+    int op;
+    uint64_t time;          /* ns from the start of the trace to the call */
+    int nargs;
+    int64_t args[TRACE_MAX_ARGS];
+    char name[PATH_MAX];    /* the name or path, for the calls that take one */
+};
+
+extern bool tracing;
+
+// whether calls are being recorded; one load, so untraced calls pay no more
+static inline bool traceactive(void) {
+  return __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+}
+
+int tracestart(const char *path, uint64_t disksize, uint64_t ninodes);
+int tracestop(void);
+void traceop(enum traceop op, uint64_t start, const char *name, const int64_t *args, int nargs);
+FILE* traceopen(const char *path, struct traceheader *hdr);
+int tracenext(FILE *file, struct tracerecord *rec);
+const char* traceopname(int op);
+
+// records a call that started at start (a statsclock() reading); the
+// arguments are those listed for op above, result last
+#define TRACE(op, start, name, ...) do { \
+  if (traceactive()) { \
+    int64_t traceargs_[] = { __VA_ARGS__ }; \
+    traceop((op), (start), (name), traceargs_, countof(traceargs_)); \
+  } \
+} while (0)
+
+#endif
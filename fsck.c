@@ -0,0 +1,436 @@
+#include "fsck.h"
+#include "blockCache.h"
+
+// Consistency checker.  The free block bitmap is only ever changed
+// alongside the inodes that refer to the blocks, so a bug or a damaged
+// image can leave blocks marked in use that no file has (leaked), blocks
+// a file has that are marked free and will be handed out again
+// (unmarked), or one block in two files (cross-linked).  fsck() rebuilds
+// the bitmap from the inodes and compares the two.
+//
+// Worker threads take the allocation groups one at a time.  Each reads
+// its group's slice of the inode table FSCK_BATCH blocks per call,
+// skipping stretches with no inode in use, and for every inode in use
+// reads its map blocks and marks its extents in the rebuilt bitmap with
+// an atomic or; a bit that was already set is a cross-link.  File data
+// is never read, so the disk is read mostly in long sequential runs and
+// several at once.  Directories have their buckets read as well, and an
+// entry naming an inode not in use is dangling.
+//
+// Repairing writes the rebuilt bitmap in place of the old one and mounts
+// the disk again, which reads it back and recounts the groups, then
+// removes the dangling entries.  Cross-linked blocks are only reported:
+// which file should keep them cannot be told from the disk.
+
+struct danglingentry {
+  uint64_t dir;
+  char name[DIRENT_NAME_LEN + 1];
+};
+
+struct fsckrun {
+  int handle;
+  struct superblock sb;
+  uint64_t *bitmap;         // the free block bitmap as it is on the disk
+  uint64_t *refs;           // the one rebuilt from what the inodes refer to
+  uint64_t nextgroup;       // next group a worker takes
+  bool failed;              // something could not be read, so refs is incomplete
+  struct fsckreport *report;
+  pthread_mutex_t lock;     // guards the list below
+  struct danglingentry *dangling;
+  uint64_t ndangling;
+  uint64_t capdangling;
+};
+
+// what a worker keeps from one inode to the next
+struct fsckworker {
+  struct fsckrun *run;
+  uint8_t *inodes;          // FSCK_BATCH blocks of the inode table
+  uint8_t *buckets;         // FSCK_BATCH blocks of a directory
+  struct extent *extents;   // the extents of the inode being checked
+  uint64_t capextents;
+};
+
+// prints the nth problem of a kind, for the first FSCK_REPORT_MAX of them
+#define NOTE(nth, ...) do { if ((nth) <= FSCK_REPORT_MAX) FSLOG(FSLOG_INFO, __VA_ARGS__); } while (0)
+
+static uint64_t tally(uint64_t *counter, uint64_t n) {
+  return __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static bool bitset(const uint64_t *bits, uint64_t n) {
+  return (bits[n / 64] >> (n % 64)) & 1;
+}
+
+static void setbits(uint64_t *bits, uint64_t from, uint64_t to) {
+  for (uint64_t n = from; n < to; n++) {
+    bits[n / 64] |= 1ULL << (n % 64);
+  }
+}
+
+static uint64_t groupstart(const struct superblock *sb, uint64_t g) {
+  return sb->datastart + g * sb->groupblocks;
+}
+
+static uint64_t groupend(const struct superblock *sb, uint64_t g) {
+  return g + 1 < sb->ngroups ? groupstart(sb, g) + sb->groupblocks : sb->nblocks;
+}
+
+// the group block n is in; n must not be in front of the groups
+static uint64_t groupat(const struct superblock *sb, uint64_t n) {
+  uint64_t g = (n - sb->datastart) / sb->groupblocks;
+  return g < sb->ngroups ? g : sb->ngroups - 1;
+}
+
+// whether n is the block of an inode in use
+static bool inodeinuse(struct fsckrun *run, uint64_t n) {
+  if (n < run->sb.datastart || n >= run->sb.nblocks) {
+    return false;
+  }
+  return n - groupstart(&run->sb, groupat(&run->sb, n)) < run->sb.groupinodes && bitset(run->bitmap, n);
+}
+
+// whether len blocks from start are all data blocks of one group
+static bool indata(struct fsckrun *run, uint64_t start, uint64_t len) {
+  if (len == 0 || start < run->sb.datastart || start >= run->sb.nblocks) {
+    return false;
+  }
+  uint64_t g = groupat(&run->sb, start);
+  return start >= groupstart(&run->sb, g) + run->sb.groupinodes && len <= groupend(&run->sb, g) - start;
+}
+
+static int readrun(struct fsckworker *w, uint64_t start, uint64_t count, void *buffer) {
+  tally(&w->run->report->blocksread, count);
+  if (rawreadblocks(w->run->handle, start, count, buffer) < 0) {
+    FSLOG(FSLOG_ERROR, "fsck could not read blocks %ld+%ld\n", start, count);
+    w->run->failed = true;
+    return -1;
+  }
+  return 0;
+}
+
+// marks len blocks from start as referred to by inode; false if they
+// are not data blocks
+static bool claim(struct fsckworker *w, uint64_t inode, uint64_t start, uint64_t len) {
+  struct fsckrun *run = w->run;
+  if (!indata(run, start, len)) {
+    NOTE(tally(&run->report->badextents, 1),
+         "Inode %ld refers to blocks %ld+%ld, which are not data blocks\n", inode, start, len);
+    return false;
+  }
+  uint64_t shared = 0;
+  uint64_t end = start + len;
+  for (uint64_t n = start; n < end; ) {
+    uint64_t off = n % 64;
+    uint64_t bits = end - n < 64 - off ? end - n : 64 - off;
+    uint64_t mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << off;
+    uint64_t old = __atomic_fetch_or(&run->refs[n / 64], mask, __ATOMIC_RELAXED);
+    shared += __builtin_popcountll(old & mask);
+    n += bits;
+  }
+  tally(&run->report->blocks, len);
+  if (shared > 0) {
+    NOTE(tally(&run->report->crosslinked, shared),
+         "Inode %ld shares %ld of blocks %ld+%ld with another file\n", inode, shared, start, len);
+  }
+  return true;
+}
+
+// reads a map block the inode refers to into buffer, if it is one
+static int loadmap(struct fsckworker *w, uint64_t inode, uint64_t blocknum, void *buffer) {
+  if (!claim(w, inode, blocknum, 1)) {
+    return -1;
+  }
+  return readrun(w, blocknum, 1, buffer);
+}
+
+// gathers the inode's extents into w->extents and claims its map blocks;
+// returns how many extents there are, or -1 if they cannot be had
+static int64_t loadextents(struct fsckworker *w, uint64_t inode, const struct inode *node) {
+  uint64_t n = node->nextents;
+  if (n > MAX_EXTENTS) {
+    NOTE(tally(&w->run->report->badextents, 1), "Inode %ld claims %ld extents\n", inode, n);
+    return -1;
+  }
+  if (n > w->capextents) {
+    struct extent *grown = realloc(w->extents, n * sizeof(struct extent));
+    if (grown == NULL) {
+      w->run->failed = true;
+      return -1;
+    }
+    w->extents = grown;
+    w->capextents = n;
+  }
+  uint64_t have = n < NEXTENTS ? n : NEXTENTS;
+  memcpy(w->extents, node->extents, have * sizeof(struct extent));
+
+  // every map block the inode points at is its own, needed or not
+  struct extent leaf[EXTENTS_PER_BLOCK];
+  int result = 0;
+  if (node->indirect != 0) {
+    if (loadmap(w, inode, node->indirect, leaf) == 0) {
+      uint64_t take = n - have < EXTENTS_PER_BLOCK ? n - have : EXTENTS_PER_BLOCK;
+      memcpy(w->extents + have, leaf, take * sizeof(struct extent));
+      have += take;
+    } else {
+      result = -1;
+    }
+  }
+  if (node->dindirect != 0) {
+    uint64_t pointers[POINTERS_PER_BLOCK];
+    if (loadmap(w, inode, node->dindirect, pointers) < 0) {
+      return -1;
+    }
+    for (uint64_t p = 0; p < POINTERS_PER_BLOCK; p++) {
+      if (pointers[p] == 0) {
+        continue;
+      }
+      if (loadmap(w, inode, pointers[p], leaf) < 0) {
+        result = -1;
+        continue;
+      }
+      if (have < n && have >= NEXTENTS + EXTENTS_PER_BLOCK) {
+        uint64_t take = n - have < EXTENTS_PER_BLOCK ? n - have : EXTENTS_PER_BLOCK;
+        memcpy(w->extents + have, leaf, take * sizeof(struct extent));
+        have += take;
+      }
+    }
+  }
+  if (have < n) {
+    NOTE(tally(&w->run->report->badextents, 1), "Inode %ld is missing map blocks\n", inode);
+    result = -1;
+  }
+  return result < 0 ? -1 : (int64_t) n;
+}
+
+// physical block of logical block lblk of the inode whose extents were
+// loaded, and in left the blocks after it in the same extent; 0 for a hole
+static uint64_t physical(struct fsckworker *w, uint64_t n, uint64_t lblk, uint64_t *left) {
+  uint64_t lo = 0;
+  uint64_t hi = n;
+  while (lo < hi) {
+    uint64_t mid = (lo + hi) / 2;
+    struct extent *e = &w->extents[mid];
+    if (lblk < e->lblk) {
+      hi = mid;
+    } else if (lblk >= (uint64_t) e->lblk + e->len) {
+      lo = mid + 1;
+    } else {
+      *left = e->lblk + e->len - lblk;
+      return e->start + (lblk - e->lblk);
+    }
+  }
+  return 0;
+}
+
+static void dangling(struct fsckworker *w, uint64_t dir, const struct dirent *d) {
+  struct fsckrun *run = w->run;
+  struct danglingentry entry = { .dir = dir };
+  memcpy(entry.name, d->name, DIRENT_NAME_LEN);
+  entry.name[DIRENT_NAME_LEN] = '\0';
+  pthread_mutex_lock(&run->lock);
+  if (run->ndangling == run->capdangling) {
+    uint64_t cap = run->capdangling > 0 ? 2 * run->capdangling : 64;
+    struct danglingentry *grown = realloc(run->dangling, cap * sizeof(struct danglingentry));
+    if (grown != NULL) {
+      run->dangling = grown;
+      run->capdangling = cap;
+    }
+  }
+  if (run->ndangling < run->capdangling) {
+    run->dangling[run->ndangling++] = entry;
+  }
+  pthread_mutex_unlock(&run->lock);
+  NOTE(tally(&run->report->dangling, 1),
+       "Directory %ld has an entry '%s' for inode %ld, which is not in use\n", dir, entry.name, d->finode);
+}
+
+// checks every entry of a directory whose n extents were loaded
+static void checkdir(struct fsckworker *w, uint64_t inode, uint64_t n) {
+  struct fsckrun *run = w->run;
+  struct dirheader hdr;
+  uint64_t left = 0;
+  uint64_t p = physical(w, n, 0, &left);
+  if (p == 0 || !indata(run, p, 1) || readrun(w, p, 1, &hdr) < 0 || hdr.magic != DIR_MAGIC) {
+    NOTE(tally(&run->report->baddirs, 1), "Directory %ld has a damaged header\n", inode);
+    return;
+  }
+  // buckets are logical blocks 1 to nbuckets; a run of them is read at once
+  uint64_t lblk = 1;
+  while (lblk <= hdr.nbuckets) {
+    p = physical(w, n, lblk, &left);
+    if (p == 0) {
+      NOTE(tally(&run->report->baddirs, 1), "Directory %ld is missing bucket %ld\n", inode, lblk - 1);
+      return;
+    }
+    uint64_t len = left < FSCK_BATCH ? left : FSCK_BATCH;
+    len = len < hdr.nbuckets + 1 - lblk ? len : hdr.nbuckets + 1 - lblk;
+    if (indata(run, p, len) && readrun(w, p, len, w->buckets) == 0) {
+      for (uint64_t b = 0; b < len; b++) {
+        const struct dirbucket *bucket = (const struct dirbucket*) (w->buckets + b * BLOCK_SIZE);
+        uint32_t count = bucket->count < DIRENTS_PER_BUCKET ? bucket->count : DIRENTS_PER_BUCKET;
+        for (uint32_t i = 0; i < count; i++) {
+          if (!inodeinuse(run, bucket->entries[i].finode)) {
+            dangling(w, inode, &bucket->entries[i]);
+          }
+        }
+      }
+    }
+    lblk += len;
+  }
+}
+
+static void checkinode(struct fsckworker *w, uint64_t inode, const struct inode *node) {
+  struct fsckreport *report = w->run->report;
+  tally(&report->inodes, 1);
+  if (node->type == FILETYPE_DIRECTORY) {
+    tally(&report->directories, 1);
+  }
+  // a small file's bytes are in the inode, which is all it has
+  if (node->flags & INODE_INLINE) {
+    return;
+  }
+  int64_t n = loadextents(w, inode, node);
+  if (n < 0) {
+    return;
+  }
+  for (int64_t k = 0; k < n; k++) {
+    claim(w, inode, w->extents[k].start, w->extents[k].len);
+  }
+  if (node->type == FILETYPE_DIRECTORY) {
+    checkdir(w, inode, n);
+  }
+}
+
+static void* fsckthread(void *arg) {
+  struct fsckworker w = { .run = arg };
+  struct fsckrun *run = w.run;
+  w.inodes = malloc(FSCK_BATCH * BLOCK_SIZE);
+  w.buckets = malloc(FSCK_BATCH * BLOCK_SIZE);
+  if (w.inodes == NULL || w.buckets == NULL) {
+    run->failed = true;
+  }
+  uint64_t g;
+  while (!run->failed && (g = __atomic_fetch_add(&run->nextgroup, 1, __ATOMIC_RELAXED)) < run->sb.ngroups) {
+    uint64_t first = groupstart(&run->sb, g);
+    for (uint64_t i = 0; i < run->sb.groupinodes; i += FSCK_BATCH) {
+      uint64_t len = run->sb.groupinodes - i < FSCK_BATCH ? run->sb.groupinodes - i : FSCK_BATCH;
+      // stretches of free inodes are not read at all
+      uint64_t used = len;
+      while (used > 0 && !bitset(run->bitmap, first + i + used - 1)) {
+        used--;
+      }
+      if (used == 0 || readrun(&w, first + i, used, w.inodes) < 0) {
+        continue;
+      }
+      for (uint64_t j = 0; j < used; j++) {
+        if (bitset(run->bitmap, first + i + j)) {
+          checkinode(&w, first + i + j, (const struct inode*) (w.inodes + j * BLOCK_SIZE));
+        }
+      }
+    }
+  }
+  free(w.inodes);
+  free(w.buckets);
+  free(w.extents);
+  return NULL;
+}
+
+static int fsckrepair(struct fsckrun *run) {
+  struct fsckreport *report = run->report;
+  if (report->leaked + report->unmarked > 0) {
+    // the cache still holds the old bitmap blocks, clean since the sync
+    cacheinvalidate(run->handle);
+    if (rawwriteblocks(run->handle, run->sb.bitmapstart, run->sb.bitmapblocks, run->refs) < 0 ||
+        rawsync(run->handle) < 0 || mountdisk(run->handle) < 0) {
+      FSLOG(FSLOG_ERROR, "fsck could not write the rebuilt bitmap\n");
+      return -1;
+    }
+    report->repaired += report->leaked + report->unmarked;
+  }
+  for (uint64_t i = 0; i < run->ndangling; i++) {
+    if (removedirentry(run->handle, run->dangling[i].dir, run->dangling[i].name) == 0) {
+      report->repaired++;
+    }
+  }
+  return syncdisk(run->handle);
+}
+
+int fsck(int handle, int threads, bool repair, struct fsckreport *report) {
+  // Checks the filesystem on a mounted disk with up to threads workers,
+  // or one per processor for 0, and fixes what it can if repair is set.
+  // Nothing else may use the disk while it runs.
+  // Returns 0 once the disk was checked, whatever was found, else -1.
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(report, 0, sizeof(*report));
+  struct fsckrun run = { .handle = handle, .report = report, .lock = PTHREAD_MUTEX_INITIALIZER };
+  if (syncdisk(handle) < 0 || rawreadblock(handle, 0, &run.sb) < 0 || run.sb.magic != MAGIC_NUM) {
+    FSLOG(FSLOG_ERROR, "fsck found no filesystem to check\n");
+    return -1;
+  }
+  uint64_t nwords = run.sb.bitmapblocks * (BLOCK_SIZE / sizeof(uint64_t));
+  run.bitmap = malloc(nwords * sizeof(uint64_t));
+  run.refs = calloc(nwords, sizeof(uint64_t));
+  if (run.bitmap == NULL || run.refs == NULL ||
+      rawreadblocks(handle, run.sb.bitmapstart, run.sb.bitmapblocks, run.bitmap) < 0) {
+    FSLOG(FSLOG_ERROR, "fsck could not read the bitmap\n");
+    free(run.bitmap);
+    free(run.refs);
+    return -1;
+  }
+  report->blocksread = 1 + run.sb.bitmapblocks;
+
+  // in use without an inode referring to them: the layout in front of
+  // the groups, the inodes themselves, and bits past the end of the disk
+  setbits(run.refs, 0, run.sb.datastart);
+  setbits(run.refs, run.sb.nblocks, nwords * 64);
+  for (uint64_t g = 0; g < run.sb.ngroups; g++) {
+    uint64_t first = groupstart(&run.sb, g);
+    for (uint64_t n = first; n < first + run.sb.groupinodes; n++) {
+      if (bitset(run.bitmap, n)) {
+        setbits(run.refs, n, n + 1);
+      }
+    }
+  }
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  threads = threads < FSCK_MAX_THREADS ? threads : FSCK_MAX_THREADS;
+  threads = (uint64_t) threads < run.sb.ngroups ? threads : (int) run.sb.ngroups;
+  pthread_t workers[FSCK_MAX_THREADS];
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    started += pthread_create(&workers[started], NULL, fsckthread, &run) == 0;
+  }
+  if (started == 0) {
+    fsckthread(&run);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (uint64_t w = 0; w < nwords && !run.failed; w++) {
+    uint64_t leaked = run.bitmap[w] & ~run.refs[w];
+    uint64_t unmarked = run.refs[w] & ~run.bitmap[w];
+    for (; leaked != 0; leaked &= leaked - 1) {
+      NOTE(++report->leaked, "Block %ld is marked in use but belongs to no file\n", w * 64 + __builtin_ctzll(leaked));
+    }
+    for (; unmarked != 0; unmarked &= unmarked - 1) {
+      NOTE(++report->unmarked, "Block %ld belongs to a file but is marked free\n", w * 64 + __builtin_ctzll(unmarked));
+    }
+  }
+
+  int result = run.failed ? -1 : 0;
+  if (run.failed) {
+    FSLOG(FSLOG_ERROR, "fsck could not read the whole disk, so it repaired nothing\n");
+  } else if (repair && fsckrepair(&run) < 0) {
+    result = -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  report->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  free(run.bitmap);
+  free(run.refs);
+  free(run.dangling);
+  return result;
+}
@@ -0,0 +1,28 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "fsHelpers.h"
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_BATCH 256              /* blocks read at once from an inode slice or a directory */
+#define FSCK_REPORT_MAX 16          /* problems of each kind printed one by one */
+
+// What fsck() found, and what it fixed if asked to.
+struct fsckreport {
+    uint64_t inodes;        /* inodes in use */
+    uint64_t directories;   /* of which directories */
+    uint64_t blocks;        /* blocks the inodes refer to, map blocks included */
+    uint64_t leaked;        /* marked in use, but nothing refers to them */
+    uint64_t unmarked;      /* referred to, but marked free */
+    uint64_t crosslinked;   /* referred to more than once */
+    uint64_t badextents;    /* extents or map blocks outside the data blocks */
+    uint64_t baddirs;       /* directories with a damaged header */
+    uint64_t dangling;      /* directory entries naming an inode not in use */
+    uint64_t repaired;      /* problems fixed */
+    uint64_t blocksread;    /* blocks read to check the disk */
+    double seconds;
+};
+
+int fsck(int handle, int threads, bool repair, struct fsckreport *report);
+
+#endif
@@ -0,0 +1,377 @@
+#include "inodeCache.h"
+#include <stddef.h>
+
+// Decoded inodes, so that operations on an open file do no inode I/O.
+// iget() hands out a pointer to the cached struct inode and takes a
+// reference; iput() drops it.  Callers change the inode in place and call
+// imarkdirty(); nothing is written until iflush() runs, which syncdisk()
+// does right before committing, so every inode changed by a transaction
+// goes to the journal with it.  Only unreferenced inodes are recycled,
+// with the same CLOCK scheme as the block cache, and a dirty one is
+// written to its block first.
+// A mutex covers the table and the reference counts.  It is not held
+// while an inode is read: the entry goes in marked as loading first, and
+// other iget() calls for it wait on iloaded until the read is done.
+// The inode itself
+// is guarded by a reader-writer lock of its own, which callers take with
+// ilock() for as long as they look at or change it, so operations on
+// different files do not wait for each other.
+// Each cached inode also remembers how its file is being read, for
+// readahead; that goes when the inode leaves the cache.
+
+struct cinode {
+  uint64_t inum;
+  int handle;
+  bool valid;
+  bool dirty;
+  bool referenced;     // second-chance bit for the clock hand
+  bool loading;        // being read by iget(); the node is not there yet
+  int refcount;        // iget() calls not yet matched by iput()
+  int64_t next;        // next entry in the same hash bucket, -1 terminates
+  pthread_rwlock_t lock;
+  struct readahead ra;
+  struct inode node;
+};
+
+static struct cinode *cinodes = NULL;
+static int64_t *ibuckets = NULL;
+static uint64_t ncinodes = 0;
+static uint64_t nibuckets = 0;
+static uint64_t ihand = 0;
+static uint64_t nidirty = 0;
+static struct icachestats istats;
+static pthread_mutex_t icachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t iloaded = PTHREAD_COND_INITIALIZER;
+
+static uint64_t hashinode(int handle, uint64_t inum) {
+  uint64_t h = inum * 0x9E3779B97F4A7C15ULL + (uint64_t) handle;
+  return (h ^ (h >> 29)) & (nibuckets - 1);
+}
+
+static struct cinode* cinodeof(struct inode *node) {
+  return (struct cinode*) ((uint8_t*) node - offsetof(struct cinode, node));
+}
+
+static int icacheresize(uint64_t ninodes) {
+  // resizing drops every inode, so write the dirty ones out first;
+  // fails if any inode is still referenced
+  for (uint64_t i = 0; i < ncinodes; i++) {
+    if (cinodes[i].valid && cinodes[i].refcount > 0) {
+      FSLOG(FSLOG_ERROR, "inode %ld is still in use\n", cinodes[i].inum);
+      return -1;
+    }
+  }
+  for (uint64_t i = 0; i < ncinodes; i++) {
+    if (cinodes[i].valid && cinodes[i].dirty) {
+      if (writeblock(cinodes[i].handle, cinodes[i].inum, &cinodes[i].node) < 0) {
+        return -1;
+      }
+      istats.writebacks++;
+    }
+  }
+  for (uint64_t i = 0; i < ncinodes; i++) {
+    pthread_rwlock_destroy(&cinodes[i].lock);
+  }
+  free(cinodes);
+  free(ibuckets);
+  cinodes = NULL;
+  ibuckets = NULL;
+  ncinodes = 0;
+  nidirty = 0;
+
+  if (ninodes == 0) {
+    return 0;
+  }
+
+  nibuckets = 1;
+  while (nibuckets < ninodes * 2) {
+    nibuckets <<= 1;
+  }
+  cinodes = calloc(ninodes, sizeof(struct cinode));
+  ibuckets = malloc(nibuckets * sizeof(int64_t));
+  if (cinodes == NULL || ibuckets == NULL) {
+    FSLOG(FSLOG_ERROR, "could not allocate inode cache of %ld inodes\n", ninodes);
+    free(cinodes);
+    free(ibuckets);
+    cinodes = NULL;
+    ibuckets = NULL;
+    return -1;
+  }
+  for (uint64_t i = 0; i < nibuckets; i++) {
+    ibuckets[i] = -1;
+  }
+  for (uint64_t i = 0; i < ninodes; i++) {
+    cinodes[i].next = -1;
+    pthread_rwlock_init(&cinodes[i].lock, NULL);
+  }
+  ncinodes = ninodes;
+  ihand = 0;
+  istats.capacity = ninodes;
+  return 0;
+}
+
+int icachesetsize(uint64_t ninodes) {
+  pthread_mutex_lock(&icachelock);
+  int result = icacheresize(ninodes);
+  pthread_mutex_unlock(&icachelock);
+  return result;
+}
+
+static int64_t icachelookup(int handle, uint64_t inum) {
+  for (int64_t i = ibuckets[hashinode(handle, inum)]; i >= 0; i = cinodes[i].next) {
+    if (cinodes[i].inum == inum && cinodes[i].handle == handle) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void icacheunlink(int64_t idx) {
+  int64_t *link = &ibuckets[hashinode(cinodes[idx].handle, cinodes[idx].inum)];
+  while (*link != idx) {
+    link = &cinodes[*link].next;
+  }
+  *link = cinodes[idx].next;
+  cinodes[idx].next = -1;
+  cinodes[idx].valid = false;
+  raforget(&cinodes[idx].ra);
+  if (cinodes[idx].dirty) {
+    cinodes[idx].dirty = false;
+    nidirty--;
+  }
+}
+
+// run the clock hand until it finds an unreferenced inode,
+// writing it back if it is dirty
+static int64_t icachevictim(void) {
+  for (uint64_t scanned = 0; scanned <= 2 * ncinodes; scanned++) {
+    struct cinode *c = &cinodes[ihand];
+    int64_t idx = ihand;
+    ihand = (ihand + 1) % ncinodes;
+
+    if (!c->valid) {
+      return idx;
+    }
+    if (c->refcount > 0) {
+      continue;
+    }
+    if (c->referenced) {
+      c->referenced = false;
+      continue;
+    }
+    if (c->dirty) {
+      if (writeblock(c->handle, c->inum, &c->node) < 0) {
+        return -1;
+      }
+      istats.writebacks++;
+    }
+    icacheunlink(idx);
+    return idx;
+  }
+  FSLOG(FSLOG_ERROR, "every cached inode is in use\n");
+  return -1;
+}
+
+static struct cinode* icacheinsert(int handle, uint64_t inum) {
+  if (ncinodes == 0 && icacheresize(ICACHE_DEFAULT_INODES) < 0) {
+    return NULL;
+  }
+  int64_t idx = icachevictim();
+  if (idx < 0) {
+    return NULL;
+  }
+  struct cinode *c = &cinodes[idx];
+  uint64_t b = hashinode(handle, inum);
+  c->handle = handle;
+  c->inum = inum;
+  c->valid = true;
+  c->dirty = false;
+  c->referenced = true;
+  c->loading = false;
+  c->refcount = 1;
+  c->next = ibuckets[b];
+  ibuckets[b] = idx;
+  return c;
+}
+
+// the cached entry of an inode, once nobody is reading it; icachelock held
+static int64_t icachewait(int handle, uint64_t inum) {
+  int64_t idx;
+  while ((idx = ncinodes > 0 ? icachelookup(handle, inum) : -1) >= 0 && cinodes[idx].loading) {
+    pthread_cond_wait(&iloaded, &icachelock);
+  }
+  return idx;
+}
+
+struct inode* iget(int handle, uint64_t inum) {
+  // returns the inode with a reference held, or NULL
+  pthread_mutex_lock(&icachelock);
+  int64_t idx = icachewait(handle, inum);
+  if (idx >= 0) {
+    istats.hits++;
+    cinodes[idx].referenced = true;
+    cinodes[idx].refcount++;
+    pthread_mutex_unlock(&icachelock);
+    return &cinodes[idx].node;
+  }
+
+  // the reference taken keeps the entry from being recycled while the
+  // lock is dropped for the read
+  istats.misses++;
+  struct cinode *c = icacheinsert(handle, inum);
+  if (c == NULL) {
+    pthread_mutex_unlock(&icachelock);
+    return NULL;
+  }
+  c->loading = true;
+  pthread_mutex_unlock(&icachelock);
+  int result = readblock(handle, inum, &c->node);
+  pthread_mutex_lock(&icachelock);
+  c->loading = false;
+  if (result < 0) {
+    c->refcount = 0;
+    if (c->valid) {
+      icacheunlink(c - cinodes);
+    }
+    c = NULL;
+  }
+  pthread_cond_broadcast(&iloaded);
+  pthread_mutex_unlock(&icachelock);
+  return c != NULL ? &c->node : NULL;
+}
+
+static void markdirty(struct cinode *c) {
+  if (!c->dirty) {
+    c->dirty = true;
+    nidirty++;
+  }
+}
+
+struct inode* inew(int handle, uint64_t inum) {
+  // like iget() for an inode that was just allocated:
+  // it starts out zeroed and dirty instead of being read
+  pthread_mutex_lock(&icachelock);
+  int64_t idx = icachewait(handle, inum);
+  struct cinode *c;
+  if (idx >= 0) {
+    c = &cinodes[idx];
+    c->refcount++;
+    raforget(&c->ra);
+  } else {
+    c = icacheinsert(handle, inum);
+  }
+  if (c != NULL) {
+    memset(&c->node, 0, sizeof(c->node));
+    markdirty(c);
+  }
+  pthread_mutex_unlock(&icachelock);
+  return c != NULL ? &c->node : NULL;
+}
+
+void iput(struct inode *node) {
+  struct cinode *c = cinodeof(node);
+  pthread_mutex_lock(&icachelock);
+  assert(c->refcount > 0);
+  c->refcount--;
+  pthread_mutex_unlock(&icachelock);
+}
+
+void ilock(struct inode *node, bool exclusive) {
+  // shared for looking at the inode and what it maps,
+  // exclusive for changing either
+  struct cinode *c = cinodeof(node);
+  if (exclusive) {
+    pthread_rwlock_wrlock(&c->lock);
+  } else {
+    pthread_rwlock_rdlock(&c->lock);
+  }
+}
+
+void iunlock(struct inode *node) {
+  pthread_rwlock_unlock(&cinodeof(node)->lock);
+}
+
+struct readahead* ireadahead(struct inode *node) {
+  // the readahead state of the file, guarded by readAhead.c
+  return &cinodeof(node)->ra;
+}
+
+void imarkdirty(struct inode *node) {
+  pthread_mutex_lock(&icachelock);
+  markdirty(cinodeof(node));
+  pthread_mutex_unlock(&icachelock);
+}
+
+int iflush(int handle) {
+  // writes every dirty inode of handle to its block
+  pthread_mutex_lock(&icachelock);
+  int result = 0;
+  for (uint64_t i = 0; i < ncinodes; i++) {
+    struct cinode *c = &cinodes[i];
+    if (c->valid && c->dirty && c->handle == handle) {
+      // clean first: a change made while it is written marks it dirty again
+      c->dirty = false;
+      nidirty--;
+      if (writeblock(handle, c->inum, &c->node) < 0) {
+        result = -1;
+        continue;
+      }
+      istats.writebacks++;
+    }
+  }
+  pthread_mutex_unlock(&icachelock);
+  return result;
+}
+
+void idiscard(int handle, uint64_t inum) {
+  // forgets one inode without writing it, e.g. because it was deleted
+  pthread_mutex_lock(&icachelock);
+  int64_t idx = ncinodes > 0 ? icachelookup(handle, inum) : -1;
+  if (idx >= 0) {
+    cinodes[idx].refcount = 0;
+    icacheunlink(idx);
+  }
+  pthread_mutex_unlock(&icachelock);
+}
+
+void iinvalidate(int handle) {
+  // drops every inode belonging to handle, dirty or not;
+  // callers flush first if they want the changes kept
+  pthread_mutex_lock(&icachelock);
+  for (uint64_t i = 0; i < ncinodes; i++) {
+    if (cinodes[i].valid && cinodes[i].handle == handle) {
+      cinodes[i].refcount = 0;
+      icacheunlink(i);
+    }
+  }
+  pthread_mutex_unlock(&icachelock);
+}
+
+uint64_t idirtycount(int handle) {
+  // dirty inodes of handle; the scan stops once it has seen all of them
+  pthread_mutex_lock(&icachelock);
+  uint64_t n = 0;
+  uint64_t seen = 0;
+  for (uint64_t i = 0; i < ncinodes && seen < nidirty; i++) {
+    if (cinodes[i].valid && cinodes[i].dirty) {
+      seen++;
+      n += cinodes[i].handle == handle;
+    }
+  }
+  pthread_mutex_unlock(&icachelock);
+  return n;
+}
+
+void icachegetstats(struct icachestats *out) {
+  pthread_mutex_lock(&icachelock);
+  *out = istats;
+  pthread_mutex_unlock(&icachelock);
+}
+
+void icacheresetstats(void) {
+  pthread_mutex_lock(&icachelock);
+  uint64_t capacity = istats.capacity;
+  memset(&istats, 0, sizeof(istats));
+  istats.capacity = capacity;
+  pthread_mutex_unlock(&icachelock);
+}
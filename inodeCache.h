@@ -0,0 +1,31 @@
+#ifndef INODECACHE_H
+#define INODECACHE_H
+
+#include "fsHelpers.h"
+#include "readAhead.h"
+
+#define ICACHE_DEFAULT_INODES 256   /* decoded inodes kept in memory (1 MiB) */
+
+struct icachestats {
+    uint64_t hits;          /* iget() calls served from memory */
+    uint64_t misses;        /* iget() calls that read the inode block */
+    uint64_t writebacks;    /* dirty inodes written to their block */
+    uint64_t capacity;      /* number of inodes held */
+};
+
+struct inode* iget(int handle, uint64_t inum);
+struct inode* inew(int handle, uint64_t inum);
+void iput(struct inode *node);
+void ilock(struct inode *node, bool exclusive);
+void iunlock(struct inode *node);
+void imarkdirty(struct inode *node);
+struct readahead* ireadahead(struct inode *node);
+int iflush(int handle);
+void idiscard(int handle, uint64_t inum);
+void iinvalidate(int handle);
+uint64_t idirtycount(int handle);
+int icachesetsize(uint64_t ninodes);
+void icachegetstats(struct icachestats *stats);
+void icacheresetstats(void);
+
+#endif
@@ -0,0 +1,223 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// linux/fs.h, which io_uring.h pulls in, has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+#include "ioEngine.h"
+
+// Asynchronous block I/O on io_uring, driven with the raw system calls.
+//
+// aiosubmit() puts requests on the submission ring and hands them to the
+// kernel with one io_uring_enter(), and reports as taken only those the
+// kernel consumed; aioreap() collects finished ones from the completion
+// ring, waiting for at least min of them.  Every request
+// carries its own address as user_data, so completions come back as the
+// caller's request structures in whatever order the device finished
+// them.  When there is no ring for the handle, because aiosetup() was
+// never called or the kernel refused it, requests are carried out
+// synchronously inside aiosubmit() and aioreap() returns them at once.
+
+static struct {
+  int handle;
+  int fd;                   // the ring, -1 when there is none
+  unsigned entries;         // submission queue size
+  unsigned inflight;        // submitted and not yet reaped
+  unsigned *sqhead;
+  unsigned *sqtail;
+  unsigned *sqmask;
+  unsigned *sqarray;
+  struct io_uring_sqe *sqes;
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned *cqmask;
+  struct io_uring_cqe *cqes;
+  void *sqring;
+  void *cqring;
+  size_t sqringsize;
+  size_t cqringsize;
+  struct aiorequest *done;  // finished synchronously, waiting for aioreap()
+  struct aiorequest *donetail;
+} eng = { .handle = -1, .fd = -1 };
+
+bool aioactive(int handle) {
+  return eng.handle == handle && eng.fd >= 0;
+}
+
+int aiosetup(int handle, unsigned depth) {
+  // returns 0 with a ring, -1 if requests will run synchronously
+  aioclose(eng.handle);
+  eng.handle = handle;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, depth > 0 ? depth : AIO_DEFAULT_DEPTH, &p);
+  if (fd < 0) {
+    FSLOG(FSLOG_ERROR, "io_uring unavailable (errno %d), using synchronous I/O\n", errno);
+    return -1;
+  }
+
+  eng.sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  eng.cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (eng.cqringsize > eng.sqringsize) {
+      eng.sqringsize = eng.cqringsize;
+    }
+    eng.cqringsize = eng.sqringsize;
+  }
+  eng.sqring = mmap(NULL, eng.sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  eng.cqring = eng.sqring;
+  if (eng.sqring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    eng.cqring = mmap(NULL, eng.cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  eng.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (eng.sqring == MAP_FAILED || eng.cqring == MAP_FAILED || eng.sqes == MAP_FAILED) {
+    FSLOG(FSLOG_ERROR, "could not map io_uring rings, using synchronous I/O\n");
+    close(fd);
+    return -1;
+  }
+
+  uint8_t *sq = eng.sqring;
+  uint8_t *cq = eng.cqring;
+  eng.sqhead = (unsigned*) (sq + p.sq_off.head);
+  eng.sqtail = (unsigned*) (sq + p.sq_off.tail);
+  eng.sqmask = (unsigned*) (sq + p.sq_off.ring_mask);
+  eng.sqarray = (unsigned*) (sq + p.sq_off.array);
+  eng.cqhead = (unsigned*) (cq + p.cq_off.head);
+  eng.cqtail = (unsigned*) (cq + p.cq_off.tail);
+  eng.cqmask = (unsigned*) (cq + p.cq_off.ring_mask);
+  eng.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  eng.entries = p.sq_entries;
+  eng.inflight = 0;
+  eng.fd = fd;
+  return 0;
+}
+
+void aioclose(int handle) {
+  if (eng.handle != handle) {
+    return;
+  }
+  if (eng.fd >= 0) {
+    // nothing may still point into the caller's buffers
+    struct aiorequest *done[16];
+    while (eng.inflight > 0 && aioreap(handle, done, countof(done), 1) > 0) {
+    }
+    munmap(eng.sqes, eng.entries * sizeof(struct io_uring_sqe));
+    if (eng.cqring != eng.sqring) {
+      munmap(eng.cqring, eng.cqringsize);
+    }
+    munmap(eng.sqring, eng.sqringsize);
+    close(eng.fd);
+  }
+  eng.fd = -1;
+  eng.handle = -1;
+  eng.done = NULL;
+  eng.donetail = NULL;
+}
+
+static int ringenter(unsigned submit, unsigned wait) {
+  for (;;) {
+    int r = syscall(__NR_io_uring_enter, eng.fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r >= 0 || errno != EINTR) {
+      return r;
+    }
+  }
+}
+
+int aiosubmit(int handle, struct aiorequest *reqs, unsigned count) {
+  // returns how many of reqs were taken; the rest have to wait for room
+  if (!aioactive(handle)) {
+    for (unsigned i = 0; i < count; i++) {
+      struct aiorequest *r = &reqs[i];
+      r->result = r->op == AIO_WRITE ? pwritev(handle, r->iov, r->niov, r->blocknum * BLOCK_SIZE)
+                                     : preadv(handle, r->iov, r->niov, r->blocknum * BLOCK_SIZE);
+      if (r->result < 0) {
+        r->result = -errno;
+      }
+      r->next = NULL;
+      if (eng.donetail != NULL) {
+        eng.donetail->next = r;
+      } else {
+        eng.done = r;
+      }
+      eng.donetail = r;
+    }
+    return count;
+  }
+
+  // the completion ring is twice the submission ring; never let more
+  // requests be in flight than it can hold
+  unsigned head = __atomic_load_n(eng.sqhead, __ATOMIC_ACQUIRE);
+  unsigned tail = *eng.sqtail;
+  unsigned room = eng.entries - (tail - head);
+  if (room > 2 * eng.entries - eng.inflight) {
+    room = 2 * eng.entries - eng.inflight;
+  }
+  unsigned n = count < room ? count : room;
+  for (unsigned i = 0; i < n; i++) {
+    unsigned idx = (tail + i) & *eng.sqmask;
+    struct io_uring_sqe *sqe = &eng.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = reqs[i].op == AIO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = handle;
+    sqe->off = reqs[i].blocknum * BLOCK_SIZE;
+    sqe->addr = (uint64_t) (uintptr_t) reqs[i].iov;
+    sqe->len = reqs[i].niov;
+    sqe->user_data = (uint64_t) (uintptr_t) &reqs[i];
+    eng.sqarray[idx] = idx;
+  }
+  __atomic_store_n(eng.sqtail, tail + n, __ATOMIC_RELEASE);
+  int taken = n > 0 ? ringenter(n, 0) : 0;
+  if (taken < 0) {
+    FSLOG(FSLOG_ERROR, "io_uring_enter failed: %d\n", errno);
+    __atomic_store_n(eng.sqtail, tail, __ATOMIC_RELEASE);
+    return -1;
+  }
+  // the kernel may take fewer than it was given; the rest come off the
+  // ring again, so nothing sits there that is not counted in flight, and
+  // the caller submits them later
+  if ((unsigned) taken < n) {
+    __atomic_store_n(eng.sqtail, tail + taken, __ATOMIC_RELEASE);
+  }
+  eng.inflight += taken;
+  return taken;
+}
+
+int aioreap(int handle, struct aiorequest **done, unsigned max, unsigned min) {
+  // hands back up to max finished requests, waiting until at least min
+  // have finished or nothing is left in flight
+  unsigned n = 0;
+  if (!aioactive(handle)) {
+    while (n < max && eng.done != NULL) {
+      done[n++] = eng.done;
+      eng.done = eng.done->next;
+    }
+    if (eng.done == NULL) {
+      eng.donetail = NULL;
+    }
+    return n;
+  }
+
+  if (min > eng.inflight) {
+    min = eng.inflight;
+  }
+  for (;;) {
+    unsigned head = *eng.cqhead;
+    unsigned tail = __atomic_load_n(eng.cqtail, __ATOMIC_ACQUIRE);
+    while (n < max && head != tail) {
+      struct io_uring_cqe *cqe = &eng.cqes[head & *eng.cqmask];
+      struct aiorequest *r = (struct aiorequest*) (uintptr_t) cqe->user_data;
+      r->result = cqe->res;
+      done[n++] = r;
+      head++;
+      eng.inflight--;
+    }
+    __atomic_store_n(eng.cqhead, head, __ATOMIC_RELEASE);
+    if (n >= min || n == max) {
+      return n;
+    }
+    if (ringenter(0, min - n) < 0) {
+      FSLOG(FSLOG_ERROR, "io_uring_enter failed: %d\n", errno);
+      return n > 0 ? (int) n : -1;
+    }
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include "fsHelpers.h"
+
+#define AIO_DEFAULT_DEPTH 64      /* submission queue entries when none are asked for */
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+// One transfer between a run of contiguous blocks and a list of buffers.
+// The request must stay put until aioreap() hands it back.
+struct aiorequest {
+    int op;                   /* AIO_READ or AIO_WRITE */
+    int niov;
+    uint64_t blocknum;        /* first block of the run */
+    struct iovec *iov;        /* buffers, BLOCK_SIZE multiples in total */
+    uint64_t tag;             /* left alone, for the caller */
+    int64_t result;           /* bytes moved or -errno, once reaped */
+    struct aiorequest *next;  /* used by the synchronous fallback */
+};
+
+int aiosetup(int handle, unsigned depth);
+void aioclose(int handle);
+bool aioactive(int handle);
+int aiosubmit(int handle, struct aiorequest *reqs, unsigned count);
+int aioreap(int handle, struct aiorequest **done, unsigned max, unsigned min);
+
+#endif
@@ -0,0 +1,515 @@
+#include "journal.h"
+#include "bitmap.h"
+#include "blockCache.h"
+#include "inodeCache.h"
+
+// Write-ahead journal and group commit.
+//
+// Every block an operation dirties stays pinned in the block cache until
+// the running transaction commits.  A commit copies those blocks into one
+// half of the journal region, fsyncs once, and only then writes them to
+// their home locations.  Transactions alternate between the two halves,
+// so by the time a half is reused the fsync of the transaction in the
+// other half has already made the older home writes durable.  Replay at
+// open time re-applies the newest complete transaction.
+//
+// Operations may run in several threads at once.  txnbegin() and txnend()
+// count the ones running, and a commit asked for by syncdisk() waits for
+// them to finish while holding new ones back, so it never captures half
+// of an operation.  Nothing commits from inside an operation: a
+// transaction has to fit in one half of the journal, and in the cache
+// that pins its blocks, so each operation is admitted with room for
+// TXN_CREDITS blocks and one that may dirty more asks txnreserve() for
+// it before it changes anything.  When the room is not there the running
+// transaction is committed first, between operations.
+
+static struct {
+  int handle;
+  uint64_t start;           // first block of the journal region
+  uint64_t nblocks;         // length of the region, both halves
+  uint64_t overhead;        // blocks every commit adds to the operations'
+  uint64_t seq;             // sequence number of the next commit
+  uint8_t *images;          // copies of the blocks being committed
+  pthread_mutex_t lock;     // one commit at a time
+  // the rest is guarded by txnlock
+  int mode;
+  uint64_t maxblocks;       // group mode: commit once this many blocks are dirty
+  uint64_t maxdelayms;      // group mode: commit once the transaction is this old
+  bool txnopen;
+  struct timespec txnstart;
+  int running;              // operations between txnbegin() and txnend()
+  uint64_t reserved;        // blocks promised to the running operations
+  bool quiescing;           // a commit is waiting for them to finish
+  pthread_mutex_t txnlock;
+  pthread_cond_t txncond;
+} jnl = { .handle = -1, .mode = DURABILITY_SYNC,
+          .maxblocks = GROUP_COMMIT_BLOCKS, .maxdelayms = GROUP_COMMIT_MS,
+          .lock = PTHREAD_MUTEX_INITIALIZER, .txnlock = PTHREAD_MUTEX_INITIALIZER,
+          .txncond = PTHREAD_COND_INITIALIZER };
+
+// nesting of txnbegin()/txnend() in the calling thread, whether it is
+// the one holding operations back, and whether txnend() is committing
+static __thread int depth = 0;
+static __thread bool quiesced = false;
+static __thread bool committing = false;
+
+// blocks the calling thread's operation holds in reserved, and what it
+// asked txnreserve() for without getting it, so that txnbegin() can get
+// it when the operation starts over
+static __thread uint64_t credits = 0;
+static __thread uint64_t wanted = 0;
+
+static uint64_t journalcapacity(void) {
+  uint64_t half = jnl.nblocks / 2;
+  uint64_t cap = half > 0 ? half - 1 : 0;
+  return cap < countof(((struct journalheader*) 0)->blocks) ? cap : countof(((struct journalheader*) 0)->blocks);
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, uint64_t len) {
+  const uint8_t *p = data;
+  for (uint64_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static uint64_t journalchecksum(struct journalheader *hdr, uint8_t **images) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  h = fnv1a(h, &hdr->seq, sizeof(hdr->seq));
+  h = fnv1a(h, &hdr->count, sizeof(hdr->count));
+  h = fnv1a(h, hdr->blocks, hdr->count * sizeof(uint64_t));
+  for (uint64_t i = 0; i < hdr->count; i++) {
+    h = fnv1a(h, images[i], BLOCK_SIZE);
+  }
+  return h;
+}
+
+bool journalactive(int handle) {
+  return jnl.handle == handle && jnl.nblocks >= 4;
+}
+
+// blocks the operations of one transaction may dirty between them: what
+// one half of the journal holds, and what the cache can pin while
+// keeping TXN_CACHE_SLACK buffers for reads, less what the commit adds
+static uint64_t txnlimit(void) {
+  struct cachestats cs;
+  cachegetstats(&cs);
+  uint64_t cache = cs.capacity > 0 ? cs.capacity : CACHE_DEFAULT_BLOCKS;
+  cache = cache > TXN_CACHE_SLACK ? cache - TXN_CACHE_SLACK : 0;
+  uint64_t limit = journalcapacity() < cache ? journalcapacity() : cache;
+  return limit > jnl.overhead ? limit - jnl.overhead : 0;
+}
+
+// blocks the running transaction holds so far: the dirty buffers, and the
+// inodes and bitmap blocks the commit will write to the cache
+static uint64_t txnblocks(int handle) {
+  return cachedirtycount(handle) + idirtycount(handle) + bitmapdirtycount();
+}
+
+int journalformat(int handle, uint64_t start, uint64_t nblocks, uint64_t overhead) {
+  // called by diskformat(): forget anything a previous filesystem
+  // left in the region and start numbering transactions again;
+  // overhead is how many blocks every commit adds on its own
+  jnl.handle = handle;
+  jnl.start = start;
+  jnl.nblocks = nblocks;
+  jnl.overhead = overhead;
+  jnl.seq = 1;
+  return journalclear(handle, start, nblocks);
+}
+
+int journalclear(int handle, uint64_t start, uint64_t nblocks) {
+  // empties both halves; closedisk() calls it once every committed block
+  // is home and durable, so the next open has nothing to replay and can
+  // start numbering transactions at 1
+  uint8_t zero[BLOCK_SIZE];
+  memset(zero, 0, BLOCK_SIZE);
+  uint64_t headers[2] = { start, start + nblocks / 2 };
+  void *zeros[2] = { zero, zero };
+  if (rawwriteblockv(handle, headers, zeros, 2) < 0) {
+    FSLOG(FSLOG_ERROR, "error while clearing the journal\n");
+    return -1;
+  }
+  return 0;
+}
+
+// reads the transaction stored in one half; returns 1 if it is complete
+static int journalload(int handle, uint64_t half, struct journalheader *hdr, uint8_t **images) {
+  if (rawreadblock(handle, half, hdr) < 0) {
+    return 0;
+  }
+  if (hdr->magic != JOURNAL_MAGIC || hdr->count > journalcapacity()) {
+    return 0;
+  }
+  // the images sit right after the header and come back in one read
+  uint64_t blocknums[countof(hdr->blocks)];
+  bool loaded = true;
+  for (uint64_t i = 0; i < hdr->count; i++) {
+    images[i] = malloc(BLOCK_SIZE);
+    blocknums[i] = half + 1 + i;
+    loaded = loaded && images[i] != NULL;
+  }
+  if (!loaded || rawreadblockv(handle, blocknums, (void**) images, hdr->count) < 0) {
+    for (uint64_t i = 0; i < hdr->count; i++) {
+      free(images[i]);
+      images[i] = NULL;
+    }
+    return 0;
+  }
+  if (journalchecksum(hdr, images) != hdr->checksum) {
+    // torn write: the crash happened before this commit's fsync
+    for (uint64_t i = 0; i < hdr->count; i++) {
+      free(images[i]);
+      images[i] = NULL;
+    }
+    return 0;
+  }
+  return 1;
+}
+
+int journalreplay(int handle) {
+  // called by opendisk(): if the image carries a journal, re-apply the
+  // committed transactions so the home locations match the last commit
+  struct superblock sb;
+  if (rawreadblock(handle, 0, &sb) < 0 || sb.magic != MAGIC_NUM) {
+    return 0;
+  }
+
+  jnl.handle = handle;
+  jnl.start = sb.journalstart;
+  jnl.nblocks = sb.journalblocks;
+  jnl.overhead = sb.gdtblocks + 1;
+  jnl.seq = 1;
+  // a clean close left the journal empty
+  if (!journalactive(handle) || sb.state == SB_CLEAN) {
+    return 0;
+  }
+
+  struct journalheader hdr[2];
+  uint8_t *images[2][countof(hdr[0].blocks)];
+  int valid[2];
+  memset(images, 0, sizeof(images));
+  for (int h = 0; h < 2; h++) {
+    valid[h] = journalload(handle, jnl.start + h * (jnl.nblocks / 2), &hdr[h], images[h]);
+  }
+
+  // Only the newest complete transaction needs replaying: the fsync that
+  // made it durable also covered the home writes of the one before it.
+  // Replaying the older one too could put back an image of a block that
+  // has since been freed and reused for file data.
+  int newest = -1;
+  for (int h = 0; h < 2; h++) {
+    if (valid[h] && (newest < 0 || hdr[h].seq > hdr[newest].seq)) {
+      newest = h;
+    }
+    if (valid[h] && hdr[h].seq >= jnl.seq) {
+      jnl.seq = hdr[h].seq + 1;
+    }
+  }
+  int replayed = 0;
+  for (int h = 0; h < 2; h++) {
+    if (!valid[h]) {
+      continue;
+    }
+    if (h == newest) {
+      rawwriteblockv(handle, hdr[h].blocks, (void**) images[h], hdr[h].count);
+    }
+    for (uint64_t i = 0; i < hdr[h].count; i++) {
+      free(images[h][i]);
+    }
+    replayed += h == newest;
+  }
+  if (replayed > 0 && rawsync(handle) < 0) {
+    FSLOG(FSLOG_ERROR, "error while synching replayed journal\n");
+    return -1;
+  }
+  return replayed;
+}
+
+struct journalimage {
+  uint64_t blocknum;
+  uint8_t *data;
+  uint64_t gen;
+};
+
+static int imagecmp(const void *a, const void *b) {
+  uint64_t x = ((const struct journalimage*) a)->blocknum;
+  uint64_t y = ((const struct journalimage*) b)->blocknum;
+  return x < y ? -1 : x > y;
+}
+
+// writes one transaction of at most journalcapacity() blocks
+static int journalwrite(int handle, uint64_t count, struct journalheader *hdr, uint8_t **images, uint64_t *gens) {
+  uint64_t half = jnl.start + (jnl.seq % 2) * (jnl.nblocks / 2);
+
+  // in home order, so neighbouring blocks go home in one write
+  struct journalimage sorted[countof(hdr->blocks)];
+  for (uint64_t i = 0; i < count; i++) {
+    sorted[i] = (struct journalimage) { hdr->blocks[i], images[i], gens[i] };
+  }
+  qsort(sorted, count, sizeof(sorted[0]), imagecmp);
+  for (uint64_t i = 0; i < count; i++) {
+    hdr->blocks[i] = sorted[i].blocknum;
+    images[i] = sorted[i].data;
+    gens[i] = sorted[i].gen;
+  }
+
+  hdr->magic = JOURNAL_MAGIC;
+  hdr->seq = jnl.seq;
+  hdr->count = count;
+  hdr->checksum = journalchecksum(hdr, images);
+
+  // the images and then the header, each in one write
+  uint64_t blocknums[countof(hdr->blocks)];
+  for (uint64_t i = 0; i < count; i++) {
+    blocknums[i] = half + 1 + i;
+  }
+  if (rawwriteblockv(handle, blocknums, (void**) images, count) < 0) {
+    return -1;
+  }
+  if (rawwriteblock(handle, half, hdr) < 0) {
+    return -1;
+  }
+  if (rawsync(handle) < 0) {
+    FSLOG(FSLOG_ERROR, "error while synching journal\n");
+    return -1;
+  }
+  jnl.seq++;
+
+  // the transaction is durable; now it is safe to update the home blocks
+  return rawwriteblockv(handle, hdr->blocks, (void**) images, count);
+}
+
+int journalcommit(int handle) {
+  // returns the number of blocks committed, or -1 on error
+  if (!journalactive(handle)) {
+    return cacheflush(handle) < 0 ? -1 : 0;
+  }
+
+  pthread_mutex_lock(&jnl.lock);
+  struct journalheader hdr;
+  uint8_t *images[countof(hdr.blocks)];
+  uint64_t gens[countof(hdr.blocks)];
+  uint64_t cap = journalcapacity();
+  if (jnl.images == NULL && (jnl.images = malloc(countof(hdr.blocks) * BLOCK_SIZE)) == NULL) {
+    pthread_mutex_unlock(&jnl.lock);
+    return -1;
+  }
+  for (uint64_t i = 0; i < cap; i++) {
+    images[i] = jnl.images + i * BLOCK_SIZE;
+  }
+
+  // the transaction goes out whole or not at all: one that does not fit
+  // in a half stays in the cache, and none of it is written home
+  uint64_t n = cachecollectdirty(handle, hdr.blocks, images, gens, cap);
+  if (n > cap) {
+    FSLOG(FSLOG_ERROR, "transaction of %ld blocks does not fit in the journal\n", n);
+    pthread_mutex_unlock(&jnl.lock);
+    return -1;
+  }
+  if (n > 0 && journalwrite(handle, n, &hdr, images, gens) < 0) {
+    pthread_mutex_unlock(&jnl.lock);
+    return -1;
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    cachemarkclean(handle, hdr.blocks[i], gens[i]);
+  }
+  pthread_mutex_lock(&jnl.txnlock);
+  jnl.txnopen = false;
+  pthread_mutex_unlock(&jnl.txnlock);
+  pthread_mutex_unlock(&jnl.lock);
+  return n;
+}
+
+void journalclose(int handle) {
+  if (jnl.handle != handle) {
+    return;
+  }
+  journalcommit(handle);
+  pthread_mutex_lock(&jnl.lock);
+  jnl.handle = -1;
+  free(jnl.images);
+  jnl.images = NULL;
+  jnl.txnopen = false;
+  jnl.reserved = 0;
+  depth = 0;
+  credits = 0;
+  pthread_mutex_unlock(&jnl.lock);
+}
+
+int setdurability(int handle, int mode, uint64_t maxblocks, uint64_t maxdelayms) {
+  if (mode != DURABILITY_SYNC && mode != DURABILITY_GROUP) {
+    FSLOG(FSLOG_ERROR, "Invalid durability mode %d\n", mode);
+    return -1;
+  }
+  // switching modes commits whatever the old mode was holding back
+  if (syncdisk(handle) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&jnl.txnlock);
+  jnl.mode = mode;
+  jnl.maxblocks = maxblocks > 0 ? maxblocks : GROUP_COMMIT_BLOCKS;
+  jnl.maxdelayms = maxdelayms > 0 ? maxdelayms : GROUP_COMMIT_MS;
+  pthread_mutex_unlock(&jnl.txnlock);
+  return 0;
+}
+
+void txnbegin(int handle) {
+  if (depth > 0) {
+    depth++;
+    return;
+  }
+  uint64_t limit = journalactive(handle) ? txnlimit() : UINT64_MAX;
+  uint64_t want = wanted > TXN_CREDITS ? wanted : TXN_CREDITS;
+  want = want < limit ? want : limit;
+  wanted = 0;
+  pthread_mutex_lock(&jnl.txnlock);
+  for (;;) {
+    // a commit waiting for the running operations goes first
+    while (jnl.quiescing) {
+      pthread_cond_wait(&jnl.txncond, &jnl.txnlock);
+    }
+    if (limit == UINT64_MAX || txnblocks(handle) + jnl.reserved + want <= limit) {
+      break;
+    }
+    // no room left: commit what is there, once the running operations
+    // are done, and look again.  A failed commit would fail again, so the
+    // operation goes ahead and finds out when it writes
+    pthread_mutex_unlock(&jnl.txnlock);
+    committing = true;
+    int synched = syncdisk(handle);
+    committing = false;
+    pthread_mutex_lock(&jnl.txnlock);
+    if (synched < 0) {
+      break;
+    }
+  }
+  depth = 1;
+  credits = want;
+  jnl.reserved += want;
+  jnl.running++;
+  if (!jnl.txnopen) {
+    jnl.txnopen = true;
+    clock_gettime(CLOCK_MONOTONIC, &jnl.txnstart);
+  }
+  pthread_mutex_unlock(&jnl.txnlock);
+}
+
+int txnreserve(int handle, uint64_t nblocks) {
+  // called by an operation that may dirty up to nblocks blocks in all,
+  // before it changes anything.  Returns 0 if the running transaction has
+  // room for them; TXN_FULL if it has not for now, in which case the
+  // operation backs out, ends and starts over, and txnbegin() commits
+  // first; TXN_TOOBIG if no transaction could hold them, or if the
+  // operation runs inside another one and so cannot start over.
+  if (depth == 0 || nblocks <= credits || !journalactive(handle)) {
+    return 0;
+  }
+  if (nblocks > txnmaxblocks(handle) || depth > 1) {
+    FSLOG(FSLOG_INFO, "Operation needs room for %ld blocks, more than a transaction has\n", nblocks);
+    return TXN_TOOBIG;
+  }
+  pthread_mutex_lock(&jnl.txnlock);
+  if (txnblocks(handle) + jnl.reserved - credits + nblocks > txnlimit()) {
+    pthread_mutex_unlock(&jnl.txnlock);
+    wanted = nblocks;
+    return TXN_FULL;
+  }
+  jnl.reserved += nblocks - credits;
+  credits = nblocks;
+  pthread_mutex_unlock(&jnl.txnlock);
+  return 0;
+}
+
+uint64_t txnmaxblocks(int handle) {
+  // the most one operation can reserve: what a transaction holds once
+  // the commit in front of it has left at most TXN_CREDITS blocks behind
+  if (!journalactive(handle)) {
+    return UINT64_MAX;
+  }
+  uint64_t limit = txnlimit();
+  return limit > TXN_CREDITS ? limit - TXN_CREDITS : 0;
+}
+
+bool txnroom(int handle, uint64_t nblocks) {
+  // whether the running transaction can take nblocks more, for work done
+  // between operations by syncdisk() while it holds them back
+  if (!journalactive(handle)) {
+    return true;
+  }
+  pthread_mutex_lock(&jnl.txnlock);
+  bool room = txnblocks(handle) + jnl.reserved + nblocks <= txnlimit();
+  pthread_mutex_unlock(&jnl.txnlock);
+  return room;
+}
+
+int txnend(int handle) {
+  // only the outermost operation decides whether to commit
+  if (--depth > 0) {
+    return 0;
+  }
+  depth = 0;
+
+  uint64_t dirty = cachedirtycount(handle) + idirtycount(handle);
+  pthread_mutex_lock(&jnl.txnlock);
+  jnl.reserved -= credits < jnl.reserved ? credits : jnl.reserved;
+  credits = 0;
+  if (jnl.running > 0 && --jnl.running == 0) {
+    pthread_cond_broadcast(&jnl.txncond);
+  }
+  bool commit = jnl.mode == DURABILITY_SYNC;
+  if (!commit) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t agems = (now.tv_sec - jnl.txnstart.tv_sec) * 1000 +
+                     (now.tv_nsec - jnl.txnstart.tv_nsec) / 1000000;
+    commit = dirty >= jnl.maxblocks || agems >= jnl.maxdelayms;
+  }
+  pthread_mutex_unlock(&jnl.txnlock);
+  if (!commit) {
+    return 0;
+  }
+  committing = true;
+  int synched = syncdisk(handle);
+  committing = false;
+  return synched;
+}
+
+bool txncommitting(void) {
+  // whether the syncdisk() running in this thread is a commit txnend()
+  // made on its own, rather than one the program asked for
+  return committing;
+}
+
+void txnquiesce(int handle) {
+  // called by syncdisk(): waits until no other thread is inside an
+  // operation and keeps new ones from starting until txnresume().
+  // Inside an operation it does nothing, since that would wait on itself.
+  (void) handle;
+  if (depth > 0) {
+    return;
+  }
+  pthread_mutex_lock(&jnl.txnlock);
+  while (jnl.quiescing) {
+    pthread_cond_wait(&jnl.txncond, &jnl.txnlock);
+  }
+  jnl.quiescing = true;
+  quiesced = true;
+  while (jnl.running > 0) {
+    pthread_cond_wait(&jnl.txncond, &jnl.txnlock);
+  }
+  pthread_mutex_unlock(&jnl.txnlock);
+}
+
+void txnresume(int handle) {
+  (void) handle;
+  if (!quiesced) {
+    return;
+  }
+  quiesced = false;
+  pthread_mutex_lock(&jnl.txnlock);
+  jnl.quiescing = false;
+  pthread_cond_broadcast(&jnl.txncond);
+  pthread_mutex_unlock(&jnl.txnlock);
+}
@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "fsHelpers.h"
+
+#define JOURNAL_BLOCKS 64             /* smallest journal diskformat() reserves */
+#define JOURNAL_MAX_BLOCKS 1018       /* two halves of one header plus 508 images */
+#define JOURNAL_MAGIC 0x4A524E4C424C4B31ULL
+
+#define DURABILITY_SYNC 0             /* commit and fsync at the end of every operation */
+#define DURABILITY_GROUP 1            /* batch operations until a threshold or syncdisk() */
+
+#define GROUP_COMMIT_BLOCKS 24        /* default dirty-block threshold in group mode */
+#define GROUP_COMMIT_MS 50            /* default age threshold in group mode */
+
+#define TXN_CREDITS 8                 /* blocks an operation may dirty without txnreserve() */
+#define TXN_CACHE_SLACK 32            /* cache buffers a transaction leaves for reads */
+#define TXN_FULL (-2)                 /* txnreserve(): no room until the running transaction commits */
+#define TXN_TOOBIG (-3)               /* txnreserve(): more than any transaction can hold */
+
+// The journal region is split in two halves and transactions alternate
+// between them.  Each half starts with this header, followed by the
+// images of the blocks it lists.
+struct journalheader {
+    uint64_t magic;
+    uint64_t seq;           /* transaction sequence number */
+    uint64_t count;         /* number of block images that follow */
+    uint64_t checksum;      /* covers seq, count, blocks[] and every image */
+    uint64_t blocks[508];   /* home block number of each image */
+};
+
+int journalformat(int handle, uint64_t start, uint64_t nblocks, uint64_t overhead);
+int journalclear(int handle, uint64_t start, uint64_t nblocks);
+int journalreplay(int handle);
+int journalcommit(int handle);
+bool journalactive(int handle);
+void journalclose(int handle);
+int setdurability(int handle, int mode, uint64_t maxblocks, uint64_t maxdelayms);
+void txnbegin(int handle);
+int txnreserve(int handle, uint64_t nblocks);
+uint64_t txnmaxblocks(int handle);
+bool txnroom(int handle, uint64_t nblocks);
+int txnend(int handle);
+bool txncommitting(void);
+void txnquiesce(int handle);
+void txnresume(int handle);
+
+#endif
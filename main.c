@@ -1,4 +1,5 @@
 #include "fsHelpers.h"
+#include "fsStats.h"
 
 void test1(int handle, void* superblock) {
   printf("\n~~~~~~~~~~ TESTING DIRECTORY CREATION ~~~~~~~~~~\n\n");
@@ -89,6 +90,8 @@ void test1(int handle, void* superblock) {
   diskdump(handle);
   printf("\n");
 
+  fsdumpstats();
+
   printf("Closing disk...\n");
   closedisk(handle);
 }
@@ -97,16 +100,18 @@ int main() {
   // open disk
   printf("Opening disk...\n");
   char* filePath = "./testDisk.disk";
-  int handle = opendisk(filePath, BLOCK_SIZE * 64);
+  int handle = opendisk(filePath, BLOCK_SIZE * 1024);
   if (handle < 0) {
     printf("Error opening disk: %d\n\n", handle);
   }
 
   // check if the superblock exists on the disk
   // if not, format the disk and add it
+  if (mountdisk(handle) < 0) {
+    diskformat(handle, BLOCK_SIZE * 1024, INODES);
+  }
   uint64_t superblock[BLOCK_SIZE];
   readblock(handle, 0, superblock);
-  diskformat(handle);
   diskdump(handle);
 
   // check if the bit at idx 0 of the free block list is set
@@ -0,0 +1,95 @@
+#include "readAhead.h"
+
+// Sequential readahead.  Every read of file data reports the bytes it
+// covers; a read that starts at the byte where the previous one ended,
+// or at the start of the file, starts or continues a stream, and
+// anything else ends it.  Bytes rather than blocks, so reads of a size
+// that is not a multiple of BLOCK_SIZE, which share a block with the
+// read before them, still count as a stream.
+// Whenever no more than half a window is left prefetched ahead of the
+// reader, the window doubles, from RA_MIN_BLOCKS up to RA_MAX_BLOCKS,
+// and the stretch up to a window past the read is handed back to be
+// prefetched, so the kernel reads it while the caller is busy with what
+// it has.
+// A stream that breaks off counts what it prefetched but never read as
+// wasted.  One mutex covers the state of every file; it is held for a
+// few comparisons only, never across the prefetch itself.
+
+static struct rastats stats;
+static pthread_mutex_t ralock = PTHREAD_MUTEX_INITIALIZER;
+
+// ends the stream, with ralock held
+static void rastop(struct readahead *ra) {
+  if (ra->end > blocksfor(ra->next)) {
+    stats.wasted += ra->end - blocksfor(ra->next);
+  }
+  ra->end = 0;
+  ra->window = 0;
+}
+
+bool raaccess(struct readahead *ra, uint64_t offset, uint64_t size, uint64_t fileblocks, uint64_t *from, uint64_t *to) {
+  // the caller is about to read size bytes at offset of a file of
+  // fileblocks blocks; returns true with the logical blocks [from, to)
+  // if they should be prefetched
+  uint64_t end = blocksfor(offset + size);
+  pthread_mutex_lock(&ralock);
+  bool sequential = offset == ra->next || offset == 0;
+  if (offset == 0 && ra->next != 0) {
+    // read again from the top: a new stream
+    rastop(ra);
+  }
+  if (!sequential) {
+    rastop(ra);
+    ra->next = offset + size;
+    pthread_mutex_unlock(&ralock);
+    return false;
+  }
+
+  // a block the previous read ended inside was counted then
+  uint64_t fresh = blocksfor(offset);
+  if (fresh < ra->end && fresh < end) {
+    stats.hits += (end < ra->end ? end : ra->end) - fresh;
+  }
+  ra->next = offset + size;
+
+  // once half the window has been read, it grows and is topped up
+  uint64_t ahead = ra->end > end ? ra->end - end : 0;
+  if (ahead > ra->window / 2) {
+    pthread_mutex_unlock(&ralock);
+    return false;
+  }
+  ra->window = ra->window == 0 ? RA_MIN_BLOCKS : ra->window * 2;
+  if (ra->window > RA_MAX_BLOCKS) {
+    ra->window = RA_MAX_BLOCKS;
+  }
+  *from = ra->end > end ? ra->end : end;
+  *to = end + ra->window < fileblocks ? end + ra->window : fileblocks;
+  bool prefetch = *to > *from;
+  if (prefetch) {
+    ra->end = *to;
+    stats.windows++;
+    stats.prefetched += *to - *from;
+  }
+  pthread_mutex_unlock(&ralock);
+  return prefetch;
+}
+
+void raforget(struct readahead *ra) {
+  // the file is leaving the inode cache
+  pthread_mutex_lock(&ralock);
+  rastop(ra);
+  ra->next = 0;
+  pthread_mutex_unlock(&ralock);
+}
+
+void ragetstats(struct rastats *out) {
+  pthread_mutex_lock(&ralock);
+  *out = stats;
+  pthread_mutex_unlock(&ralock);
+}
+
+void raresetstats(void) {
+  pthread_mutex_lock(&ralock);
+  memset(&stats, 0, sizeof(stats));
+  pthread_mutex_unlock(&ralock);
+}
@@ -0,0 +1,28 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "fsHelpers.h"
+
+#define RA_MIN_BLOCKS 4             /* first window of a sequential stream */
+#define RA_MAX_BLOCKS 256           /* the window stops doubling here (1 MiB) */
+
+// Where a file is being read from, kept with its cached inode.
+struct readahead {
+    uint64_t next;          /* byte offset a sequential read starts at */
+    uint64_t end;           /* one past the last block prefetched */
+    uint64_t window;        /* blocks kept prefetched ahead, 0 when not streaming */
+};
+
+struct rastats {
+    uint64_t windows;       /* prefetches issued */
+    uint64_t prefetched;    /* blocks they covered */
+    uint64_t hits;          /* blocks read that had been prefetched */
+    uint64_t wasted;        /* prefetched blocks given up on unread */
+};
+
+bool raaccess(struct readahead *ra, uint64_t offset, uint64_t size, uint64_t fileblocks, uint64_t *from, uint64_t *to);
+void raforget(struct readahead *ra);
+void ragetstats(struct rastats *stats);
+void raresetstats(void);
+
+#endif
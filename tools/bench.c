@@ -0,0 +1,387 @@
+#include "../fsHelpers.h"
+#include "../bitmap.h"
+#include "../ioEngine.h"
+#include "../journal.h"
+#include "../readAhead.h"
+
+// Throughput benchmark for readfile() and writetofile().
+//
+// Build from the top of the repository:
+//   gcc -O2 -pthread -o bench tools/bench.c bitmap.c blockCache.c dentryCache.c fsHelpers.c fsStats.c fsTrace.c inodeCache.c ioEngine.c journal.c readAhead.c
+// Run:
+//   ./bench [image] [MiB per file] [rounds] [sync|uring|mmap]
+//   ./bench [image] [MiB per file] [rounds] stress [threads]
+//
+// A fresh image is formatted, one file is written in a single call and
+// then read back rounds times.  The image normally sits in the page
+// cache, so the numbers measure the copying done by the filesystem
+// rather than the disk.  The per-byte line under each does the same with
+// the loop readfile() and writetofile() used to have, and gives how many
+// times faster the whole-block copies are.  With uring, multi-block transfers go through
+// the io_uring engine instead of one system call at a time.  With mmap,
+// the image is opened with opendiskmapped() and blocks are copied to and
+// from the mapping.  The stream line reads the aligned file again in
+// STREAM_CHUNK pieces, front to back, after dropping the image from the
+// page cache, so it shows what readahead saves when the data has to come
+// from the disk; the ustream line does the same in pieces of
+// STREAM_CHUNK + STREAM_SKEW bytes, which mostly start inside a block.  The last line lists a directory of BENCH_DIRENTS
+// entries rounds times, which is mostly directory block reads.
+//
+// stress runs threads that each create, write, check, rewrite and delete
+// small files in one shared directory, rounds operations apiece.  Every
+// surviving file must still hold its own pattern afterwards, which a
+// block handed to two files would break, and deleting them all must give
+// back every block the run took.  Then each thread reads a file of its
+// own of the given size, with 1, 2, 4... threads at once, to show how
+// concurrent reads of different files scale.
+
+#define BENCH_DIRENTS 20000
+#define STREAM_CHUNK (64 << 10)      /* bytes per readfileat() in the stream test */
+#define STREAM_SKEW 100              /* bytes the ustream test adds to each piece */
+#define STRESS_FILES 16             /* files a stress thread keeps at most */
+#define STRESS_MAX_SIZE (256 << 10) /* largest of those files */
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct stressfile {
+  int inode;
+  uint64_t size;
+  uint32_t seed;
+  char name[DIRENT_NAME_LEN];
+};
+
+struct stressthread {
+  pthread_t thread;
+  int handle;
+  int dir;
+  int id;
+  int rounds;
+  struct stressfile files[STRESS_FILES];
+  int nfiles;
+  uint64_t errors;
+  int bigfile;              // read scaling: the thread's own file
+  uint64_t bigsize;
+  uint8_t *bigbuffer;
+};
+
+static void fillpattern(uint8_t *buf, uint64_t size, uint32_t seed) {
+  uint32_t x = seed | 1;
+  for (uint64_t i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = x;
+  }
+}
+
+// The copy loop readfile() and writetofile() had before whole blocks
+// went straight to and from the caller's buffer: a block at a time
+// through a bounce block, a byte at a time, with i % BLOCK_SIZE checked
+// on every byte.  Kept as the baseline for the numbers above it.
+static int64_t bytewrite(int handle, int file, const uint8_t *buffer, uint64_t size) {
+  uint8_t block[BLOCK_SIZE];
+  for (uint64_t i = 0; i < size; i++) {
+    block[i % BLOCK_SIZE] = buffer[i];
+    if (i % BLOCK_SIZE == BLOCK_SIZE - 1 || i == size - 1) {
+      uint64_t from = i - i % BLOCK_SIZE;
+      if (writefileat(handle, file, block, from, i + 1 - from) < 0) {
+        return -1;
+      }
+    }
+  }
+  return size;
+}
+
+static int64_t byteread(int handle, int file, uint8_t *buffer, uint64_t size) {
+  uint8_t block[BLOCK_SIZE];
+  for (uint64_t i = 0; i < size; i++) {
+    if (i % BLOCK_SIZE == 0 &&
+        readfileat(handle, file, block, i, size - i < BLOCK_SIZE ? size - i : BLOCK_SIZE) < 0) {
+      return -1;
+    }
+    buffer[i] = block[i % BLOCK_SIZE];
+  }
+  return size;
+}
+
+// the file still holds its pattern and its name still leads to it
+static bool checkfile(int handle, int dir, struct stressfile *f, uint8_t *expect, uint8_t *back) {
+  fillpattern(expect, f->size, f->seed);
+  return readfile(handle, f->inode, back, f->size) == (int) f->size &&
+         memcmp(expect, back, f->size) == 0 &&
+         hierdirsearch(handle, f->name, dir) == f->inode;
+}
+
+static void* stressworker(void *arg) {
+  struct stressthread *t = arg;
+  uint8_t *data = malloc(STRESS_MAX_SIZE);
+  uint8_t *back = malloc(STRESS_MAX_SIZE);
+  uint32_t rng = t->id * 7919 + 17;
+  for (int r = 0; r < t->rounds; r++) {
+    rng = rng * 1103515245 + 12345;
+    uint32_t pick = rng >> 8;
+    if (t->nfiles == STRESS_FILES || (t->nfiles > 0 && pick % 3 == 0)) {
+      struct stressfile *f = &t->files[pick % t->nfiles];
+      t->errors += !checkfile(t->handle, t->dir, f, data, back);
+      t->errors += removedirentry(t->handle, t->dir, f->name) < 0;
+      deletefile(t->handle, f->inode);
+      *f = t->files[--t->nfiles];
+    } else if (t->nfiles > 0 && pick % 3 == 1) {
+      struct stressfile *f = &t->files[pick % t->nfiles];
+      f->seed = rng;
+      fillpattern(data, f->size, f->seed);
+      t->errors += writefileat(t->handle, f->inode, data, 0, f->size) != (int) f->size;
+      t->errors += !checkfile(t->handle, t->dir, f, data, back);
+    } else {
+      struct stressfile *f = &t->files[t->nfiles];
+      f->size = 1 + pick % STRESS_MAX_SIZE;
+      f->seed = rng;
+      snprintf(f->name, sizeof(f->name), "t%d.%d", t->id, r);
+      f->inode = createfilein(t->handle, 0, 0, t->dir);
+      if (f->inode < 0) {
+        t->errors++;
+        continue;
+      }
+      fillpattern(data, f->size, f->seed);
+      t->errors += writefileat(t->handle, f->inode, data, 0, f->size) != (int) f->size;
+      t->errors += adddirentry(t->handle, t->dir, f->inode, f->name) < 0;
+      t->errors += !checkfile(t->handle, t->dir, f, data, back);
+      t->nfiles++;
+    }
+  }
+  free(data);
+  free(back);
+  return NULL;
+}
+
+static void* readworker(void *arg) {
+  struct stressthread *t = arg;
+  for (int r = 0; r < t->rounds; r++) {
+    t->errors += readfile(t->handle, t->bigfile, t->bigbuffer, t->bigsize) != (int) t->bigsize;
+  }
+  return NULL;
+}
+
+static int stress(FILE *out, char *path, uint64_t mib, int rounds, int nthreads) {
+  uint64_t disksize = ((mib + 1) * nthreads + 64) << 20;
+  disksize += (uint64_t) nthreads * STRESS_FILES * STRESS_MAX_SIZE;
+  unlink(path);
+  int handle = opendisk(path, disksize);
+  if (handle < 0 || diskformat(handle, disksize, 0) < 0) {
+    fprintf(out, "could not set up %s\n", path);
+    return 1;
+  }
+  // small transactions, so commits keep happening while threads run
+  setdurability(handle, DURABILITY_GROUP, 0, 0);
+  uint64_t nblocks = disksize / BLOCK_SIZE;
+  uint64_t freebefore = bitmapcountfree(0, nblocks);
+
+  struct stressthread *threads = calloc(nthreads, sizeof(struct stressthread));
+  int dir = createdirectory(handle);
+  for (int i = 0; i < nthreads; i++) {
+    threads[i] = (struct stressthread) { .handle = handle, .dir = dir, .id = i, .rounds = rounds };
+  }
+  double t = now();
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i].thread, NULL, stressworker, &threads[i]);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+  double st = now() - t;
+
+  // check the survivors once more with nothing else running, then give
+  // everything back
+  uint8_t *data = malloc(STRESS_MAX_SIZE);
+  uint8_t *back = malloc(STRESS_MAX_SIZE);
+  uint64_t errors = 0;
+  uint64_t live = 0;
+  for (int i = 0; i < nthreads; i++) {
+    errors += threads[i].errors;
+    for (int k = 0; k < threads[i].nfiles; k++) {
+      struct stressfile *f = &threads[i].files[k];
+      errors += !checkfile(handle, dir, f, data, back);
+      errors += removedirentry(handle, dir, f->name) < 0;
+      deletefile(handle, f->inode);
+      live++;
+    }
+  }
+  deletedirectory(handle, dir);
+  syncdisk(handle);
+  uint64_t freeafter = bitmapcountfree(0, nblocks);
+  fprintf(out, "stress    %d threads  %8.0f ops/s  %ld files left  %ld errors  %ld blocks lost\n",
+          nthreads, nthreads * (double) rounds / st, live, errors, (int64_t) (freebefore - freeafter));
+  free(data);
+  free(back);
+
+  // concurrent reads of different files
+  uint64_t size = mib << 20;
+  for (int i = 0; i < nthreads; i++) {
+    struct stressthread *r = &threads[i];
+    r->errors = 0;
+    r->bigsize = size;
+    r->bigbuffer = malloc(size);
+    fillpattern(r->bigbuffer, size, i + 1);
+    r->bigfile = createfile(handle, 0, 0);
+    if (r->bigfile < 0 || writetofile(handle, r->bigfile, r->bigbuffer, size) != (int) size) {
+      fprintf(out, "could not write the read test files\n");
+      return 1;
+    }
+  }
+  syncdisk(handle);
+  for (int n = 1; n <= nthreads; n *= 2) {
+    t = now();
+    for (int i = 0; i < n; i++) {
+      pthread_create(&threads[i].thread, NULL, readworker, &threads[i]);
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i].thread, NULL);
+      errors += threads[i].errors;
+    }
+    double rt = now() - t;
+    fprintf(out, "read x%-3d %8ld bytes  read %6.2f GB/s\n", n, size, n * size * (double) rounds / rt / 1e9);
+    if (n < nthreads && n * 2 > nthreads) {
+      n = nthreads / 2;
+    }
+  }
+  for (int i = 0; i < nthreads; i++) {
+    deletefile(handle, threads[i].bigfile);
+    free(threads[i].bigbuffer);
+  }
+  free(threads);
+  closedisk(handle);
+  unlink(path);
+  return errors == 0 && freebefore == freeafter ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  char *path = argc > 1 ? argv[1] : "/tmp/bench.disk";
+  uint64_t mib = argc > 2 ? strtoull(argv[2], NULL, 10) : 256;
+  int rounds = argc > 3 ? atoi(argv[3]) : 8;
+  bool uring = argc > 4 && strcmp(argv[4], "uring") == 0;
+  bool mapped = argc > 4 && strcmp(argv[4], "mmap") == 0;
+
+  // the filesystem reports progress on stdout; keep the results apart
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+
+  if (argc > 4 && strcmp(argv[4], "stress") == 0) {
+    return stress(out, path, mib, rounds, argc > 5 ? atoi(argv[5]) : 4);
+  }
+
+  uint64_t disksize = (mib * 2 + 64) << 20;
+  unlink(path);
+  int handle = mapped ? opendiskmapped(path, disksize) : opendisk(path, disksize);
+  if (handle < 0 || diskformat(handle, disksize, 0) < 0) {
+    fprintf(out, "could not set up %s\n", path);
+    return 1;
+  }
+  if (uring && aiosetup(handle, 0) < 0) {
+    fprintf(out, "io_uring unavailable, measuring synchronous I/O\n");
+  }
+
+  // one aligned file and one whose last block is partly used
+  uint64_t sizes[2] = { mib << 20, (mib << 20) + 100 };
+  uint8_t *data = malloc(sizes[1]);
+  uint8_t *back = malloc(sizes[1]);
+  for (uint64_t i = 0; i < sizes[1]; i++) {
+    data[i] = i * 131 + 7;
+  }
+
+  for (int s = 0; s < 2; s++) {
+    int file = createfile(handle, 0, 0);
+    double t = now();
+    if (writetofile(handle, file, data, sizes[s]) != (int64_t) sizes[s]) {
+      fprintf(out, "write failed\n");
+      return 1;
+    }
+    syncdisk(handle);
+    double wt = now() - t;
+
+    t = now();
+    for (int r = 0; r < rounds; r++) {
+      readfile(handle, file, back, sizes[s]);
+    }
+    double rt = now() - t;
+    if (memcmp(data, back, sizes[s]) != 0) {
+      fprintf(out, "read back different data\n");
+      return 1;
+    }
+
+    fprintf(out, "%-9s %8ld bytes  write %6.2f GB/s  read %6.2f GB/s\n",
+            s == 0 ? "aligned" : "unaligned", sizes[s],
+            sizes[s] / wt / 1e9, sizes[s] * (double) rounds / rt / 1e9);
+
+    for (int u = 0; s == 0 && !mapped && u < 2; u++) {
+      uint64_t chunk = u == 0 ? STREAM_CHUNK : STREAM_CHUNK + STREAM_SKEW;
+      raresetstats();
+      double st = 0;
+      for (int r = 0; r < rounds; r++) {
+        posix_fadvise(handle, 0, 0, POSIX_FADV_DONTNEED);
+        t = now();
+        for (uint64_t off = 0; off < sizes[s]; off += chunk) {
+          readfileat(handle, file, back + off, off, off + chunk < sizes[s] ? chunk : sizes[s] - off);
+        }
+        st += now() - t;
+      }
+      struct rastats ra;
+      ragetstats(&ra);
+      fprintf(out, "%-9s %8ld bytes  read %6.2f GB/s  readahead %ld windows, %.1f%% of reads hit, %ld blocks wasted\n",
+              u == 0 ? "stream" : "ustream", sizes[s], sizes[s] * (double) rounds / st / 1e9, ra.windows,
+              100.0 * ra.hits / (rounds * (sizes[s] / BLOCK_SIZE)), ra.wasted);
+    }
+    deletefile(handle, file);
+    syncdisk(handle);
+
+    // the same file through the per-byte loop
+    file = createfile(handle, 0, 0);
+    t = now();
+    if (bytewrite(handle, file, data, sizes[s]) != (int64_t) sizes[s]) {
+      fprintf(out, "per-byte write failed\n");
+      return 1;
+    }
+    syncdisk(handle);
+    double bwt = now() - t;
+    memset(back, 0, sizes[s]);
+    t = now();
+    for (int r = 0; r < rounds; r++) {
+      byteread(handle, file, back, sizes[s]);
+    }
+    double brt = now() - t;
+    if (memcmp(data, back, sizes[s]) != 0) {
+      fprintf(out, "per-byte read back different data\n");
+      return 1;
+    }
+    fprintf(out, "per-byte  %8ld bytes  write %6.2f GB/s  read %6.2f GB/s  whole blocks %.1fx, %.1fx faster\n",
+            sizes[s], sizes[s] / bwt / 1e9, sizes[s] * (double) rounds / brt / 1e9, bwt / wt, brt / rt);
+    deletefile(handle, file);
+    syncdisk(handle);
+  }
+
+  // directory listing; the entries are added as one group commit
+  setdurability(handle, DURABILITY_GROUP, 4096, 60000);
+  int dir = createdirectory(handle);
+  char name[DIRENT_NAME_LEN];
+  for (int i = 0; i < BENCH_DIRENTS; i++) {
+    snprintf(name, sizeof(name), "f%d", i);
+    adddirentry(handle, dir, dir, name);
+  }
+  syncdisk(handle);
+  double t = now();
+  for (int r = 0; r < rounds; r++) {
+    free(ls(handle, dir));
+  }
+  double lt = now() - t;
+  fprintf(out, "ls        %8d names  %8.0f names/ms\n",
+          BENCH_DIRENTS, BENCH_DIRENTS * (double) rounds / lt / 1e3);
+
+  closedisk(handle);
+  unlink(path);
+  free(data);
+  free(back);
+  return 0;
+}
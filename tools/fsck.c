@@ -0,0 +1,60 @@
+#include "../fsck.h"
+
+// Checks the filesystem on an image and optionally repairs it.
+//
+// Build from the top of the repository:
+//   gcc -O2 -pthread -o fsck tools/fsck.c bitmap.c blockCache.c dentryCache.c fsck.c fsHelpers.c fsStats.c fsTrace.c inodeCache.c ioEngine.c journal.c readAhead.c
+// Run:
+//   ./fsck image [check|repair] [threads]
+//
+// The image is mounted as it is, replaying its journal if it was not
+// closed cleanly, and then every inode in use and every directory is
+// checked with threads workers, one per processor by default.  The first
+// few problems of each kind are printed as they are found, then the
+// totals and how fast the image was read.  repair writes a rebuilt free
+// block bitmap and removes directory entries for inodes not in use;
+// blocks shared by two files are reported but left alone.
+//
+// The exit status follows the usual fsck convention: 0 if the image is
+// clean, 1 if problems were found and all of them fixed, 4 if problems
+// are left, 8 if the image could not be checked.
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s image [check|repair] [threads]\n", argv[0]);
+    return 8;
+  }
+  char *path = argv[1];
+  bool repair = argc > 2 && strcmp(argv[2], "repair") == 0;
+  int threads = argc > 3 ? atoi(argv[3]) : 0;
+
+  struct stat st;
+  if (stat(path, &st) < 0 || st.st_size < BLOCK_SIZE) {
+    fprintf(stderr, "no image at %s\n", path);
+    return 8;
+  }
+  int handle = opendisk(path, st.st_size);
+  if (handle < 0 || mountdisk(handle) < 0) {
+    fprintf(stderr, "%s holds no filesystem\n", path);
+    return 8;
+  }
+
+  struct fsckreport r;
+  int result = fsck(handle, threads, repair, &r);
+  closedisk(handle);
+  if (result < 0) {
+    fprintf(stderr, "could not check %s\n", path);
+    return 8;
+  }
+
+  uint64_t problems = r.leaked + r.unmarked + r.crosslinked + r.badextents + r.baddirs + r.dangling;
+  printf("%ld inodes, %ld directories, %ld blocks in use\n", r.inodes, r.directories, r.blocks);
+  printf("leaked %ld, unmarked %ld, cross-linked %ld, bad extents %ld, bad directories %ld, dangling entries %ld\n",
+         r.leaked, r.unmarked, r.crosslinked, r.badextents, r.baddirs, r.dangling);
+  printf("read %ld blocks in %.3f s (%.1f MiB/s), repaired %ld\n", r.blocksread, r.seconds,
+         r.seconds > 0 ? r.blocksread * (double) BLOCK_SIZE / (1 << 20) / r.seconds : 0, r.repaired);
+  if (problems == 0) {
+    return 0;
+  }
+  return r.repaired >= problems ? 1 : 4;
+}
@@ -0,0 +1,218 @@
+#include "../fsHelpers.h"
+#include "../fsStats.h"
+#include "../fsTrace.h"
+#include "../journal.h"
+
+// Plays back a trace recorded with tracestart() against a fresh image.
+//
+// Build from the top of the repository:
+//   gcc -O2 -pthread -o replay tools/replay.c bitmap.c blockCache.c dentryCache.c fsHelpers.c fsStats.c fsTrace.c inodeCache.c ioEngine.c journal.c readAhead.c
+// Run:
+//   ./replay trace [image] [fast|timed] [group|sync]
+//
+// The image is formatted with the size and inode count the trace was
+// recorded with, then the calls are made in the order they finished, one
+// at a time.  fast makes each call as soon as the last one returns; timed
+// waits until the call is as far into the replay as it was into the
+// recording, so idle time and bursts come out as they were.  Inode
+// numbers the replay hands out need not match the recorded ones, so
+// every inode a create returned is mapped to the one the replay got and
+// later calls are given that instead.  Writes get a fixed pattern of the
+// recorded size, as traces keep no file contents.  A call whose outcome
+// differs from the recorded one, one failing where the other did not or
+// a read or write moving a different number of bytes, counts as
+// diverged, which means the image the trace was taken on did not start
+// out empty or the filesystem now behaves differently.
+//
+// Output is a JSON object per kind of call and one for the whole replay:
+//   {"op":"write","count":5000,"errors":0,"avg_us":3.10,"p50_us":2.05,...}
+//   {"trace":"t.trace","mode":"fast","durability":"group","ops":20000,
+//    "diverged":0,"seconds":0.081,"ops_per_sec":246913}
+// The per-call latencies come from the counters in fsStats.c and are zero
+// if those were compiled out.  The exit status is non-zero if the trace
+// is damaged or any call diverged.
+
+struct replay {
+  int handle;
+  int64_t *map;             // inode the replay got for each recorded one, 0 for none yet
+  uint64_t nmap;
+  uint8_t *data;
+  uint64_t cap;
+};
+
+static uint64_t nsnow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the inode the replay uses for a recorded one
+static int64_t inodefor(struct replay *r, int64_t inode) {
+  if (inode > 0 && (uint64_t) inode < r->nmap && r->map[inode] != 0) {
+    return r->map[inode];
+  }
+  return inode;
+}
+
+static void remember(struct replay *r, int64_t recorded, int64_t got) {
+  if (recorded > 0 && (uint64_t) recorded < r->nmap && got > 0) {
+    r->map[recorded] = got;
+  }
+}
+
+// a buffer of at least size bytes for reads and writes
+static uint8_t* buffer(struct replay *r, uint64_t size) {
+  if (size > r->cap) {
+    free(r->data);
+    r->data = malloc(size);
+    r->cap = r->data != NULL ? size : 0;
+    for (uint64_t i = 0; i < r->cap; i++) {
+      r->data[i] = i * 131 + 7;
+    }
+  }
+  return r->data;
+}
+
+// makes the call rec describes; false if it came out differently
+static bool play(struct replay *r, struct tracerecord *rec) {
+  int64_t *a = rec->args;
+  int64_t want = a[rec->nargs - 1];
+  int64_t got = 0;
+  switch (rec->op) {
+  case TRACE_CREATE:
+    got = createfilein(r->handle, a[0], a[1], inodefor(r, a[2]));
+    remember(r, want, got);
+    break;
+  case TRACE_DELETE:
+    deletefile(r->handle, inodefor(r, a[0]));
+    return true;
+  case TRACE_READ:
+  case TRACE_WRITE: {
+    uint8_t *buf = buffer(r, a[2]);
+    if (buf == NULL) {
+      return false;
+    }
+    if (rec->op == TRACE_READ) {
+      got = readfileat(r->handle, inodefor(r, a[0]), buf, a[1], a[2]);
+    } else {
+      got = writefileat(r->handle, inodefor(r, a[0]), buf, a[1], a[2]);
+    }
+    return got == want;
+  }
+  case TRACE_ENLARGE:
+    got = enlargefile(r->handle, inodefor(r, a[0]), a[1]);
+    return got == want;
+  case TRACE_SHRINK:
+    got = shrinkfile(r->handle, inodefor(r, a[0]), a[1]);
+    return got == want;
+  case TRACE_PUNCH:
+    got = punchhole(r->handle, inodefor(r, a[0]), a[1], a[2]);
+    break;
+  case TRACE_MKDIR:
+    got = createdirectory(r->handle);
+    remember(r, want, got);
+    break;
+  case TRACE_RMDIR:
+    deletedirectory(r->handle, inodefor(r, a[0]));
+    return true;
+  case TRACE_LINK:
+    got = adddirentry(r->handle, inodefor(r, a[0]), inodefor(r, a[1]), rec->name);
+    break;
+  case TRACE_UNLINK:
+    got = removedirentry(r->handle, inodefor(r, a[0]), rec->name);
+    break;
+  case TRACE_LOOKUP:
+    got = findinodebyfilename(r->handle, inodefor(r, a[0]), rec->name);
+    return want < 0 ? got < 0 : got == inodefor(r, want);
+  case TRACE_PATH:
+    got = hierdirsearch(r->handle, rec->name, inodefor(r, a[0]));
+    return want < 0 ? got < 0 : got == inodefor(r, want);
+  case TRACE_SYNC:
+    got = syncdisk(r->handle);
+    break;
+  }
+  return (want < 0) == (got < 0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace [image] [fast|timed] [group|sync]\n", argv[0]);
+    return 1;
+  }
+  char *tracepath = argv[1];
+  char *path = argc > 2 ? argv[2] : "/tmp/replay.disk";
+  bool timed = argc > 3 && strcmp(argv[3], "timed") == 0;
+  bool sync = argc > 4 && strcmp(argv[4], "sync") == 0;
+
+  // the filesystem reports progress on stdout; keep the results apart
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+
+  struct traceheader hdr;
+  FILE *trace = traceopen(tracepath, &hdr);
+  if (trace == NULL) {
+    fprintf(stderr, "could not read trace %s\n", tracepath);
+    return 1;
+  }
+  unlink(path);
+  int handle = opendisk(path, hdr.disksize);
+  if (handle < 0 || diskformat(handle, hdr.disksize, hdr.ninodes) < 0) {
+    fprintf(stderr, "could not set up %s\n", path);
+    return 1;
+  }
+  setdurability(handle, sync ? DURABILITY_SYNC : DURABILITY_GROUP, 0, 0);
+
+  struct replay r = { .handle = handle, .nmap = hdr.disksize / BLOCK_SIZE };
+  r.map = calloc(r.nmap, sizeof(int64_t));
+  struct tracerecord *rec = calloc(1, sizeof(*rec));
+  uint64_t ops = 0;
+  uint64_t diverged = 0;
+  int more;
+  fsresetstats();
+  uint64_t start = nsnow();
+  while ((more = tracenext(trace, rec)) > 0) {
+    if (timed) {
+      uint64_t at = start + rec->time;
+      struct timespec ts = { .tv_sec = at / 1000000000ULL, .tv_nsec = at % 1000000000ULL };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+      }
+    }
+    if (!play(&r, rec)) {
+      diverged++;
+      fprintf(stderr, "diverged at call %ld (%s)\n", ops, traceopname(rec->op));
+    }
+    ops++;
+  }
+  syncdisk(handle);
+  double seconds = (nsnow() - start) / 1e9;
+  fclose(trace);
+  if (more < 0) {
+    fprintf(stderr, "trace %s is damaged after %ld calls\n", tracepath, ops);
+  }
+
+  struct fsstats s;
+  fsgetstats(&s);
+  for (int op = 0; op < OP_COUNT; op++) {
+    struct opstats *o = &s.ops[op];
+    if (o->count == 0) {
+      continue;
+    }
+    fprintf(out, "{\"op\":\"%s\",\"count\":%ld,\"errors\":%ld,\"avg_us\":%.2f,\"p50_us\":%.2f,"
+                 "\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+            statsopname(op), o->count, o->errors, o->totalns / 1e3 / o->count,
+            statspercentile(o, 0.50) / 1e3, statspercentile(o, 0.99) / 1e3,
+            statspercentile(o, 0.999) / 1e3, o->maxns / 1e3);
+  }
+  fprintf(out, "{\"trace\":\"%s\",\"mode\":\"%s\",\"durability\":\"%s\",\"ops\":%ld,\"diverged\":%ld,"
+               "\"seconds\":%.6f,\"ops_per_sec\":%.0f}\n",
+          tracepath, timed ? "timed" : "fast", sync ? "sync" : "group", ops, diverged, seconds,
+          seconds > 0 ? ops / seconds : 0);
+  fflush(out);
+
+  closedisk(handle);
+  unlink(path);
+  free(r.map);
+  free(r.data);
+  free(rec);
+  return more < 0 || diverged > 0 ? 1 : 0;
+}
@@ -0,0 +1,419 @@
+#include "../fsHelpers.h"
+#include "../bitmap.h"
+#include "../fsTrace.h"
+#include "../journal.h"
+
+// Workload suite: latency and throughput of single operations.
+//
+// Build from the top of the repository:
+//   gcc -O2 -pthread -o suite tools/suite.c bitmap.c blockCache.c dentryCache.c fsHelpers.c fsStats.c fsTrace.c inodeCache.c ioEngine.c journal.c readAhead.c
+// Run:
+//   ./suite [image] [files] [MiB] [group|sync] [workload] [trace]
+//
+// Every workload formats a fresh image, sets up what it needs without
+// timing it, then times each of its operations on its own.  files is the
+// number of operations in the metadata, small-file and lookup tests and
+// MiB the size of the file in the large-file tests.  The journal runs in
+// group commit mode unless sync is given, in which case every operation
+// also pays for its commit.  Naming a workload runs only the ones of that
+// name.  Given a trace file as well, every call a workload makes, set up
+// included, is recorded there for tools/replay.c to play back; each
+// workload starts the file afresh, so name the one wanted.
+//
+// Each workload prints one JSON object on a line of its own:
+//   {"workload":"dirlookup","param":4096,"durability":"group","ops":10000,
+//    "errors":0,"seconds":0.004,"ops_per_sec":2500000,"p50_us":0.3,...}
+// param is the fan-out or depth where the workload has one, and seconds
+// adds up the timed operations only.  The exit status is non-zero if any
+// operation failed, so a script can compare runs and stop on breakage.
+
+#define SUITE_SMALL_SIZE 4096       /* bytes in a small file */
+#define SUITE_CHUNK (64 << 10)      /* bytes per call in the sequential large-file tests */
+#define SUITE_RANDOM_IO 4096        /* bytes per call in the random large-file tests */
+#define SUITE_CONTIG_SPAN 1024      /* blocks the contiguous allocation test works in */
+
+struct run {
+  int handle;
+  uint64_t files;
+  uint64_t size;
+  uint64_t param;
+  uint64_t *lat;            // nanoseconds each timed operation took
+  uint64_t nops;
+  uint64_t cap;
+  uint64_t errors;
+  uint32_t rng;
+  uint8_t *data;
+  uint8_t *back;
+  int *inodes;
+  int dir;
+};
+
+struct workload {
+  const char *name;
+  uint64_t param;
+  void (*fn)(struct run *r);
+};
+
+static uint64_t nsnow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// records an operation that started at start
+static void record(struct run *r, uint64_t start) {
+  uint64_t took = nsnow() - start;
+  if (r->nops == r->cap) {
+    r->cap = r->cap > 0 ? r->cap * 2 : 4096;
+    r->lat = realloc(r->lat, r->cap * sizeof(uint64_t));
+    assert(r->lat != NULL);
+  }
+  r->lat[r->nops++] = took;
+}
+
+static uint32_t nextrand(struct run *r) {
+  r->rng = r->rng * 1103515245 + 12345;
+  return r->rng >> 8;
+}
+
+static uint64_t randomoffset(struct run *r) {
+  uint64_t blocks = r->size / SUITE_RANDOM_IO;
+  return ((uint64_t) nextrand(r) * nextrand(r) % blocks) * SUITE_RANDOM_IO;
+}
+
+// r->files files named f0, f1... in a new directory, each holding size
+// bytes; not timed
+static void makefiles(struct run *r, uint64_t size) {
+  r->dir = createdirectory(r->handle);
+  char name[DIRENT_NAME_LEN];
+  for (uint64_t i = 0; i < r->files; i++) {
+    snprintf(name, sizeof(name), "f%ld", i);
+    r->inodes[i] = createfilein(r->handle, 0, FILETYPE_REGULAR, r->dir);
+    r->errors += r->inodes[i] < 0 || adddirentry(r->handle, r->dir, r->inodes[i], name) < 0;
+    if (size > 0) {
+      r->errors += writetofile(r->handle, r->inodes[i], r->data, size) != (int) size;
+    }
+  }
+  syncdisk(r->handle);
+}
+
+// one file of r->size bytes; not timed
+static int makelargefile(struct run *r) {
+  int file = createfile(r->handle, 0, FILETYPE_REGULAR);
+  r->errors += file < 0 || writetofile(r->handle, file, r->data, r->size) != (int) r->size;
+  syncdisk(r->handle);
+  return file;
+}
+
+static void createfiles(struct run *r) {
+  r->dir = createdirectory(r->handle);
+  char name[DIRENT_NAME_LEN];
+  for (uint64_t i = 0; i < r->files; i++) {
+    snprintf(name, sizeof(name), "f%ld", i);
+    uint64_t t = nsnow();
+    int inode = createfilein(r->handle, 0, FILETYPE_REGULAR, r->dir);
+    r->errors += inode < 0 || adddirentry(r->handle, r->dir, inode, name) < 0;
+    record(r, t);
+  }
+}
+
+static void deletefiles(struct run *r) {
+  makefiles(r, 0);
+  char name[DIRENT_NAME_LEN];
+  for (uint64_t i = 0; i < r->files; i++) {
+    snprintf(name, sizeof(name), "f%ld", i);
+    uint64_t t = nsnow();
+    r->errors += removedirentry(r->handle, r->dir, name) < 0;
+    deletefile(r->handle, r->inodes[i]);
+    record(r, t);
+  }
+}
+
+static void smallwrite(struct run *r) {
+  makefiles(r, 0);
+  for (uint64_t i = 0; i < r->files; i++) {
+    uint64_t t = nsnow();
+    r->errors += writetofile(r->handle, r->inodes[i], r->data, SUITE_SMALL_SIZE) != SUITE_SMALL_SIZE;
+    record(r, t);
+  }
+}
+
+// param 0 reads the files in the order they were made, 1 in random order
+static void smallread(struct run *r) {
+  makefiles(r, SUITE_SMALL_SIZE);
+  for (uint64_t i = 0; i < r->files; i++) {
+    uint64_t k = r->param ? nextrand(r) % r->files : i;
+    uint64_t t = nsnow();
+    r->errors += readfile(r->handle, r->inodes[k], r->back, SUITE_SMALL_SIZE) != SUITE_SMALL_SIZE;
+    record(r, t);
+  }
+}
+
+static void largewrite(struct run *r) {
+  int file = createfile(r->handle, 0, FILETYPE_REGULAR);
+  for (uint64_t off = 0; off < r->size; off += SUITE_CHUNK) {
+    uint64_t t = nsnow();
+    r->errors += writefileat(r->handle, file, r->data + off, off, SUITE_CHUNK) != SUITE_CHUNK;
+    record(r, t);
+  }
+}
+
+static void largeread(struct run *r) {
+  int file = makelargefile(r);
+  for (uint64_t off = 0; off < r->size; off += SUITE_CHUNK) {
+    uint64_t t = nsnow();
+    r->errors += readfileat(r->handle, file, r->back + off, off, SUITE_CHUNK) != SUITE_CHUNK;
+    record(r, t);
+  }
+}
+
+static void randomwrite(struct run *r) {
+  int file = makelargefile(r);
+  for (uint64_t i = 0; i < r->size / SUITE_RANDOM_IO; i++) {
+    uint64_t off = randomoffset(r);
+    uint64_t t = nsnow();
+    r->errors += writefileat(r->handle, file, r->data + off, off, SUITE_RANDOM_IO) != SUITE_RANDOM_IO;
+    record(r, t);
+  }
+}
+
+static void randomread(struct run *r) {
+  int file = makelargefile(r);
+  for (uint64_t i = 0; i < r->size / SUITE_RANDOM_IO; i++) {
+    uint64_t off = randomoffset(r);
+    uint64_t t = nsnow();
+    r->errors += readfileat(r->handle, file, r->back, off, SUITE_RANDOM_IO) != SUITE_RANDOM_IO;
+    record(r, t);
+  }
+}
+
+// fills a new directory with param entries, all naming the directory itself
+static void dirinsert(struct run *r) {
+  r->dir = createdirectory(r->handle);
+  char name[DIRENT_NAME_LEN];
+  for (uint64_t i = 0; i < r->param; i++) {
+    snprintf(name, sizeof(name), "e%ld", i);
+    uint64_t t = nsnow();
+    r->errors += adddirentry(r->handle, r->dir, r->dir, name) < 0;
+    record(r, t);
+  }
+}
+
+// looks up random names in a directory of param entries
+static void dirlookup(struct run *r) {
+  r->dir = createdirectory(r->handle);
+  char name[DIRENT_NAME_LEN];
+  for (uint64_t i = 0; i < r->param; i++) {
+    snprintf(name, sizeof(name), "e%ld", i);
+    r->errors += adddirentry(r->handle, r->dir, r->dir, name) < 0;
+  }
+  syncdisk(r->handle);
+  for (uint64_t i = 0; i < r->files; i++) {
+    snprintf(name, sizeof(name), "e%ld", nextrand(r) % r->param);
+    uint64_t t = nsnow();
+    r->errors += findinodebyfilename(r->handle, r->dir, name) != r->dir;
+    record(r, t);
+  }
+}
+
+// resolves a path through param nested directories to a file at the bottom
+static void pathsearch(struct run *r) {
+  int root = createdirectory(r->handle);
+  char path[PATH_MAX] = "";
+  int dir = root;
+  for (uint64_t i = 0; i < r->param; i++) {
+    int sub = createdirectory(r->handle);
+    char name[DIRENT_NAME_LEN];
+    snprintf(name, sizeof(name), "d%ld", i);
+    r->errors += sub < 0 || adddirentry(r->handle, dir, sub, name) < 0;
+    strcat(path, name);
+    strcat(path, "/");
+    dir = sub;
+  }
+  int leaf = createfilein(r->handle, 0, FILETYPE_REGULAR, dir);
+  r->errors += leaf < 0 || adddirentry(r->handle, dir, leaf, "leaf") < 0;
+  strcat(path, "leaf");
+  syncdisk(r->handle);
+  for (uint64_t i = 0; i < r->files; i++) {
+    uint64_t t = nsnow();
+    r->errors += hierdirsearch(r->handle, path, root) != leaf;
+    record(r, t);
+  }
+}
+
+// looks up a name one character too long for a directory entry, then
+// the longest name there can be, which the first must not hide
+static void longname(struct run *r) {
+  r->dir = createdirectory(r->handle);
+  int file = createfilein(r->handle, 0, FILETYPE_REGULAR, r->dir);
+  char name[DIRENT_NAME_LEN + 1];
+  memset(name, 'n', DIRENT_NAME_LEN - 1);
+  name[DIRENT_NAME_LEN - 1] = '\0';
+  r->errors += file < 0 || adddirentry(r->handle, r->dir, file, name) < 0;
+  syncdisk(r->handle);
+  for (uint64_t i = 0; i < r->files; i++) {
+    uint64_t t = nsnow();
+    name[DIRENT_NAME_LEN - 1] = 'a' + i % 26;
+    name[DIRENT_NAME_LEN] = '\0';
+    r->errors += findinodebyfilename(r->handle, r->dir, name) != -1;
+    name[DIRENT_NAME_LEN - 1] = '\0';
+    r->errors += findinodebyfilename(r->handle, r->dir, name) != file;
+    r->errors += hierdirsearch(r->handle, name, r->dir) != file;
+    record(r, t);
+  }
+}
+
+// Claims exact runs of param blocks with bitmapalloccontig() in a span
+// of free blocks it sets up itself: every param-th block is used, so
+// only shorter runs exist and nothing may be claimed; then one used block
+// in front of the cursor is freed, and the run made there must be found
+// by wrapping past the cursor; then a run is asked for at a goal inside
+// it.  Everything is given back after each round.
+static void alloccontig(struct run *r) {
+  struct bitmapzone all = { 0, bitmapwords * 64, 0 };
+  uint64_t got;
+  uint64_t base = bitmapallocrun(&all, 0, SUITE_CONTIG_SPAN, &got);
+  if (got != SUITE_CONTIG_SPAN) {
+    r->errors++;
+    return;
+  }
+  bitmapfree(base, got);
+  uint64_t count = r->param;
+  for (uint64_t i = 0; i < r->files; i++) {
+    for (uint64_t n = count - 1; n < SUITE_CONTIG_SPAN; n += count) {
+      setbit(base + n);
+    }
+    struct bitmapzone zone = { base, base + SUITE_CONTIG_SPAN, base + SUITE_CONTIG_SPAN / 2 };
+    uint64_t before = bitmapcountfree(base, base + SUITE_CONTIG_SPAN);
+
+    uint64_t t = nsnow();
+    int64_t none = bitmapalloccontig(&zone, base, count);
+    clearbit(base + count - 1);
+    int64_t wrapped = bitmapalloccontig(&zone, 0, count);
+    record(r, t);
+    r->errors += none != -1;
+    r->errors += wrapped < (int64_t) base || wrapped + count > base + 2 * count - 1 ||
+                 bitmapcountfree(wrapped, wrapped + count) != 0 ||
+                 bitmapcountfree(base, base + SUITE_CONTIG_SPAN) != before + 1 - count;
+
+    bitmapfree(wrapped, count);
+    int64_t atgoal = bitmapalloccontig(&zone, base + 1, count);
+    r->errors += atgoal != (int64_t) base + 1;
+    r->errors += bitmapalloccontig(&zone, base, SUITE_CONTIG_SPAN) != -1;
+    bitmapfree(base, SUITE_CONTIG_SPAN);
+  }
+}
+
+static const struct workload workloads[] = {
+  { "create", 0, createfiles },
+  { "delete", 0, deletefiles },
+  { "smallwrite", 0, smallwrite },
+  { "smallread", 0, smallread },
+  { "smallread", 1, smallread },
+  { "largewrite", 0, largewrite },
+  { "largeread", 0, largeread },
+  { "randomwrite", 0, randomwrite },
+  { "randomread", 0, randomread },
+  { "dirinsert", 16, dirinsert },
+  { "dirinsert", 1024, dirinsert },
+  { "dirinsert", 65536, dirinsert },
+  { "dirlookup", 16, dirlookup },
+  { "dirlookup", 1024, dirlookup },
+  { "dirlookup", 65536, dirlookup },
+  { "pathsearch", 4, pathsearch },
+  { "pathsearch", 16, pathsearch },
+  { "pathsearch", 64, pathsearch },
+  { "longname", 0, longname },
+  { "alloccontig", 16, alloccontig },
+};
+
+static int compareu64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// latency below which the fraction q of the operations finished, in microseconds
+static double percentile(struct run *r, double q) {
+  if (r->nops == 0) {
+    return 0;
+  }
+  uint64_t i = q * r->nops;
+  return r->lat[i < r->nops ? i : r->nops - 1] / 1e3;
+}
+
+int main(int argc, char **argv) {
+  char *path = argc > 1 ? argv[1] : "/tmp/suite.disk";
+  uint64_t files = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000;
+  uint64_t mib = argc > 3 ? strtoull(argv[3], NULL, 10) : 64;
+  bool sync = argc > 4 && strcmp(argv[4], "sync") == 0;
+  char *only = argc > 5 ? argv[5] : NULL;
+  char *tracepath = argc > 6 ? argv[6] : NULL;
+  if (files == 0 || mib == 0) {
+    fprintf(stderr, "files and MiB must be at least 1\n");
+    return 1;
+  }
+
+  // the filesystem reports progress on stdout; keep the results apart
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+
+  // room for every small file and its inode, the large file twice over,
+  // and the biggest directory
+  uint64_t size = mib << 20;
+  uint64_t disksize = files * (SUITE_SMALL_SIZE + 2 * BLOCK_SIZE) + 2 * size + (64 << 20);
+  uint8_t *data = malloc(size);
+  uint8_t *back = malloc(size);
+  int *inodes = malloc(files * sizeof(int));
+  for (uint64_t i = 0; i < size; i++) {
+    data[i] = i * 131 + 7;
+  }
+
+  uint64_t failed = 0;
+  for (uint64_t w = 0; w < countof(workloads); w++) {
+    const struct workload *wl = &workloads[w];
+    if (only != NULL && strcmp(only, wl->name) != 0) {
+      continue;
+    }
+    unlink(path);
+    int handle = opendisk(path, disksize);
+    if (handle < 0 || diskformat(handle, disksize, files + 1024) < 0) {
+      fprintf(stderr, "could not set up %s\n", path);
+      return 1;
+    }
+    setdurability(handle, sync ? DURABILITY_SYNC : DURABILITY_GROUP, 0, 0);
+    if (tracepath != NULL && tracestart(tracepath, disksize, files + 1024) < 0) {
+      fprintf(stderr, "could not record %s\n", tracepath);
+      return 1;
+    }
+
+    struct run r = { .handle = handle, .files = files, .size = size, .param = wl->param,
+                     .rng = 12345 + w, .data = data, .back = back, .inodes = inodes };
+    wl->fn(&r);
+    syncdisk(handle);
+    if (tracepath != NULL) {
+      tracestop();
+    }
+    closedisk(handle);
+
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < r.nops; i++) {
+      total += r.lat[i];
+    }
+    qsort(r.lat, r.nops, sizeof(uint64_t), compareu64);
+    double seconds = total / 1e9;
+    fprintf(out, "{\"workload\":\"%s\",\"param\":%ld,\"durability\":\"%s\",\"ops\":%ld,\"errors\":%ld,"
+                 "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f}\n",
+            wl->name, wl->param, sync ? "sync" : "group", r.nops, r.errors, seconds,
+            seconds > 0 ? r.nops / seconds : 0, percentile(&r, 0.50), percentile(&r, 0.99), percentile(&r, 0.999));
+    fflush(out);
+    failed += r.errors;
+    free(r.lat);
+  }
+
+  unlink(path);
+  free(data);
+  free(back);
+  free(inodes);
+  return failed == 0 ? 0 : 1;
+}